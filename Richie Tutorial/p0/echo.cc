@@ -6,11 +6,124 @@
  * a file, and '<file' to redirect stdin to a file), it is possible to use this
  * program to stream keystrokes to a file, or to display an existing file
  * similar to the 'cat' command.
+ *
+ * By default, echo copies with fgets() and printf(), a few bytes at a time.
+ * The -f flag switches to a fast path for using echo as a pipeline
+ * passthrough: splice() when stdin or stdout is a pipe, so the data never
+ * enters this process, and otherwise big read() and write() calls.  With -c,
+ * echo also counts lines and bytes as they go by, using a SIMD newline
+ * counter.  -B runs a built-in benchmark of all of these paths.
  */
 
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <errno.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <libgen.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/** The default size of the fast path's buffer */
+const size_t FAST_BUFSIZE = 1 << 20;
+
+/** The size we ask for when we can resize a pipe (the default is 64KB) */
+const int PIPE_SIZE = 1 << 20;
+
+/**
+ * Display a help message to explain how the command-line parameters for this
+ * program work
+ *
+ * @progname The name of the program
+ */
+void usage(char *progname) {
+  printf("%s: Copy stdin to stdout.\n", basename(progname));
+  printf("  -f       Fast mode: splice when stdin or stdout is a pipe, else "
+         "large read/write\n");
+  printf("  -c       Count lines and bytes on the way through (implies -f), "
+         "and print them to stderr\n");
+  printf("  -s [int] Buffer size for fast mode's read/write (default 1MB)\n");
+  printf("  -k [str] Newline counter: auto (default), scalar, avx2, avx512\n");
+  printf("  -B [int] Benchmark every copy path on this many MB of text, "
+         "through pipes\n");
+  printf("  -h       Print help (this message)\n");
+}
+
+/** arg_t is used to store the command-line arguments of the program */
+struct arg_t {
+  /** Use the fast path? */
+  bool fast = false;
+
+  /** Count lines and bytes? */
+  bool count = false;
+
+  /** The size of the fast path's buffer */
+  size_t bufsize = FAST_BUFSIZE;
+
+  /** The newline counter to use */
+  std::string kernel = "auto";
 
-int main() {
+  /** Megabytes of text for the benchmark (0 for no benchmark) */
+  size_t bench_mb = 0;
+
+  /** Display a usage message? */
+  bool usage = false;
+};
+
+/**
+ * Parse the command-line arguments, and use them to populate the provided args
+ * object.
+ *
+ * @param argc The number of command-line arguments passed to the program
+ * @param argv The list of command-line arguments
+ * @param args The struct into which the parsed args should go
+ */
+void parse_args(int argc, char **argv, arg_t &args) {
+  long opt;
+  while ((opt = getopt(argc, argv, "fcs:k:B:h")) != -1) {
+    switch (opt) {
+    case 'f':
+      args.fast = true;
+      break;
+    case 'c':
+      args.fast = true;
+      args.count = true;
+      break;
+    case 's':
+      args.bufsize = strtoul(optarg, nullptr, 10);
+      // NB: a read() of 0 bytes returns 0, which would look like EOF
+      if (args.bufsize == 0) {
+        fprintf(stderr, "Invalid buffer size for -s: %s\n", optarg);
+        exit(0);
+      }
+      break;
+    case 'k':
+      args.kernel = std::string(optarg);
+      break;
+    case 'B':
+      args.bench_mb = strtoul(optarg, nullptr, 10);
+      break;
+    case 'h':
+      args.usage = true;
+      break;
+    }
+  }
+}
+
+/**
+ * The original echo: copy `in` to `out` with fgets() and printf()
+ *
+ * @param in  The stream to read
+ * @param out The stream to write
+ */
+void echo_stdio(FILE *in, FILE *out) {
   // we will read data into this space on the stack  It can be any size, but
   // we'll do 16 bytes at a time.
   char buffer[16];
@@ -31,12 +144,375 @@ int main() {
   // NB: We should be paying attention to errors from fgets, but in this program
   //     we don't.  This program represents the last time we are allowed to
   //     ignore errors in this tutorial series.
-  while (fgets(buffer, sizeof(buffer), stdin)) {
+  while (fgets(buffer, sizeof(buffer), in)) {
     // NB: This version of printf is effectively 'fputs(buffer, stdout)'
     //
     // NB: We are ignoring the return value from printf().  The tutorial series
     //     will limit uses of printf(), so that we can always ignore printf()
     //     errors.
-    printf("%s", buffer);
+    fprintf(out, "%s", buffer);
+  }
+  fflush(out);
+}
+
+/** Count the newlines in a buffer, one byte at a time */
+size_t scalar_count_newlines(const char *buf, size_t len) {
+  size_t count = 0;
+  for (size_t i = 0; i < len; ++i)
+    count += buf[i] == '\n';
+  return count;
+}
+
+/**
+ * Count the newlines in a buffer, 32 bytes at a time.  Each compare makes a
+ * byte of 0xFF (-1) for every newline, so subtracting the compare results
+ * counts newlines in 32 byte-sized counters at once.  Every 255 rounds, before
+ * a counter can overflow, _mm256_sad_epu8 adds the counters up.
+ */
+__attribute__((target("avx2"))) size_t avx2_count_newlines(const char *buf,
+                                                           size_t len) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i zero = _mm256_setzero_si256();
+  size_t count = 0, i = 0;
+  while (i + 32 <= len) {
+    __m256i acc = zero;
+    for (int round = 0; round < 255 && i + 32 <= len; ++round, i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+    }
+    __m256i sums = _mm256_sad_epu8(acc, zero);
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+             _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return count + scalar_count_newlines(buf + i, len - i);
+}
+
+/** Count the newlines in a buffer, 64 bytes at a time, with compare masks */
+__attribute__((target("avx512bw,popcnt"))) size_t
+avx512_count_newlines(const char *buf, size_t len) {
+  const __m512i nl = _mm512_set1_epi8('\n');
+  size_t count = 0, i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m512i v = _mm512_loadu_si512((const void *)(buf + i));
+    count += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(v, nl));
+  }
+  return count + scalar_count_newlines(buf + i, len - i);
+}
+
+/** The type of a newline counter */
+typedef size_t (*count_fn_t)(const char *, size_t);
+
+/**
+ * Choose the newline counter to use
+ *
+ * @param name "auto" for the best counter this CPU supports, or the name of
+ *             an instruction set
+ *
+ * @return The counter
+ */
+count_fn_t pick_counter(const std::string &name) {
+  bool avx512 = __builtin_cpu_supports("avx512bw");
+  bool avx2 = __builtin_cpu_supports("avx2");
+  if (name == "auto")
+    return avx512 ? avx512_count_newlines
+           : avx2 ? avx2_count_newlines
+                  : scalar_count_newlines;
+  if (name == "scalar")
+    return scalar_count_newlines;
+  if (name == "avx2" && avx2)
+    return avx2_count_newlines;
+  if (name == "avx512" && avx512)
+    return avx512_count_newlines;
+  fprintf(stderr, "Counter %s is unknown or not supported by this CPU\n",
+          name.c_str());
+  exit(0);
+}
+
+/** The number of lines and bytes that went by */
+struct counts_t {
+  /** The number of newlines */
+  uint64_t lines = 0;
+
+  /** The number of bytes */
+  uint64_t bytes = 0;
+};
+
+/**
+ * Write all of a buffer, even if write() only takes part of it at a time
+ *
+ * @return false on error
+ */
+bool write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, buf, len);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return false;
+    buf += w;
+    len -= w;
   }
+  return true;
+}
+
+/** Return true if fd is a pipe, and try to make the pipe bigger */
+bool is_pipe(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+    return false;
+  // NB: a bigger pipe means fewer, bigger splices.  It's OK if we can't.
+  fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+  return true;
+}
+
+/**
+ * Copy `in` to `out` with big read() and write() calls, counting newlines
+ * along the way if requested
+ *
+ * @param in      The file descriptor to read
+ * @param out     The file descriptor to write
+ * @param bufsize The size of the buffer
+ * @param counter The newline counter, or nullptr to skip counting
+ * @param counts  The counts to update
+ *
+ * @return false on error
+ */
+bool echo_rw(int in, int out, size_t bufsize, count_fn_t counter,
+             counts_t &counts) {
+  std::vector<char> buf(bufsize);
+  while (true) {
+    ssize_t n = read(in, buf.data(), bufsize);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("read");
+      return false;
+    }
+    if (n == 0)
+      return true;
+    if (counter != nullptr)
+      counts.lines += counter(buf.data(), n);
+    counts.bytes += n;
+    if (!write_all(out, buf.data(), n)) {
+      perror("write");
+      return false;
+    }
+  }
+}
+
+/**
+ * Copy `in` to `out` with splice(), which moves pages between the kernel's
+ * pipe buffers instead of copying through this process.  One of the two must
+ * be a pipe.
+ *
+ * @param in     The file descriptor to read
+ * @param out    The file descriptor to write
+ * @param counts The counts to update (bytes only)
+ * @param copied Set to true once any data has moved, so that the caller knows
+ *               whether a failure can still fall back to read/write
+ *
+ * @return false on error
+ */
+bool echo_splice(int in, int out, counts_t &counts, bool &copied) {
+  while (true) {
+    ssize_t n = splice(in, nullptr, out, nullptr, PIPE_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    if (n == 0)
+      return true;
+    copied = true;
+    counts.bytes += n;
+  }
+}
+
+/**
+ * Copy `in` to `out`, when both are pipes, while counting newlines.  tee()
+ * copies the data in the input pipe to the output pipe without reading it, so
+ * the output still doesn't pass through this process.  Then we read() the
+ * same bytes out of the input pipe to count them.
+ *
+ * @param in      The pipe to read
+ * @param out     The pipe to write
+ * @param bufsize The size of the counting buffer
+ * @param counter The newline counter
+ * @param counts  The counts to update
+ * @param copied  Set to true once any data has moved
+ *
+ * @return false on error
+ */
+bool echo_tee(int in, int out, size_t bufsize, count_fn_t counter,
+              counts_t &counts, bool &copied) {
+  std::vector<char> buf(bufsize);
+  while (true) {
+    ssize_t n = tee(in, out, bufsize, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    if (n == 0)
+      return true;
+    copied = true;
+    // Consume (and count) exactly the bytes that tee() passed on
+    for (ssize_t left = n; left > 0;) {
+      ssize_t r = read(in, buf.data(), left);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0) {
+        perror("read");
+        return false;
+      }
+      counts.lines += counter(buf.data(), r);
+      left -= r;
+    }
+    counts.bytes += n;
+  }
+}
+
+/**
+ * The fast path: pick the cheapest way to copy `in` to `out`
+ *
+ * @param args   The arguments to the program
+ * @param in     The file descriptor to read
+ * @param out    The file descriptor to write
+ * @param counts The counts (lines are only counted with -c)
+ *
+ * @return false on error
+ */
+bool echo_fast(arg_t &args, int in, int out, counts_t &counts) {
+  count_fn_t counter = args.count ? pick_counter(args.kernel) : nullptr;
+  bool in_pipe = is_pipe(in), out_pipe = is_pipe(out);
+  bool copied = false;
+  // NB: splice and tee refuse some files (for example, ones opened with
+  //     O_APPEND).  If they fail before moving any data, use read/write.
+  if (!args.count && (in_pipe || out_pipe)) {
+    if (echo_splice(in, out, counts, copied))
+      return true;
+    if (copied) {
+      perror("splice");
+      return false;
+    }
+  } else if (args.count && in_pipe && out_pipe) {
+    if (echo_tee(in, out, args.bufsize, counter, counts, copied))
+      return true;
+    if (copied) {
+      perror("tee");
+      return false;
+    }
+  }
+  return echo_rw(in, out, args.bufsize, counter, counts);
+}
+
+/**
+ * Benchmark every copy path in the same setting: a thread writes `mb`
+ * megabytes of text into one pipe, the path copies that pipe to a second pipe,
+ * and another thread drains the second pipe.  That is what echo sees in the
+ * middle of a shell pipeline.
+ *
+ * @param args The arguments to the program
+ */
+void run_benchmark(arg_t &args) {
+  using namespace std::chrono;
+  // Make lines of random lengths (0 to 120 characters) of printable text
+  std::vector<char> text(args.bench_mb << 20);
+  uint64_t expected_lines = 0;
+  unsigned seed = 1;
+  for (size_t i = 0; i < text.size();) {
+    size_t len = rand_r(&seed) % 121;
+    for (size_t j = 0; j < len && i < text.size(); ++j)
+      text[i++] = 'a' + rand_r(&seed) % 26;
+    if (i < text.size()) {
+      text[i++] = '\n';
+      ++expected_lines;
+    }
+  }
+
+  struct path_t {
+    const char *name;
+    bool stdio, fast, count;
+    const char *kernel;
+  };
+  const path_t paths[] = {{"stdio (fgets/printf)", true, false, false, ""},
+                          {"fast (splice)", false, true, false, ""},
+                          {"fast, count (tee, scalar)", false, true, true,
+                           "scalar"},
+                          {"fast, count (tee, auto)", false, true, true,
+                           "auto"}};
+  printf("path, seconds, GB/s, lines, bytes\n");
+  for (auto &p : paths) {
+    int src[2], dst[2];
+    if (pipe(src) != 0 || pipe(dst) != 0) {
+      perror("pipe");
+      exit(0);
+    }
+    std::atomic<uint64_t> drained(0);
+    std::thread feeder([&]() {
+      is_pipe(src[1]);
+      write_all(src[1], text.data(), text.size());
+      close(src[1]);
+    });
+    std::thread drainer([&]() {
+      std::vector<char> buf(FAST_BUFSIZE);
+      ssize_t n;
+      uint64_t total = 0;
+      while ((n = read(dst[0], buf.data(), buf.size())) > 0)
+        total += n;
+      drained = total;
+      close(dst[0]);
+    });
+    arg_t a = args;
+    a.fast = p.fast;
+    a.count = p.count;
+    a.kernel = p.kernel;
+    counts_t counts;
+    high_resolution_clock::time_point t1 = high_resolution_clock::now();
+    if (p.stdio) {
+      FILE *in = fdopen(src[0], "r"), *out = fdopen(dst[1], "w");
+      echo_stdio(in, out);
+      fclose(in);
+      fclose(out);
+    } else {
+      echo_fast(a, src[0], dst[1], counts);
+      close(src[0]);
+      close(dst[1]);
+    }
+    feeder.join();
+    drainer.join();
+    high_resolution_clock::time_point t2 = high_resolution_clock::now();
+    double secs = duration_cast<duration<double>>(t2 - t1).count();
+    printf("%s, %lf, %lf, %lu, %lu\n", p.name, secs,
+           drained.load() / secs / 1e9, counts.lines, drained.load());
+    if (drained != text.size() || (p.count && counts.lines != expected_lines))
+      printf("Error: expected %lu lines, %zu bytes\n", expected_lines,
+             text.size());
+  }
+}
+
+int main(int argc, char **argv) {
+  arg_t args;
+  parse_args(argc, argv, args);
+
+  // if help was requested, give help, then quit
+  if (args.usage) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  if (args.bench_mb > 0) {
+    run_benchmark(args);
+    return 0;
+  }
+
+  if (!args.fast) {
+    echo_stdio(stdin, stdout);
+    return 0;
+  }
+
+  counts_t counts;
+  bool ok = echo_fast(args, STDIN_FILENO, STDOUT_FILENO, counts);
+  if (args.count)
+    fprintf(stderr, "%lu %lu\n", counts.lines, counts.bytes);
+  return ok ? 0 : 1;
 }
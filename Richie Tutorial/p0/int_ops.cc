@@ -3,22 +3,101 @@
  *
  * Int_ops demonstrates a few basic operations on an array of integers:
  * - creating integer arrays from a deterministic pseudo-random number
- *   generator.
- * - printing (text or binary)
- * - searching (linear or binary)
- * - sorting (via the C qsort() function)
+ *   generator (serial rand_r(), or a counter-based generator that runs on many
+ *   threads).
+ * - streaming over data that doesn't fit in memory: statistics, top-k,
+ *   quantiles, scans, and an external merge sort
+ * - allocating arrays with huge pages, and with their pages interleaved
+ *   across NUMA nodes or placed by the threads that will use them
+ * - printing (text or binary), or saving to a file with a header that can be
+ *   memory-mapped by a later run
+ * - searching (linear, with SIMD kernels for counting, finding every match,
+ *   and finding several keys at once; binary; or through a cache-friendly Eytzinger index that
+ *   answers big batches of queries)
+ * - sorting (via the C qsort() function, C++ std::sort(), or a radix sort that
+ *   can run on many threads)
  *
  * NB: running this program with the -b flag and some nice large -n value is a
- *     good way to create binary data files for subsequent tutorials.
+ *     good way to create binary data files for subsequent tutorials.  Use -o
+ *     instead of -b to make a file that -i can reload in a few milliseconds.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
 #include <errno.h>
+#include <fcntl.h>
+#include <immintrin.h>
 #include <libgen.h>
+#include <linux/mempolicy.h>
+#include <linux/mman.h>
+#include <memory>
+#include <queue>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
 #include <unistd.h>
 #include <utility>
+#include <vector>
+
+/** number of bits sorted by each pass of radix sort */
+const int RADIX_BITS = 8;
+
+/** number of buckets in each pass of radix sort */
+const int RADIX_BUCKETS = 1 << RADIX_BITS;
+
+/** each thread of a parallel array generation gets at least this many elements */
+const size_t GENERATE_SLICE_MIN = 1 << 20;
+
+/** size of a normal page */
+const size_t PAGE_SIZE_4K = 1ul << 12;
+
+/** size of a 2MB huge page */
+const size_t PAGE_SIZE_2M = 1ul << 21;
+
+/** size of a 1GB huge page */
+const size_t PAGE_SIZE_1G = 1ul << 30;
+
+/** magic number at the start of every array file */
+const char ARRAY_MAGIC[8] = {'I', 'N', 'T', 'O', 'P', 'S', '1', '\0'};
+
+/** flag in an array file's header that says the array is sorted */
+const uint32_t ARRAY_SORTED = 1;
+
+/** arrays smaller than this aren't worth radix sorting, or splitting up */
+const size_t RADIX_MIN = 1 << 16;
+
+/** size of a cache line, in bytes */
+const size_t CACHE_LINE = 64;
+
+/** number of queries that a batched index search runs in lockstep */
+const size_t SEARCH_BATCH = 32;
+
+/** linear search benchmarks stop after this many total element comparisons */
+const size_t LINEAR_BUDGET = 1ul << 30;
+
+/** the most keys that a multi-key scan can look for at once */
+const size_t MAX_SCAN_KEYS = 16;
+
+/** each thread of a parallel scan gets at least this many elements */
+const size_t SCAN_SLICE_MIN = 1 << 20;
+
+/** parallel find-first scans check whether to give up after each block */
+const size_t SCAN_BLOCK = 1 << 16;
+
+/**
+ * the most runs an external sort merges at once.  Each open run is a file
+ * descriptor, and runs are merged in levels (MAX_MERGE_FANIN spilled runs
+ * become one level-1 run, and so on), so this keeps the number of open runs
+ * well under the usual 1024-descriptor limit, even for millions of chunks.
+ */
+const size_t MAX_MERGE_FANIN = 128;
 
 /**
  * Display a help message to explain how the command-line parameters for this
@@ -31,9 +110,42 @@ void usage(char *progname) {
          basename(progname));
   printf("  -n [int] Number of integers to put into an array\n");
   printf("  -r [int] Random seed to use when generating integers\n");
+  printf("  -G       Generate integers on many threads, with a counter-based "
+         "PRNG\n");
+  printf("  -i [str] Load (mmap) the array from a file made with -o, instead "
+         "of generating it\n");
+  printf("  -o [str] Save the array (after sorting) to a file, for use with "
+         "-i\n");
+  printf("  -P [str] Page type for big arrays: malloc (default), thp, 2mb, "
+         "1gb\n");
+  printf("  -N [str] NUMA placement: none (default), interleave, local (per "
+         "thread slice)\n");
+  printf("  -S [str] Stream a file made with -o or -b ('-' for stdin) in "
+         "chunks,\n"
+         "           reporting statistics (works with -l/-c/-L/-m/-K/-E)\n");
+  printf("  -C [int] Number of integers per chunk for -S (default 16M)\n");
+  printf("  -K [int] With -S, report the k largest integers\n");
+  printf("  -E [str] With -S, external-sort the stream into a file ('-' for "
+         "stdout)\n");
+  printf("  -D [str] Directory for -E's sorted runs (default /tmp)\n");
   printf("  -s       Sort the integer array?\n");
+  printf("  -a [str] Sort algorithm: qsort (default), std, radix, parallel\n");
+  printf("  -t [int] Number of threads for the parallel sort (default #cores)\n");
+  printf("  -T       Report the time taken to create, sort and scan (on "
+         "stderr)\n");
   printf("  -f [int] Find an integer in the array using binary search\n");
   printf("  -l [int] Find an integer in the array using linear search\n");
+  printf("  -c [int] Count the occurrences of an integer in the array\n");
+  printf("  -L [int] Find every occurrence of an integer in the array\n");
+  printf("  -m [list] Find each of several comma-separated integers in one "
+         "pass\n");
+  printf("  -k [str] Scan kernel for -l/-c/-L/-m: auto (default), scalar, avx2, "
+         "avx512\n");
+  printf("  -q [str] Look up every key in a binary file of unsigned ints ('-' "
+         "for stdin)\n");
+  printf("  -Q [int] Look up this many pseudo-random keys\n");
+  printf("  -x [str] Search method for -q/-Q: linear, binary, eytzinger, batch, "
+         "or all (default)\n");
   printf("  -p       Print the array as text, with one int per line\n");
   printf("  -b       Print the array as binary\n");
   printf("  -h       Print help (this message)\n");
@@ -42,20 +154,80 @@ void usage(char *progname) {
 /** arg_t is used to store the command-line arguments of the program */
 struct arg_t {
   /** The number of random elements to put into the array */
-  unsigned num = 16;
+  size_t num = 16;
 
   /** A random seed to use when generating elements to put into the array */
   unsigned seed = 0;
 
+  /** Generate the array with the parallel counter-based generator? */
+  bool parallel_generate = false;
+
+  /** File from which to load the array */
+  std::string infile;
+
+  /** File to which to save the array */
+  std::string outfile;
+
+  /** File to stream through, instead of making an array */
+  std::string streamfile;
+
+  /** The number of integers per chunk when streaming */
+  size_t chunk = 1 << 24;
+
+  /** The number of largest integers to report when streaming */
+  size_t topk = 0;
+
+  /** File into which to external-sort the stream */
+  std::string sortfile;
+
+  /** Directory for the sorted runs of an external sort */
+  std::string spilldir = "/tmp";
+
+  /** The type of pages to allocate arrays with */
+  std::string pages = "malloc";
+
+  /** How to place array pages on NUMA nodes */
+  std::string numa = "none";
+
   /** Sort the array? */
   bool sort = false;
 
+  /** The sort algorithm to use */
+  std::string algorithm = "qsort";
+
+  /** The number of threads for the parallel sort */
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+  /** Report the time taken to create, sort and scan? */
+  bool timing = false;
+
   /** Key to use for a binary search in the array */
   std::pair<bool, unsigned> bskey = {false, 0};
 
   /** Key to use for a linear search in the array */
   std::pair<bool, unsigned> lskey = {false, 0};
 
+  /** Key to count in the array */
+  std::pair<bool, unsigned> countkey = {false, 0};
+
+  /** Key to find every occurrence of */
+  std::pair<bool, unsigned> allkey = {false, 0};
+
+  /** Keys to find in one pass */
+  std::vector<unsigned> multikeys;
+
+  /** The scan kernels to use */
+  std::string kernel = "auto";
+
+  /** File of keys to look up */
+  std::string queryfile;
+
+  /** Number of random keys to look up */
+  size_t num_queries = 0;
+
+  /** Search method for looking up many keys */
+  std::string method = "all";
+
   /** Print the array as text? */
   bool printtext = false;
 
@@ -76,23 +248,105 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "n:r:sf:l:pbh")) != -1) {
+  while ((opt = getopt(argc, argv, "n:r:Gi:o:P:N:S:C:K:E:D:sa:t:Tf:l:c:L:m:k:q:Q:x:pbh")) != -1) {
     switch (opt) {
     case 'n':
-      args.num = atoi(optarg);
+      // NB: arrays can have billions of elements, so atoi() isn't enough
+      args.num = strtoull(optarg, nullptr, 10);
       break;
     case 'r':
       args.seed = atoi(optarg);
       break;
+    case 'G':
+      args.parallel_generate = true;
+      break;
+    case 'i':
+      args.infile = std::string(optarg);
+      break;
+    case 'o':
+      args.outfile = std::string(optarg);
+      break;
+    case 'S':
+      args.streamfile = std::string(optarg);
+      break;
+    case 'C':
+      args.chunk = strtoull(optarg, nullptr, 10);
+      break;
+    case 'K':
+      args.topk = strtoull(optarg, nullptr, 10);
+      break;
+    case 'E':
+      args.sortfile = std::string(optarg);
+      break;
+    case 'D':
+      args.spilldir = std::string(optarg);
+      break;
+    case 'P':
+      args.pages = std::string(optarg);
+      break;
+    case 'N':
+      args.numa = std::string(optarg);
+      break;
     case 's':
       args.sort = true;
       break;
+    case 'a':
+      args.algorithm = std::string(optarg);
+      break;
+    case 't':
+      args.threads = std::max(1, atoi(optarg));
+      break;
+    case 'T':
+      args.timing = true;
+      break;
     case 'f':
       // NB: C++ pair objects are a convenient way to store a tuple :)
-      args.bskey = std::make_pair(true, atoi(optarg));
+      args.bskey = std::make_pair(true, (unsigned)strtoul(optarg, nullptr, 10));
       break;
     case 'l':
-      args.lskey = std::make_pair(true, atoi(optarg));
+      args.lskey = std::make_pair(true, (unsigned)strtoul(optarg, nullptr, 10));
+      break;
+    case 'c':
+      args.countkey =
+          std::make_pair(true, (unsigned)strtoul(optarg, nullptr, 10));
+      break;
+    case 'L':
+      args.allkey = std::make_pair(true, (unsigned)strtoul(optarg, nullptr, 10));
+      break;
+    case 'm': {
+      // NB: each key must be a number followed by ',' or the end of the list,
+      //     so "1a2" and "1,,2" are errors instead of a hang or a bogus 0
+      const char *pos = optarg;
+      while (true) {
+        char *next;
+        unsigned long key = strtoul(pos, &next, 10);
+        if (next == pos || (*next != ',' && *next != '\0')) {
+          fprintf(stderr, "Invalid key list for -m: %s\n", optarg);
+          exit(0);
+        }
+        if (args.multikeys.size() == MAX_SCAN_KEYS) {
+          fprintf(stderr, "At most %zu keys can be given to -m\n",
+                  MAX_SCAN_KEYS);
+          exit(0);
+        }
+        args.multikeys.push_back(key);
+        if (*next == '\0')
+          break;
+        pos = next + 1;
+      }
+      break;
+    }
+    case 'k':
+      args.kernel = std::string(optarg);
+      break;
+    case 'q':
+      args.queryfile = std::string(optarg);
+      break;
+    case 'Q':
+      args.num_queries = strtoull(optarg, nullptr, 10);
+      break;
+    case 'x':
+      args.method = std::string(optarg);
       break;
     case 'p':
       args.printtext = true;
@@ -107,27 +361,334 @@ void parse_args(int argc, char **argv, arg_t &args) {
   }
 }
 
+/**
+ * alloc_policy_t describes how to allocate big arrays (the array itself, and
+ * the scratch space for radix sorts)
+ */
+struct alloc_policy_t {
+  /**
+   * The type of pages: "malloc" for whatever malloc() does, "thp" to ask for
+   * transparent huge pages, or "2mb"/"1gb" for reserved (hugetlbfs) pages
+   */
+  std::string pages = "malloc";
+
+  /**
+   * The NUMA placement: "none" for the kernel's default (the node of the
+   * thread that first touches each page), "interleave" to spread pages
+   * round-robin across all nodes, or "local" to have each of `threads` threads
+   * touch its own slice of the array first
+   */
+  std::string numa = "none";
+
+  /** The number of threads that will work on the array */
+  unsigned threads = 1;
+};
+
+/**
+ * Get the bit mask of online NUMA nodes
+ *
+ * @return A bit mask with one bit per online node (just node 0 if the mask
+ *         can't be read)
+ */
+unsigned long numa_node_mask() {
+  unsigned long mask = 0;
+  FILE *f = fopen("/sys/devices/system/node/online", "r");
+  if (f != nullptr) {
+    // The file holds ranges, like "0-3,6"
+    unsigned lo, hi;
+    int got;
+    while ((got = fscanf(f, "%u-%u", &lo, &hi)) >= 1) {
+      if (got == 1)
+        hi = lo;
+      for (unsigned n = lo; n <= hi && n < 64; ++n)
+        mask |= 1ul << n;
+      if (fgetc(f) != ',')
+        break;
+    }
+    fclose(f);
+  }
+  return mask ? mask : 1;
+}
+
+/**
+ * Allocate an array of unsigned integers according to a policy.  The default
+ * policy just uses malloc().  Every other policy uses mmap(), so that it can
+ * control the type of pages and where they go:
+ * - with huge pages, one TLB entry covers 2MB (or 1GB) instead of 4KB, so
+ *   random accesses to a multi-GB array (e.g., search, or the scatter step of
+ *   radix sort) rarely miss in the TLB
+ * - with "interleave", the memory bandwidth of every node is used
+ * - with "local", each thread's slice is on that thread's node, as long as
+ *   the threads that later work on the array use the same slices
+ *
+ * NB: reserved huge pages must be set up ahead of time (e.g., via
+ *     /proc/sys/vm/nr_hugepages).  If there aren't enough, we fall back to
+ *     transparent huge pages.
+ *
+ * @param num    The number of elements in the array
+ * @param policy How to allocate the array
+ *
+ * @return The array
+ */
+unsigned *alloc_array(size_t num, const alloc_policy_t &policy) {
+  char buf[1024];
+  if (policy.pages == "malloc" && policy.numa == "none") {
+    // NB: we are using C-style allocation here, instead of 'new unsigned[num]'.
+    //     The array is cache-line aligned, which the Eytzinger index needs.
+    size_t bytes = std::max<size_t>(1, num * sizeof(unsigned));
+    unsigned *arr = (unsigned *)aligned_alloc(
+        CACHE_LINE, (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if (arr == nullptr) {
+      fprintf(stderr, "Error calling aligned_alloc: %s\n",
+              strerror_r(errno, buf, sizeof(buf)));
+      exit(0);
+    }
+    return arr;
+  }
+
+  if (policy.pages != "malloc" && policy.pages != "thp" &&
+      policy.pages != "2mb" && policy.pages != "1gb") {
+    fprintf(stderr, "Unknown page type %s\n", policy.pages.c_str());
+    exit(0);
+  }
+
+  // Map the memory, rounded up to a whole number of pages
+  size_t page = policy.pages == "2mb"   ? PAGE_SIZE_2M
+                : policy.pages == "1gb" ? PAGE_SIZE_1G
+                                        : PAGE_SIZE_4K;
+  size_t bytes = std::max<size_t>(1, num * sizeof(unsigned));
+  bytes = (bytes + page - 1) / page * page;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *map = MAP_FAILED;
+  if (page != PAGE_SIZE_4K) {
+    int huge = page == PAGE_SIZE_2M ? MAP_HUGE_2MB : MAP_HUGE_1GB;
+    map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+               flags | MAP_HUGETLB | huge, -1, 0);
+    if (map == MAP_FAILED)
+      fprintf(stderr, "No %s huge pages available (%s); using thp instead\n",
+              policy.pages.c_str(), strerror_r(errno, buf, sizeof(buf)));
+  }
+  if (map == MAP_FAILED) {
+    map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "Error calling mmap: %s\n",
+              strerror_r(errno, buf, sizeof(buf)));
+      exit(0);
+    }
+    if (policy.pages != "malloc" && madvise(map, bytes, MADV_HUGEPAGE) != 0)
+      fprintf(stderr, "Error calling madvise(MADV_HUGEPAGE): %s\n",
+              strerror_r(errno, buf, sizeof(buf)));
+  }
+  unsigned *arr = (unsigned *)map;
+
+  // Place the pages.  Nothing has touched them yet, so nothing has been
+  // placed yet.
+  if (policy.numa == "interleave") {
+    unsigned long mask = numa_node_mask();
+    if (syscall(SYS_mbind, map, bytes, MPOL_INTERLEAVE, &mask,
+                sizeof(mask) * 8, 0) != 0)
+      fprintf(stderr, "Error calling mbind: %s\n",
+              strerror_r(errno, buf, sizeof(buf)));
+  } else if (policy.numa == "local") {
+    // Each thread touches one element per page of the same slice it will
+    // get from parallel_sort_array() and the parallel scans
+    unsigned num_threads = std::max(1u, policy.threads);
+    auto touch = [&](unsigned t) {
+      size_t begin = num * t / num_threads, end = num * (t + 1) / num_threads;
+      for (size_t i = begin; i < end; i += PAGE_SIZE_4K / sizeof(unsigned))
+        arr[i] = 0;
+    };
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < num_threads; ++t)
+      workers.emplace_back(touch, t);
+    touch(0);
+    for (auto &w : workers)
+      w.join();
+  } else if (policy.numa != "none") {
+    fprintf(stderr, "Unknown NUMA placement %s\n", policy.numa.c_str());
+    exit(0);
+  }
+  return arr;
+}
+
+/**
+ * Free an array that was made by alloc_array()
+ *
+ * @param arr    The array to free
+ * @param num    The number of elements in the array
+ * @param policy The policy that was used to allocate the array
+ */
+void free_array(unsigned *arr, size_t num, const alloc_policy_t &policy) {
+  if (policy.pages == "malloc" && policy.numa == "none") {
+    free(arr);
+    return;
+  }
+  // NB: alloc_array() always maps a multiple of the huge page size, even if
+  //     it fell back to normal pages, so this length is right either way
+  size_t page = policy.pages == "2mb"   ? PAGE_SIZE_2M
+                : policy.pages == "1gb" ? PAGE_SIZE_1G
+                                        : PAGE_SIZE_4K;
+  size_t bytes = std::max<size_t>(1, num * sizeof(unsigned));
+  munmap(arr, (bytes + page - 1) / page * page);
+}
+
 /**
  * Create an array of the requested size, and populate it with
  * randomly-generated integers
  *
- * @param num   The number of elements to put into the array
- * @param _seed The seed for the random-number generator
+ * @param num    The number of elements to put into the array
+ * @param _seed  The seed for the random-number generator
+ * @param policy How to allocate the array
+ */
+unsigned *create_array(size_t num, unsigned _seed,
+                       const alloc_policy_t &policy = alloc_policy_t()) {
+  unsigned *arr = alloc_array(num, policy);
+  unsigned seed = _seed;
+  for (size_t i = 0; i < num; ++i) {
+    arr[i] = rand_r(&seed);
+  }
+  return arr;
+}
+
+/**
+ * A counter-based pseudo-random number generator: the i-th number for a seed
+ * is a hash of (seed, i).  Unlike rand_r(), which must produce the numbers in
+ * order, any thread can produce any number, so the array comes out the same no
+ * matter how many threads make it.
+ *
+ * NB: this is the finalizer of the SplitMix64 generator, which mixes the bits
+ *     well enough that consecutive counters give unrelated outputs.
+ *
+ * @param seed The seed for the random-number generator
+ * @param i    The position of the number in the sequence
+ *
+ * @return A pseudo-random 32-bit number
+ */
+inline unsigned counter_rand(uint64_t seed, uint64_t i) {
+  uint64_t z = seed * 0xD1B54A32D192ED03ul + (i + 1) * 0x9E3779B97F4A7C15ul;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ul;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBul;
+  return (z ^ (z >> 31)) >> 32;
+}
+
+/**
+ * Create an array of the requested size, and populate it with integers from
+ * counter_rand(), using many threads.  Each thread fills (and so is the first
+ * to touch) one contiguous slice of the array.
+ *
+ * @param num         The number of elements to put into the array
+ * @param seed        The seed for the random-number generator
+ * @param num_threads The number of threads to use
+ * @param policy      How to allocate the array
+ */
+unsigned *create_array_parallel(size_t num, unsigned seed,
+                                unsigned num_threads,
+                                const alloc_policy_t &policy = alloc_policy_t()) {
+  unsigned *arr = alloc_array(num, policy);
+  num_threads = std::max<size_t>(
+      1, std::min<size_t>(num_threads, num / GENERATE_SLICE_MIN));
+  auto fill = [&](unsigned t) {
+    size_t end = num * (t + 1) / num_threads;
+    for (size_t i = num * t / num_threads; i < end; ++i)
+      arr[i] = counter_rand(seed, i);
+  };
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < num_threads; ++t)
+    workers.emplace_back(fill, t);
+  fill(0);
+  for (auto &w : workers)
+    w.join();
+  return arr;
+}
+
+/**
+ * The header of an array file.  It is 64 bytes, so the elements that follow
+ * it are cache-line aligned when the file is memory-mapped.
  */
-unsigned *create_array(unsigned num, unsigned _seed) {
-  // NB: we are using C-style allocation here, instead of 'new unsigned[num]'
-  unsigned *arr = (unsigned *)malloc(num * sizeof(unsigned));
-  if (arr == nullptr) {
+struct array_header_t {
+  /** Always ARRAY_MAGIC */
+  char magic[8];
+
+  /** The number of elements in the file */
+  uint64_t count;
+
+  /** The size of each element (always sizeof(unsigned)) */
+  uint32_t elem_size;
+
+  /** Bit flags about the array (e.g., ARRAY_SORTED) */
+  uint32_t flags;
+
+  /** Unused, for future versions of the format */
+  uint64_t reserved[5];
+};
+
+/**
+ * Save an array to a file, with a header
+ *
+ * @param filename The name of the file to create
+ * @param arr      The array of integers to save
+ * @param num      The number of elements in the array
+ * @param sorted   Is the array sorted?
+ */
+void save_array(const std::string &filename, unsigned arr[], size_t num,
+                bool sorted) {
+  array_header_t header = {};
+  memcpy(header.magic, ARRAY_MAGIC, sizeof(header.magic));
+  header.count = num;
+  header.elem_size = sizeof(unsigned);
+  header.flags = sorted ? ARRAY_SORTED : 0;
+  FILE *f = fopen(filename.c_str(), "wb");
+  if (f == nullptr || fwrite(&header, sizeof(header), 1, f) != 1 ||
+      fwrite(arr, sizeof(unsigned), num, f) != num || fclose(f) != 0) {
     char buf[1024];
-    fprintf(stderr, "Error calling malloc: %s\n",
+    fprintf(stderr, "Error writing %s: %s\n", filename.c_str(),
             strerror_r(errno, buf, sizeof(buf)));
     exit(0);
   }
-  unsigned seed = _seed;
-  for (unsigned i = 0; i < num; ++i) {
-    arr[i] = rand_r(&seed);
+}
+
+/**
+ * Load an array from a file made by save_array().  The file is memory-mapped,
+ * so this takes the same (tiny) amount of time for any size of file, and pages
+ * are only read from disk (or the page cache) when they are used.
+ *
+ * NB: the mapping is private, so sorting the array does not change the file.
+ *
+ * @param filename The name of the file to load
+ * @param num      The number of elements in the array, as an out parameter
+ * @param sorted   Whether the array is sorted, as an out parameter
+ *
+ * @return The array
+ */
+unsigned *load_array(const std::string &filename, size_t &num, bool &sorted) {
+  char buf[1024];
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", filename.c_str(),
+            strerror_r(errno, buf, sizeof(buf)));
+    exit(0);
   }
-  return arr;
+  array_header_t header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, ARRAY_MAGIC, sizeof(header.magic)) != 0 ||
+      header.elem_size != sizeof(unsigned) ||
+      (uint64_t)st.st_size != sizeof(header) + header.count * sizeof(unsigned)) {
+    fprintf(stderr, "%s is not a valid array file\n", filename.c_str());
+    exit(0);
+  }
+  void *map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Error calling mmap: %s\n",
+            strerror_r(errno, buf, sizeof(buf)));
+    exit(0);
+  }
+  // NB: the mapping stays valid after the file is closed
+  close(fd);
+  num = header.count;
+  sorted = header.flags & ARRAY_SORTED;
+  return (unsigned *)((char *)map + sizeof(header));
 }
 
 /**
@@ -137,10 +698,13 @@ unsigned *create_array(unsigned num, unsigned _seed) {
  * @param l The "left" element
  * @param r The "right" element
  *
+ * NB: the elements must be compared as unsigned.  Comparing them as int would
+ *     put every value >= 2^31 before all of the smaller values.
+ *
  * @return -1 if left < right, 0 if equal, 1 if left > right
  */
 static int uintcompare(const void *l, const void *r) {
-  int lf = *(int *)l, rt = *(int *)r;
+  unsigned lf = *(unsigned *)l, rt = *(unsigned *)r;
   return (lf < rt) ? -1 : (lf > rt) ? 1 : 0;
 }
 
@@ -155,16 +719,160 @@ static int uintcompare(const void *l, const void *r) {
  * @param arr  The array to sort
  * @param size The number of elements in the array
  */
-void sort_array(unsigned *arr, unsigned size) {
+void sort_array(unsigned *arr, size_t size) {
   qsort(arr, size, sizeof(unsigned), uintcompare);
 }
 
+/**
+ * Sort an array of unsigned integers with the C++ sort algorithm.  The
+ * comparison gets inlined, so there are no function calls per comparison.
+ *
+ * @param arr  The array to sort
+ * @param size The number of elements in the array
+ */
+void std_sort_array(unsigned *arr, size_t size) { std::sort(arr, arr + size); }
+
+/**
+ * Sort an array of unsigned integers with a least-significant-digit radix
+ * sort.  There are no comparisons at all: each of the four passes distributes
+ * the elements into 256 buckets by one byte of the key, keeping the order from
+ * the previous pass.  That is O(n) work, in four streaming passes.
+ *
+ * @param arr    The array to sort
+ * @param size   The number of elements in the array
+ * @param policy How to allocate the scratch space
+ */
+void radix_sort_array(unsigned *arr, size_t size,
+                      const alloc_policy_t &policy = alloc_policy_t()) {
+  if (size < RADIX_MIN) {
+    std_sort_array(arr, size);
+    return;
+  }
+  unsigned *scratch = alloc_array(size, policy);
+
+  // Count every digit of every element in one pass over the data
+  const int passes = 32 / RADIX_BITS;
+  std::vector<size_t> counts(passes * RADIX_BUCKETS, 0);
+  for (size_t i = 0; i < size; ++i)
+    for (int p = 0; p < passes; ++p)
+      ++counts[p * RADIX_BUCKETS + ((arr[i] >> (p * RADIX_BITS)) & 0xFF)];
+
+  unsigned *src = arr, *dst = scratch;
+  for (int p = 0; p < passes; ++p) {
+    size_t *count = &counts[p * RADIX_BUCKETS];
+    // NB: if every element has the same digit, this pass wouldn't move
+    //     anything, so skip it
+    if (count[(src[0] >> (p * RADIX_BITS)) & 0xFF] == size)
+      continue;
+    // Turn counts into starting offsets, then scatter
+    size_t offset = 0;
+    for (int b = 0; b < RADIX_BUCKETS; ++b) {
+      size_t c = count[b];
+      count[b] = offset;
+      offset += c;
+    }
+    for (size_t i = 0; i < size; ++i)
+      dst[count[(src[i] >> (p * RADIX_BITS)) & 0xFF]++] = src[i];
+    std::swap(src, dst);
+  }
+  if (src != arr)
+    memcpy(arr, src, size * sizeof(unsigned));
+  free_array(scratch, size, policy);
+}
+
+/**
+ * Sort an array of unsigned integers with a radix sort that runs on many
+ * threads.  Each thread owns a contiguous slice of the array.  In each pass,
+ * every thread counts the digits in its slice; then the counts are turned into
+ * offsets, ordered by (digit, thread), so that each thread knows exactly where
+ * each of its elements goes; then every thread scatters its slice.  No two
+ * threads ever write to the same location, so there is no locking.
+ *
+ * @param arr         The array to sort
+ * @param size        The number of elements in the array
+ * @param num_threads The number of threads to use
+ * @param policy      How to allocate the scratch space
+ */
+void parallel_sort_array(unsigned *arr, size_t size, unsigned num_threads,
+                         const alloc_policy_t &policy = alloc_policy_t()) {
+  num_threads = std::min<size_t>(num_threads, size / RADIX_MIN);
+  if (num_threads <= 1) {
+    radix_sort_array(arr, size, policy);
+    return;
+  }
+  unsigned *scratch = alloc_array(size, policy);
+
+  // The slice of the array that thread t owns is [bounds[t], bounds[t+1])
+  std::vector<size_t> bounds(num_threads + 1);
+  for (unsigned t = 0; t <= num_threads; ++t)
+    bounds[t] = size * t / num_threads;
+
+  // counts[t][b] is the number of elements in thread t's slice with digit b.
+  // NB: each thread's counts are a separate allocation, so threads never
+  //     write to the same cache line.
+  std::vector<std::vector<size_t>> counts(num_threads,
+                                          std::vector<size_t>(RADIX_BUCKETS));
+
+  // Run `fn(t)` on every thread, and wait for them all to finish
+  auto run_all = [&](auto fn) {
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < num_threads; ++t)
+      workers.emplace_back(fn, t);
+    fn(0);
+    for (auto &w : workers)
+      w.join();
+  };
+
+  unsigned *src = arr, *dst = scratch;
+  for (int shift = 0; shift < 32; shift += RADIX_BITS) {
+    // Count the digits in each slice
+    run_all([&](unsigned t) {
+      size_t *count = counts[t].data();
+      std::fill(count, count + RADIX_BUCKETS, 0);
+      for (size_t i = bounds[t]; i < bounds[t + 1]; ++i)
+        ++count[(src[i] >> shift) & 0xFF];
+    });
+    // Turn counts into offsets: all of digit 0 (thread 0, then thread 1, ...),
+    // then all of digit 1, and so on.  Skip the pass if it wouldn't move
+    // anything.
+    size_t offset = 0, nonempty = 0;
+    for (int b = 0; b < RADIX_BUCKETS; ++b) {
+      size_t bucket_total = 0;
+      for (unsigned t = 0; t < num_threads; ++t) {
+        size_t c = counts[t][b];
+        counts[t][b] = offset;
+        offset += c;
+        bucket_total += c;
+      }
+      nonempty += (bucket_total > 0);
+    }
+    if (nonempty == 1)
+      continue;
+    // Scatter each slice
+    run_all([&](unsigned t) {
+      size_t *count = counts[t].data();
+      for (size_t i = bounds[t]; i < bounds[t + 1]; ++i)
+        dst[count[(src[i] >> shift) & 0xFF]++] = src[i];
+    });
+    std::swap(src, dst);
+  }
+  if (src != arr) {
+    run_all([&](unsigned t) {
+      memcpy(arr + bounds[t], src + bounds[t],
+             (bounds[t + 1] - bounds[t]) * sizeof(unsigned));
+    });
+  }
+  free_array(scratch, size, policy);
+}
+
 /**
  * Recursive binary search algorithm.  Remember that modern compilers will apply
  * tail-call optimizations, so it's fine to use recursion if you are compiling
  * at -O1 or greater.
  *
  * NB: for an array of size X, the call should use 0 for lo, and X-1 for hi.
+ *     Indices are signed (so that hi can become -1), and 64 bits wide (so
+ *     that arrays can have more than 2^31 elements).
  *
  * @param arr The array of integers in which to search
  * @param lo  The lowest index to consider in the array
@@ -173,9 +881,9 @@ void sort_array(unsigned *arr, unsigned size) {
  *
  * @return index at which key can be found, or -1
  */
-int binary_search(unsigned arr[], int lo, int hi, unsigned key) {
+long binary_search(unsigned arr[], long lo, long hi, unsigned key) {
   if (hi >= lo) {
-    int mid = lo + (hi - lo) / 2; // mid point
+    long mid = lo + (hi - lo) / 2; // mid point
     if (arr[mid] == key)
       return mid; // On success, return the index
     if (arr[mid] > key)
@@ -194,22 +902,633 @@ int binary_search(unsigned arr[], int lo, int hi, unsigned key) {
  *
  * @return index at which key can be found, or -1
  */
-int linear_search(unsigned arr[], unsigned num, unsigned key) {
-  for (unsigned i = 0; i < num; ++i)
+long linear_search(unsigned arr[], size_t num, unsigned key) {
+  for (size_t i = 0; i < num; ++i)
     if (arr[i] == key)
       return i;
   return -1;
 }
 
+/**
+ * The kernels that scan an unsorted array.  There is one scan_kernels_t for
+ * each instruction set: a scalar one that works everywhere, one for AVX2 (8
+ * keys per comparison), and one for AVX-512 (16 keys per comparison).
+ * pick_kernels() chooses one at run time, based on what the CPU supports.
+ *
+ * Each kernel scans arr[begin, end), and reports indices relative to arr, so
+ * that several threads can scan different slices of the same array.
+ */
+struct scan_kernels_t {
+  /** The name of the instruction set */
+  const char *name;
+
+  /** Return the index of the first element equal to key, or -1 */
+  long (*find_first)(const unsigned *arr, size_t begin, size_t end,
+                     unsigned key);
+
+  /** Return the number of elements equal to key */
+  size_t (*count)(const unsigned *arr, size_t begin, size_t end, unsigned key);
+
+  /** Append the index of every element equal to key to `out` */
+  void (*find_all)(const unsigned *arr, size_t begin, size_t end, unsigned key,
+                   std::vector<size_t> &out);
+
+  /**
+   * For each of num_keys keys, set first[j] to the index of its first match,
+   * if first[j] is -1 and there is a match.  All keys are checked in one pass.
+   */
+  void (*find_first_multi)(const unsigned *arr, size_t begin, size_t end,
+                           const unsigned *keys, size_t num_keys, long *first);
+};
+
+/** The scalar version of scan_kernels_t::find_first */
+long scalar_find_first(const unsigned *arr, size_t begin, size_t end,
+                       unsigned key) {
+  for (size_t i = begin; i < end; ++i)
+    if (arr[i] == key)
+      return i;
+  return -1;
+}
+
+/** The scalar version of scan_kernels_t::count */
+size_t scalar_count(const unsigned *arr, size_t begin, size_t end,
+                    unsigned key) {
+  size_t res = 0;
+  for (size_t i = begin; i < end; ++i)
+    res += (arr[i] == key);
+  return res;
+}
+
+/** The scalar version of scan_kernels_t::find_all */
+void scalar_find_all(const unsigned *arr, size_t begin, size_t end,
+                     unsigned key, std::vector<size_t> &out) {
+  for (size_t i = begin; i < end; ++i)
+    if (arr[i] == key)
+      out.push_back(i);
+}
+
+/** The scalar version of scan_kernels_t::find_first_multi */
+void scalar_find_first_multi(const unsigned *arr, size_t begin, size_t end,
+                             const unsigned *keys, size_t num_keys,
+                             long *first) {
+  for (size_t i = begin; i < end; ++i)
+    for (size_t j = 0; j < num_keys; ++j)
+      if (arr[i] == keys[j] && first[j] == -1)
+        first[j] = i;
+}
+
+/**
+ * Record the matches in one vector's worth of comparisons, for
+ * find_first_multi
+ *
+ * @param mask  A bit mask of the lanes that matched key j
+ * @param base  The array index of lane 0
+ * @param j     The key that was compared
+ * @param first The first-match index of each key
+ */
+inline void record_first(uint32_t mask, size_t base, size_t j, long *first) {
+  if (mask != 0 && first[j] == -1)
+    first[j] = base + __builtin_ctz(mask);
+}
+
+/**
+ * Run `fn` once for every set bit in `mask`, passing base + the bit's position
+ */
+template <typename F> inline void for_each_bit(uint64_t mask, size_t base, F fn) {
+  while (mask != 0) {
+    fn(base + __builtin_ctzll(mask));
+    mask &= mask - 1;
+  }
+}
+
+/**
+ * The AVX2 version of scan_kernels_t::find_first.  It compares 32 elements
+ * (four vectors) per iteration, and only looks at the individual comparisons
+ * once any of them has matched.
+ */
+__attribute__((target("avx2"))) long
+avx2_find_first(const unsigned *arr, size_t begin, size_t end, unsigned key) {
+  __m256i k = _mm256_set1_epi32(key);
+  size_t i = begin;
+  for (; i + 32 <= end; i += 32) {
+    __m256i c0 = _mm256_cmpeq_epi32(
+        _mm256_loadu_si256((const __m256i *)(arr + i)), k);
+    __m256i c1 = _mm256_cmpeq_epi32(
+        _mm256_loadu_si256((const __m256i *)(arr + i + 8)), k);
+    __m256i c2 = _mm256_cmpeq_epi32(
+        _mm256_loadu_si256((const __m256i *)(arr + i + 16)), k);
+    __m256i c3 = _mm256_cmpeq_epi32(
+        _mm256_loadu_si256((const __m256i *)(arr + i + 24)), k);
+    __m256i any = _mm256_or_si256(_mm256_or_si256(c0, c1),
+                                  _mm256_or_si256(c2, c3));
+    if (!_mm256_testz_si256(any, any)) {
+      uint64_t mask =
+          (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(c0)) |
+          ((uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(c1)) << 8) |
+          ((uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(c2)) << 16) |
+          ((uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(c3)) << 24);
+      return i + __builtin_ctzll(mask);
+    }
+  }
+  return scalar_find_first(arr, i, end, key);
+}
+
+/**
+ * The AVX2 version of scan_kernels_t::count.  Each matching lane is -1, so
+ * subtracting the comparison results counts matches 8 lanes at a time.
+ */
+__attribute__((target("avx2"))) size_t
+avx2_count(const unsigned *arr, size_t begin, size_t end, unsigned key) {
+  __m256i k = _mm256_set1_epi32(key);
+  size_t res = 0, i = begin;
+  while (i + 8 <= end) {
+    // NB: each 32-bit lane can only count to 2^32 before it overflows, so
+    //     flush the lane counts into `res` periodically
+    size_t stop = std::min(end - (end - i) % 8, i + (8ul << 30));
+    __m256i acc = _mm256_setzero_si256();
+    for (; i < stop; i += 8)
+      acc = _mm256_sub_epi32(
+          acc, _mm256_cmpeq_epi32(
+                   _mm256_loadu_si256((const __m256i *)(arr + i)), k));
+    unsigned lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    for (unsigned l : lanes)
+      res += l;
+  }
+  return res + scalar_count(arr, i, end, key);
+}
+
+/** The AVX2 version of scan_kernels_t::find_all */
+__attribute__((target("avx2"))) void
+avx2_find_all(const unsigned *arr, size_t begin, size_t end, unsigned key,
+              std::vector<size_t> &out) {
+  __m256i k = _mm256_set1_epi32(key);
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(
+        _mm256_loadu_si256((const __m256i *)(arr + i)), k)));
+    for_each_bit(mask, i, [&](size_t idx) { out.push_back(idx); });
+  }
+  scalar_find_all(arr, i, end, key, out);
+}
+
+/** The AVX2 version of scan_kernels_t::find_first_multi */
+__attribute__((target("avx2"))) void
+avx2_find_first_multi(const unsigned *arr, size_t begin, size_t end,
+                      const unsigned *keys, size_t num_keys, long *first) {
+  __m256i k[MAX_SCAN_KEYS];
+  for (size_t j = 0; j < num_keys; ++j)
+    k[j] = _mm256_set1_epi32(keys[j]);
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(arr + i));
+    for (size_t j = 0; j < num_keys; ++j)
+      record_first(_mm256_movemask_ps(
+                       _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, k[j]))),
+                   i, j, first);
+  }
+  scalar_find_first_multi(arr, i, end, keys, num_keys, first);
+}
+
+/**
+ * The AVX-512 version of scan_kernels_t::find_first.  AVX-512 comparisons
+ * produce a bit mask directly, so there's no movemask step.
+ */
+__attribute__((target("avx512f"))) long
+avx512_find_first(const unsigned *arr, size_t begin, size_t end, unsigned key) {
+  __m512i k = _mm512_set1_epi32(key);
+  size_t i = begin;
+  for (; i + 64 <= end; i += 64) {
+    uint64_t m0 = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i), k);
+    uint64_t m1 = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 16), k);
+    uint64_t m2 = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 32), k);
+    uint64_t m3 = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 48), k);
+    uint64_t mask = m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+    if (mask != 0)
+      return i + __builtin_ctzll(mask);
+  }
+  return scalar_find_first(arr, i, end, key);
+}
+
+/** The AVX-512 version of scan_kernels_t::count */
+__attribute__((target("avx512f"))) size_t
+avx512_count(const unsigned *arr, size_t begin, size_t end, unsigned key) {
+  __m512i k = _mm512_set1_epi32(key);
+  size_t res = 0, i = begin;
+  for (; i + 64 <= end; i += 64) {
+    res += __builtin_popcount(
+        _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i), k));
+    res += __builtin_popcount(
+        _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 16), k));
+    res += __builtin_popcount(
+        _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 32), k));
+    res += __builtin_popcount(
+        _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i + 48), k));
+  }
+  return res + scalar_count(arr, i, end, key);
+}
+
+/** The AVX-512 version of scan_kernels_t::find_all */
+__attribute__((target("avx512f"))) void
+avx512_find_all(const unsigned *arr, size_t begin, size_t end, unsigned key,
+                std::vector<size_t> &out) {
+  __m512i k = _mm512_set1_epi32(key);
+  size_t i = begin;
+  for (; i + 16 <= end; i += 16) {
+    uint32_t mask = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(arr + i), k);
+    for_each_bit(mask, i, [&](size_t idx) { out.push_back(idx); });
+  }
+  scalar_find_all(arr, i, end, key, out);
+}
+
+/** The AVX-512 version of scan_kernels_t::find_first_multi */
+__attribute__((target("avx512f"))) void
+avx512_find_first_multi(const unsigned *arr, size_t begin, size_t end,
+                        const unsigned *keys, size_t num_keys, long *first) {
+  __m512i k[MAX_SCAN_KEYS];
+  for (size_t j = 0; j < num_keys; ++j)
+    k[j] = _mm512_set1_epi32(keys[j]);
+  size_t i = begin;
+  for (; i + 16 <= end; i += 16) {
+    __m512i v = _mm512_loadu_si512(arr + i);
+    for (size_t j = 0; j < num_keys; ++j)
+      record_first(_mm512_cmpeq_epi32_mask(v, k[j]), i, j, first);
+  }
+  scalar_find_first_multi(arr, i, end, keys, num_keys, first);
+}
+
+/** The scan kernels for each instruction set */
+const scan_kernels_t SCALAR_KERNELS = {"scalar", scalar_find_first,
+                                       scalar_count, scalar_find_all,
+                                       scalar_find_first_multi};
+const scan_kernels_t AVX2_KERNELS = {"avx2", avx2_find_first, avx2_count,
+                                     avx2_find_all, avx2_find_first_multi};
+const scan_kernels_t AVX512_KERNELS = {"avx512", avx512_find_first,
+                                       avx512_count, avx512_find_all,
+                                       avx512_find_first_multi};
+
+/**
+ * Choose the scan kernels to use
+ *
+ * @param name "auto" for the best kernels this CPU supports, or the name of
+ *             an instruction set
+ *
+ * @return The kernels
+ */
+const scan_kernels_t &pick_kernels(const std::string &name) {
+  bool avx512 = __builtin_cpu_supports("avx512f");
+  bool avx2 = __builtin_cpu_supports("avx2");
+  if (name == "auto")
+    return avx512 ? AVX512_KERNELS : avx2 ? AVX2_KERNELS : SCALAR_KERNELS;
+  if (name == "scalar")
+    return SCALAR_KERNELS;
+  if ((name == "avx2" && avx2) || (name == "avx512" && avx512))
+    return name == "avx2" ? AVX2_KERNELS : AVX512_KERNELS;
+  fprintf(stderr, "Kernel %s is unknown or not supported by this CPU\n",
+          name.c_str());
+  exit(0);
+}
+
+/**
+ * Split [0, size) into one slice per thread, and run fn(t, begin, end) for
+ * each slice on its own thread.  Small arrays are not split.
+ *
+ * @param size        The number of elements
+ * @param num_threads The maximum number of threads to use
+ * @param fn          The function to run on each slice
+ *
+ * @return The number of slices
+ */
+template <typename F>
+unsigned parallel_slices(size_t size, unsigned num_threads, F fn) {
+  num_threads = std::max<size_t>(1, std::min<size_t>(num_threads,
+                                                    size / SCAN_SLICE_MIN));
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < num_threads; ++t)
+    workers.emplace_back(fn, t, size * t / num_threads,
+                         size * (t + 1) / num_threads);
+  fn(0, 0, size / num_threads);
+  for (auto &w : workers)
+    w.join();
+  return num_threads;
+}
+
+/**
+ * Find the first element equal to key, using many threads.  Each thread scans
+ * its slice in blocks, and gives up as soon as an earlier slice has found a
+ * match, since nothing it finds could be first.
+ *
+ * @return The index of the first match, or -1
+ */
+long scan_find_first(const scan_kernels_t &k, const unsigned *arr, size_t size,
+                     unsigned key, unsigned num_threads) {
+  std::atomic<size_t> best(SIZE_MAX);
+  parallel_slices(size, num_threads, [&](unsigned, size_t begin, size_t end) {
+    for (size_t b = begin; b < end && best.load() > b; b += SCAN_BLOCK) {
+      long idx = k.find_first(arr, b, std::min(end, b + SCAN_BLOCK), key);
+      if (idx != -1) {
+        size_t cur = best.load();
+        while ((size_t)idx < cur && !best.compare_exchange_weak(cur, idx)) {
+        }
+        return;
+      }
+    }
+  });
+  return best == SIZE_MAX ? -1 : (long)best.load();
+}
+
+/**
+ * Count the elements equal to key, using many threads
+ */
+size_t scan_count(const scan_kernels_t &k, const unsigned *arr, size_t size,
+                  unsigned key, unsigned num_threads) {
+  std::atomic<size_t> total(0);
+  parallel_slices(size, num_threads, [&](unsigned, size_t begin, size_t end) {
+    total += k.count(arr, begin, end, key);
+  });
+  return total;
+}
+
+/**
+ * Find the index of every element equal to key, using many threads.  Each
+ * thread collects its own matches, and they are concatenated in slice order.
+ */
+std::vector<size_t> scan_find_all(const scan_kernels_t &k, const unsigned *arr,
+                                  size_t size, unsigned key,
+                                  unsigned num_threads) {
+  std::vector<std::vector<size_t>> found(num_threads);
+  unsigned used =
+      parallel_slices(size, num_threads, [&](unsigned t, size_t b, size_t e) {
+        k.find_all(arr, b, e, key, found[t]);
+      });
+  std::vector<size_t> res;
+  for (unsigned t = 0; t < used; ++t)
+    res.insert(res.end(), found[t].begin(), found[t].end());
+  return res;
+}
+
+/**
+ * Find the first match of each of several keys, in one pass, using many
+ * threads.  Each thread finds the first match in its slice, and then the
+ * earliest slice with a match wins.
+ *
+ * @return The index of the first match of each key, or -1
+ */
+std::vector<long> scan_find_first_multi(const scan_kernels_t &k,
+                                        const unsigned *arr, size_t size,
+                                        const std::vector<unsigned> &keys,
+                                        unsigned num_threads) {
+  std::vector<std::vector<long>> first(num_threads,
+                                       std::vector<long>(keys.size(), -1));
+  unsigned used =
+      parallel_slices(size, num_threads, [&](unsigned t, size_t b, size_t e) {
+        k.find_first_multi(arr, b, e, keys.data(), keys.size(),
+                           first[t].data());
+      });
+  std::vector<long> res(keys.size(), -1);
+  for (size_t j = 0; j < keys.size(); ++j)
+    for (unsigned t = 0; t < used && res[j] == -1; ++t)
+      res[j] = first[t][j];
+  return res;
+}
+
+/**
+ * An Eytzinger layout of a sorted array: the array is stored as a complete
+ * binary search tree in breadth-first order, with the root at index 1 and the
+ * children of node k at 2k and 2k+1.  The first few levels of the tree (the
+ * ones every search touches) are packed together at the front, so they stay in
+ * cache.  And the 16 great-great-grandchildren of node k are adjacent, aligned
+ * to one cache line, so one prefetch fetches everything a search might need
+ * four steps from now.
+ */
+struct eytzinger_t {
+  /** The tree, indexed from 1 (index 0 is unused) */
+  unsigned *tree = nullptr;
+
+  /** The number of elements in the tree */
+  size_t size = 0;
+
+  /** The number of steps that every search makes unconditionally */
+  int full_levels = 0;
+
+  /** How the tree was allocated */
+  alloc_policy_t policy;
+
+  /**
+   * Build the tree from a sorted array
+   *
+   * @param arr    The sorted array
+   * @param size   The number of elements in the array
+   * @param policy How to allocate the tree
+   */
+  eytzinger_t(const unsigned *arr, size_t size,
+              const alloc_policy_t &policy = alloc_policy_t())
+      : size(size), policy(policy) {
+    tree = alloc_array(size + 1, policy);
+    tree[0] = 0; // unused, but search_batch() reads it in place of a branch
+    size_t next = 0;
+    fill(arr, next, 1);
+    // Every node at depth < full_levels exists, so a search can make that many
+    // steps without checking whether it has fallen off the bottom of the tree
+    while (full_levels < 63 && (2ul << full_levels) - 1 <= size)
+      ++full_levels;
+  }
+
+  /** Free the tree */
+  ~eytzinger_t() { free_array(tree, size + 1, policy); }
+
+  eytzinger_t(const eytzinger_t &) = delete;
+  eytzinger_t &operator=(const eytzinger_t &) = delete;
+
+  /**
+   * Place the elements of arr, in order, into the subtree rooted at k
+   *
+   * NB: this is an in-order traversal of the tree, so the recursion is only
+   *     log2(size) deep.
+   */
+  void fill(const unsigned *arr, size_t &next, size_t k) {
+    if (k <= size) {
+      fill(arr, next, 2 * k);
+      tree[k] = arr[next++];
+      fill(arr, next, 2 * k + 1);
+    }
+  }
+
+  /**
+   * Turn a finished search path into an answer.  Each step of the search
+   * appended one bit to k (1 for "went right"), so the lower bound is the last
+   * node where we went left: strip the trailing 1s, and then one more bit.
+   *
+   * @return The index in `tree` of the key, or -1 if it isn't present
+   */
+  long finish(size_t k, unsigned key) const {
+    k >>= __builtin_ffsl(~k);
+    return (k != 0 && tree[k] == key) ? (long)k : -1;
+  }
+
+  /**
+   * Look up one key.  The loop is branch-free (the comparison becomes part of
+   * the index), and prefetches four levels ahead.
+   *
+   * @param key The value to search for
+   *
+   * @return The index in `tree` of the key, or -1 if it isn't present
+   */
+  long search(unsigned key) const {
+    size_t k = 1;
+    while (k <= size) {
+      __builtin_prefetch(tree + 16 * k);
+      k = 2 * k + (tree[k] < key);
+    }
+    return finish(k, key);
+  }
+
+  /**
+   * Look up many keys.  A single search can't go faster than one cache miss
+   * per level, but the misses of different searches are independent.  So we
+   * run SEARCH_BATCH searches in lockstep: at each level, every search issues
+   * its prefetch and takes its step, and by the time we come back around to
+   * the first search its next node has (hopefully) arrived.
+   *
+   * @param keys     The values to search for
+   * @param num_keys The number of values
+   * @param results  For each key, its index in `tree`, or -1
+   */
+  void search_batch(const unsigned *keys, size_t num_keys,
+                    long *results) const {
+    size_t k[SEARCH_BATCH];
+    for (size_t base = 0; base < num_keys; base += SEARCH_BATCH) {
+      size_t count = std::min(SEARCH_BATCH, num_keys - base);
+      const unsigned *batch = keys + base;
+      for (size_t j = 0; j < count; ++j)
+        k[j] = 1;
+      for (int level = 0; level < full_levels; ++level) {
+        for (size_t j = 0; j < count; ++j) {
+          __builtin_prefetch(tree + 16 * k[j]);
+          k[j] = 2 * k[j] + (tree[k[j]] < batch[j]);
+        }
+      }
+      // NB: The last level of the tree may be partly full, so some searches
+      //     need one more step.  We select instead of branching: a search
+      //     that has already left the tree reads tree[0] (so the read is
+      //     always in bounds), and its step is multiplied by 0.
+      for (size_t j = 0; j < count; ++j) {
+        size_t in = k[j] <= size;
+        size_t node = k[j] * in;
+        k[j] += in * (k[j] + (tree[node] < batch[j]));
+        results[base + j] = finish(k[j], batch[j]);
+      }
+    }
+  }
+};
+
+/**
+ * Read a binary file of unsigned integers (like the output of the -b flag)
+ *
+ * @param filename The file to read, or "-" for stdin
+ *
+ * @return A vector holding every integer in the file
+ */
+std::vector<unsigned> read_queries(const std::string &filename) {
+  FILE *f = (filename == "-") ? stdin : fopen(filename.c_str(), "rb");
+  if (f == nullptr) {
+    char buf[1024];
+    fprintf(stderr, "Error opening %s: %s\n", filename.c_str(),
+            strerror_r(errno, buf, sizeof(buf)));
+    exit(0);
+  }
+  std::vector<unsigned> keys;
+  unsigned chunk[4096];
+  size_t got;
+  while ((got = fread(chunk, sizeof(unsigned), 4096, f)) > 0)
+    keys.insert(keys.end(), chunk, chunk + got);
+  if (ferror(f)) {
+    char buf[1024];
+    fprintf(stderr, "Error calling fread: %s\n",
+            strerror_r(errno, buf, sizeof(buf)));
+    exit(0);
+  }
+  if (f != stdin)
+    fclose(f);
+  return keys;
+}
+
+/**
+ * Make pseudo-random keys to look up.  Half are drawn from the array (so they
+ * will be found), and half are random (so they will usually miss).
+ *
+ * @param arr   The array that will be searched
+ * @param num   The number of elements in the array
+ * @param count The number of keys to make
+ * @param _seed The seed for the random-number generator
+ *
+ * @return A vector of keys
+ */
+std::vector<unsigned> random_queries(const unsigned *arr, size_t num,
+                                     size_t count, unsigned _seed) {
+  std::vector<unsigned> keys(count);
+  unsigned seed = _seed;
+  for (size_t i = 0; i < count; ++i) {
+    size_t r = ((size_t)rand_r(&seed) << 31) | rand_r(&seed);
+    keys[i] = (i % 2 == 0 && num > 0) ? arr[r % num] : rand_r(&seed);
+  }
+  return keys;
+}
+
+/**
+ * Look up every key with one search method, and report how many were found
+ * and how many lookups per second the method managed
+ *
+ * @param method The search method
+ * @param arr    The sorted array
+ * @param num    The number of elements in the array
+ * @param index  The Eytzinger index of the array
+ * @param keys   The keys to look up
+ */
+void run_searches(const std::string &method, unsigned *arr, size_t num,
+                  const eytzinger_t &index, const std::vector<unsigned> &keys) {
+  size_t count = keys.size();
+  // NB: linear search is O(n) per lookup, so give it a budget
+  if (method == "linear" && num > 0)
+    count = std::min(count, std::max<size_t>(1, LINEAR_BUDGET / num));
+  std::vector<long> results(count);
+
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  if (method == "linear") {
+    for (size_t i = 0; i < count; ++i)
+      results[i] = linear_search(arr, num, keys[i]);
+  } else if (method == "binary") {
+    for (size_t i = 0; i < count; ++i)
+      results[i] = binary_search(arr, 0, (long)num - 1, keys[i]);
+  } else if (method == "eytzinger") {
+    for (size_t i = 0; i < count; ++i)
+      results[i] = index.search(keys[i]);
+  } else if (method == "batch") {
+    index.search_batch(keys.data(), count, results.data());
+  } else {
+    fprintf(stderr, "Unknown search method %s\n", method.c_str());
+    exit(0);
+  }
+  std::chrono::duration<double> secs =
+      std::chrono::steady_clock::now() - start_time;
+
+  size_t found = 0;
+  for (size_t i = 0; i < count; ++i)
+    found += (results[i] != -1);
+  printf("%s,%zu,%zu,%zu,%.6f,%.1f\n", method.c_str(), num, count, found,
+         secs.count(), count / secs.count());
+}
+
 /**
  * Print the contents of an integer array as text, with one entry per line
  *
  * @param arr The array of integers to print
  * @param num The number of elements in the array
  */
-void print_text(unsigned arr[], unsigned num) {
-  for (unsigned i = 0; i < num; ++i)
-    printf("%d\n", arr[i]);
+void print_text(unsigned arr[], size_t num) {
+  for (size_t i = 0; i < num; ++i)
+    printf("%u\n", arr[i]);
 }
 
 /**
@@ -218,7 +1537,7 @@ void print_text(unsigned arr[], unsigned num) {
  * @param arr The array of integers to print
  * @param num The number of elements in the array
  */
-void print_binary(unsigned arr[], unsigned num) {
+void print_binary(unsigned arr[], size_t num) {
   if (fwrite(&arr[0], sizeof(unsigned), num, stdout) < num) {
     char buf[1024];
     fprintf(stderr, "Error calling fwrite: %s\n",
@@ -227,6 +1546,528 @@ void print_binary(unsigned arr[], unsigned num) {
   }
 }
 
+/**
+ * A quantile sketch for 32-bit values, in the style of HdrHistogram.  Values
+ * below 2*SUB get their own bucket.  Above that, each power of two is split
+ * into SUB buckets, so any reported quantile is within 1/SUB (under 1%) of the
+ * true value.  The sketch is a few KB, no matter how many values it sees.
+ */
+struct quantile_sketch_t {
+  /** log2 of the number of buckets per power of two */
+  static const int SUB_BITS = 7;
+
+  /** The number of buckets per power of two */
+  static const uint64_t SUB = 1ull << SUB_BITS;
+
+  /** The count for each bucket */
+  std::vector<uint64_t> counts =
+      std::vector<uint64_t>(2 * SUB + (31 - SUB_BITS) * SUB);
+
+  /** The total number of values recorded */
+  uint64_t total = 0;
+
+  /** Find the bucket for a value */
+  static size_t index_of(unsigned v) {
+    if (v < 2 * SUB)
+      return v;
+    int e = 31 - __builtin_clz(v); // e > SUB_BITS
+    unsigned top = v >> (e - SUB_BITS); // in [SUB, 2*SUB)
+    return 2 * SUB + (e - SUB_BITS - 1) * SUB + (top - SUB);
+  }
+
+  /** The largest value that would be placed in a bucket */
+  static unsigned value_of(size_t idx) {
+    if (idx < 2 * SUB)
+      return idx;
+    int e = (idx - 2 * SUB) / SUB + SUB_BITS + 1;
+    uint64_t top = (idx - 2 * SUB) % SUB + SUB;
+    return ((top + 1) << (e - SUB_BITS)) - 1;
+  }
+
+  /** Record one value */
+  void record(unsigned v) {
+    ++counts[index_of(v)];
+    ++total;
+  }
+
+  /** The value at or below which `pct` percent of the values fall */
+  unsigned percentile(double pct) const {
+    uint64_t target = std::max<uint64_t>(1, total * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen >= target)
+        return value_of(i);
+    }
+    return value_of(counts.size() - 1);
+  }
+};
+
+/**
+ * Read a stream of unsigned integers in fixed-size chunks.  The stream can be
+ * a file made with -o (the header is checked and skipped) or the raw output of
+ * -b, and can be a pipe, so it never needs to fit in memory.
+ */
+struct stream_reader_t {
+  /** The file being read */
+  FILE *file;
+
+  /** The name of the file, for error messages */
+  std::string name;
+
+  /**
+   * Bytes that were read while looking for a header, but turned out to be
+   * data
+   */
+  std::vector<unsigned char> pending;
+
+  /**
+   * Open a stream, and skip its header if it has one
+   *
+   * @param filename The file to read, or "-" for stdin
+   */
+  explicit stream_reader_t(const std::string &filename) : name(filename) {
+    file = (filename == "-") ? stdin : fopen(filename.c_str(), "rb");
+    if (file == nullptr) {
+      char buf[1024];
+      fprintf(stderr, "Error opening %s: %s\n", filename.c_str(),
+              strerror_r(errno, buf, sizeof(buf)));
+      exit(0);
+    }
+    array_header_t header;
+    size_t got = fread(&header, 1, sizeof(header), file);
+    if (got == sizeof(header) &&
+        memcmp(header.magic, ARRAY_MAGIC, sizeof(header.magic)) == 0) {
+      if (header.elem_size != sizeof(unsigned)) {
+        fprintf(stderr, "%s is not a valid array file\n", filename.c_str());
+        exit(0);
+      }
+    } else {
+      pending.assign((unsigned char *)&header, (unsigned char *)&header + got);
+    }
+  }
+
+  /** Close the stream */
+  ~stream_reader_t() {
+    if (file != stdin)
+      fclose(file);
+  }
+
+  stream_reader_t(const stream_reader_t &) = delete;
+  stream_reader_t &operator=(const stream_reader_t &) = delete;
+
+  /**
+   * Read the next chunk of integers
+   *
+   * @param chunk The buffer to fill
+   * @param max   The largest number of integers to read
+   *
+   * @return The number of integers read (0 at the end of the stream)
+   */
+  size_t next(unsigned *chunk, size_t max) {
+    unsigned char *dst = (unsigned char *)chunk;
+    size_t want = max * sizeof(unsigned);
+    size_t have = std::min(want, pending.size());
+    memcpy(dst, pending.data(), have);
+    pending.erase(pending.begin(), pending.begin() + have);
+    have += fread(dst + have, 1, want - have, file);
+    if (ferror(file)) {
+      char buf[1024];
+      fprintf(stderr, "Error reading %s: %s\n", name.c_str(),
+              strerror_r(errno, buf, sizeof(buf)));
+      exit(0);
+    }
+    if (have % sizeof(unsigned) != 0) {
+      fprintf(stderr, "%s ends with a partial integer\n", name.c_str());
+      exit(0);
+    }
+    return have / sizeof(unsigned);
+  }
+};
+
+/**
+ * One sorted run of an external merge sort, spilled to a temporary file, and
+ * then read back through a buffer during the merge
+ */
+struct sorted_run_t {
+  /** The temporary file */
+  FILE *file;
+
+  /** The buffer of values read back from the file */
+  std::vector<unsigned> buf;
+
+  /** The position of the next value in buf */
+  size_t pos = 0;
+
+  /** The number of values in buf */
+  size_t len = 0;
+
+  /** The number of merge passes that made this run (0 for a spilled chunk) */
+  int level = 0;
+
+  /**
+   * Make an empty run in a temporary file in `dir`.  The file is unlinked
+   * right away, so it disappears when we're done, even if we crash.
+   */
+  explicit sorted_run_t(const std::string &dir) {
+    std::string path = dir + "/int_ops_run.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0 || unlink(path.c_str()) != 0 ||
+        (file = fdopen(fd, "w+b")) == nullptr) {
+      char err[1024];
+      fprintf(stderr, "Error making a temporary file in %s: %s\n", dir.c_str(),
+              strerror_r(errno, err, sizeof(err)));
+      exit(0);
+    }
+  }
+
+  /** Close the file */
+  ~sorted_run_t() { fclose(file); }
+
+  sorted_run_t(const sorted_run_t &) = delete;
+  sorted_run_t &operator=(const sorted_run_t &) = delete;
+
+  /** Write a sorted chunk to the run */
+  void write(const unsigned *chunk, size_t num) {
+    if (fwrite(chunk, sizeof(unsigned), num, file) != num) {
+      char err[1024];
+      fprintf(stderr, "Error writing a sorted run: %s\n",
+              strerror_r(errno, err, sizeof(err)));
+      exit(0);
+    }
+  }
+
+  /** Get ready to read the run back, with a buffer of `buf_size` values */
+  void rewind(size_t buf_size) {
+    fflush(file);
+    fseek(file, 0, SEEK_SET);
+    buf.resize(buf_size);
+  }
+
+  /**
+   * Get the next value of the run
+   *
+   * @param v The value, as an out parameter
+   *
+   * @return false if the run has no more values
+   */
+  bool next(unsigned &v) {
+    if (pos == len) {
+      len = fread(buf.data(), sizeof(unsigned), buf.size(), file);
+      pos = 0;
+      if (len == 0)
+        return false;
+    }
+    v = buf[pos++];
+    return true;
+  }
+};
+
+/**
+ * Merge the runs from `first` to the end of `runs` with a heap, passing each
+ * value, in order, to `put`, and then remove those runs
+ *
+ * @param runs     The runs
+ * @param first    The index of the first run to merge
+ * @param buf_size The number of values to buffer for each run
+ * @param put      What to do with each value
+ */
+template <class put_t>
+void merge_runs(std::vector<std::unique_ptr<sorted_run_t>> &runs, size_t first,
+                size_t buf_size, put_t put) {
+  typedef std::pair<unsigned, size_t> head_t; // (value, run)
+  std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t>> heads;
+  for (size_t r = first; r < runs.size(); ++r) {
+    runs[r]->rewind(buf_size);
+    unsigned v;
+    if (runs[r]->next(v))
+      heads.push({v, r});
+  }
+  while (!heads.empty()) {
+    head_t h = heads.top();
+    heads.pop();
+    put(h.first);
+    unsigned v;
+    if (runs[h.second]->next(v))
+      heads.push({v, h.second});
+  }
+  runs.resize(first);
+}
+
+/**
+ * Merge the last MAX_MERGE_FANIN runs into one intermediate run, one level
+ * above the highest of them
+ *
+ * @param runs     The runs
+ * @param buf_size The number of values to buffer for each run
+ * @param dir      Where to put the new run's temporary file
+ */
+void merge_last_runs(std::vector<std::unique_ptr<sorted_run_t>> &runs,
+                     size_t buf_size, const std::string &dir) {
+  size_t first = runs.size() - MAX_MERGE_FANIN;
+  std::unique_ptr<sorted_run_t> merged(new sorted_run_t(dir));
+  for (size_t r = first; r < runs.size(); ++r)
+    merged->level = std::max(merged->level, runs[r]->level + 1);
+  std::vector<unsigned> out;
+  out.reserve(buf_size);
+  merge_runs(runs, first, buf_size, [&](unsigned v) {
+    out.push_back(v);
+    if (out.size() == out.capacity()) {
+      merged->write(out.data(), out.size());
+      out.clear();
+    }
+  });
+  merged->write(out.data(), out.size());
+  runs.push_back(std::move(merged));
+}
+
+/**
+ * Write a stream of values to stdout (raw, like -b) or to a file (with a
+ * header, like -o), through a large buffer
+ */
+struct stream_writer_t {
+  /** The file being written */
+  FILE *file;
+
+  /** Should the file have a header? */
+  bool with_header;
+
+  /** The buffer of values not yet written */
+  std::vector<unsigned> buf;
+
+  /** The number of values written so far */
+  uint64_t count = 0;
+
+  /**
+   * Open the output, and leave room for the header if there is one
+   *
+   * @param filename The file to write, or "-" for stdout
+   * @param buf_size The number of values to buffer
+   */
+  stream_writer_t(const std::string &filename, size_t buf_size)
+      : with_header(filename != "-") {
+    file = with_header ? fopen(filename.c_str(), "wb") : stdout;
+    array_header_t header = {};
+    if (file == nullptr ||
+        (with_header && fwrite(&header, sizeof(header), 1, file) != 1)) {
+      fail();
+    }
+    buf.reserve(buf_size);
+  }
+
+  /** Report a write error and exit */
+  void fail() {
+    char err[1024];
+    fprintf(stderr, "Error writing sorted output: %s\n",
+            strerror_r(errno, err, sizeof(err)));
+    exit(0);
+  }
+
+  /** Write the buffered values */
+  void flush() {
+    if (fwrite(buf.data(), sizeof(unsigned), buf.size(), file) != buf.size())
+      fail();
+    count += buf.size();
+    buf.clear();
+  }
+
+  /** Add one value to the output */
+  void put(unsigned v) {
+    buf.push_back(v);
+    if (buf.size() == buf.capacity())
+      flush();
+  }
+
+  /** Write everything, and fill in the header now that we know the count */
+  void finish() {
+    flush();
+    if (with_header) {
+      array_header_t header = {};
+      memcpy(header.magic, ARRAY_MAGIC, sizeof(header.magic));
+      header.count = count;
+      header.elem_size = sizeof(unsigned);
+      header.flags = ARRAY_SORTED;
+      if (fseek(file, 0, SEEK_SET) != 0 ||
+          fwrite(&header, sizeof(header), 1, file) != 1 || fclose(file) != 0)
+        fail();
+    } else if (fflush(file) != 0) {
+      fail();
+    }
+  }
+};
+
+/**
+ * Format a 128-bit unsigned integer (printf can't)
+ *
+ * @param v The value to format
+ *
+ * @return The value, in decimal
+ */
+std::string u128_to_string(unsigned __int128 v) {
+  std::string res;
+  do {
+    res.insert(res.begin(), '0' + (int)(v % 10));
+    v /= 10;
+  } while (v != 0);
+  return res;
+}
+
+/**
+ * Process a stream of integers that may be much bigger than memory.  The
+ * stream is read one chunk at a time, and every chunk goes through every
+ * requested operation before the next chunk is read:
+ * - count, min, max, sum, and mean, which are always reported
+ * - approximate quantiles, from a quantile_sketch_t
+ * - the k largest values, kept in a min-heap of size k
+ * - the -l/-c/-L/-m scans, with the SIMD kernels
+ * - an external merge sort: each chunk is sorted, and spilled to disk as a
+ *   run, and runs are merged with a heap, at most MAX_MERGE_FANIN at a time.
+ *   Whenever the newest MAX_MERGE_FANIN runs are all at the same level, they
+ *   are merged into one run at the next level, and at the end the remaining
+ *   runs are merged (in more than one pass, if there are too many of them).
+ * So memory use is about two chunks, plus k, plus the merge buffers (which,
+ * all together, are the size of one chunk).
+ *
+ * @param args   The program arguments
+ * @param policy How to allocate the chunk buffers
+ */
+void run_stream(const arg_t &args, const alloc_policy_t &policy) {
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  stream_reader_t in(args.streamfile);
+  size_t chunk_size = std::max<size_t>(1, args.chunk);
+  unsigned *chunk = alloc_array(chunk_size, policy);
+  const scan_kernels_t &kernels = pick_kernels(args.kernel);
+
+  uint64_t count = 0;
+  unsigned lo = UINT32_MAX, hi = 0;
+  unsigned __int128 sum = 0;
+  quantile_sketch_t sketch;
+  std::priority_queue<unsigned, std::vector<unsigned>, std::greater<unsigned>>
+      topk;
+  long first_l = -1;
+  size_t matches = 0;
+  std::vector<long> first_m(args.multikeys.size(), -1);
+  std::vector<std::unique_ptr<sorted_run_t>> runs;
+  bool external_sort = !args.sortfile.empty();
+  // When the sorted output goes to stdout, the report (including the -L
+  // matches, which are printed as they are found) goes to stderr, so the two
+  // don't mix
+  FILE *report = (args.sortfile == "-") ? stderr : stdout;
+  size_t merge_buf_size =
+      std::max<size_t>(4096, chunk_size / (MAX_MERGE_FANIN + 1));
+
+  size_t n;
+  while ((n = in.next(chunk, chunk_size)) > 0) {
+    uint64_t sum_chunk = 0; // NB: n < 2^32 values per chunk can't overflow this
+    for (size_t i = 0; i < n; ++i) {
+      lo = std::min(lo, chunk[i]);
+      hi = std::max(hi, chunk[i]);
+      sum_chunk += chunk[i];
+      sketch.record(chunk[i]);
+    }
+    sum += sum_chunk;
+
+    // NB: most values are smaller than the smallest of the top k, so this is
+    //     usually just one comparison
+    for (size_t i = 0; i < n && args.topk > 0; ++i) {
+      if (topk.size() < args.topk) {
+        topk.push(chunk[i]);
+      } else if (chunk[i] > topk.top()) {
+        topk.pop();
+        topk.push(chunk[i]);
+      }
+    }
+
+    // Scans report positions in the whole stream, not in the chunk
+    if (args.lskey.first && first_l == -1) {
+      long idx = scan_find_first(kernels, chunk, n, args.lskey.second,
+                                 args.threads);
+      if (idx != -1)
+        first_l = count + idx;
+    }
+    if (args.countkey.first)
+      matches += scan_count(kernels, chunk, n, args.countkey.second,
+                            args.threads);
+    if (args.allkey.first)
+      for (size_t idx : scan_find_all(kernels, chunk, n, args.allkey.second,
+                                      args.threads))
+        fprintf(report, "a[%lu] == %u\n", count + idx, args.allkey.second);
+    if (!args.multikeys.empty()) {
+      std::vector<long> f = scan_find_first_multi(kernels, chunk, n,
+                                                  args.multikeys, args.threads);
+      for (size_t j = 0; j < f.size(); ++j)
+        if (first_m[j] == -1 && f[j] != -1)
+          first_m[j] = count + f[j];
+    }
+
+    if (external_sort) {
+      parallel_sort_array(chunk, n, args.threads, policy);
+      runs.emplace_back(new sorted_run_t(args.spilldir));
+      runs.back()->write(chunk, n);
+      // NB: levels never increase from the front of runs to the back, so the
+      //     newest MAX_MERGE_FANIN runs share a level if the ends do
+      while (runs.size() >= MAX_MERGE_FANIN &&
+             runs.back()->level ==
+                 runs[runs.size() - MAX_MERGE_FANIN]->level)
+        merge_last_runs(runs, merge_buf_size, args.spilldir);
+    }
+    count += n;
+  }
+  free_array(chunk, chunk_size, policy);
+
+  // Merge the runs into the output
+  if (external_sort) {
+    while (runs.size() > MAX_MERGE_FANIN)
+      merge_last_runs(runs, merge_buf_size, args.spilldir);
+    size_t buf_size = std::max<size_t>(4096, chunk_size / (runs.size() + 1));
+    stream_writer_t out(args.sortfile, buf_size);
+    merge_runs(runs, 0, buf_size, [&](unsigned v) { out.put(v); });
+    out.finish();
+  }
+
+  // Report everything
+  fprintf(report, "count %lu\n", count);
+  if (count > 0) {
+    fprintf(report, "min %u\nmax %u\nsum %s\nmean %.3f\n", lo, hi,
+            u128_to_string(sum).c_str(), (double)sum / count);
+    for (double pct : {50.0, 90.0, 99.0, 99.9})
+      fprintf(report, "p%g ~%u\n", pct, std::min(sketch.percentile(pct), hi));
+  }
+  if (args.topk > 0) {
+    std::vector<unsigned> largest;
+    while (!topk.empty()) {
+      largest.push_back(topk.top());
+      topk.pop();
+    }
+    fprintf(report, "top %zu:", largest.size());
+    for (auto it = largest.rbegin(); it != largest.rend(); ++it)
+      fprintf(report, " %u", *it);
+    fprintf(report, "\n");
+  }
+  if (args.lskey.first) {
+    if (first_l != -1)
+      fprintf(report, "a[%ld] == %u\n", first_l, args.lskey.second);
+    else
+      fprintf(report, "key %u not found\n", args.lskey.second);
+  }
+  if (args.countkey.first)
+    fprintf(report, "key %u appears %zu times\n", args.countkey.second,
+            matches);
+  for (size_t j = 0; j < first_m.size(); ++j) {
+    if (first_m[j] != -1)
+      fprintf(report, "a[%ld] == %u\n", first_m[j], args.multikeys[j]);
+    else
+      fprintf(report, "key %u not found\n", args.multikeys[j]);
+  }
+  if (args.timing) {
+    std::chrono::duration<double> secs =
+        std::chrono::steady_clock::now() - start_time;
+    fprintf(stderr, "Streamed %lu elements (%zu sorted runs) in %.6f seconds\n",
+            count, runs.size(), secs.count());
+  }
+}
+
 int main(int argc, char *argv[]) {
   arg_t args;
   parse_args(argc, argv, args);
@@ -237,10 +2078,66 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  // make the array, and maybe sort it
-  unsigned *arr = create_array(args.num, args.seed);
-  if (args.sort)
-    sort_array(arr, args.num);
+  // NB: looking up many keys needs a sorted array
+  bool many_queries = !args.queryfile.empty() || args.num_queries > 0;
+  if (many_queries)
+    args.sort = true;
+
+  alloc_policy_t policy;
+  policy.pages = args.pages;
+  policy.numa = args.numa;
+  policy.threads = args.threads;
+
+  // in streaming mode, there's no array at all
+  if (!args.streamfile.empty()) {
+    run_stream(args, policy);
+    return 0;
+  }
+
+  // make (or load) the array, and maybe sort it
+  std::chrono::steady_clock::time_point create_time =
+      std::chrono::steady_clock::now();
+  unsigned *arr;
+  bool sorted = false;
+  if (!args.infile.empty())
+    arr = load_array(args.infile, args.num, sorted);
+  else if (args.parallel_generate)
+    arr = create_array_parallel(args.num, args.seed, args.threads, policy);
+  else
+    arr = create_array(args.num, args.seed, policy);
+  if (args.timing) {
+    std::chrono::duration<double> secs =
+        std::chrono::steady_clock::now() - create_time;
+    fprintf(stderr, "%s %zu elements in %.6f seconds (pages=%s, numa=%s)\n",
+            args.infile.empty() ? "Generated" : "Loaded", args.num,
+            secs.count(), args.pages.c_str(), args.numa.c_str());
+  }
+  // NB: there's no need to sort an array that was saved after sorting
+  if (args.sort && !sorted) {
+    std::chrono::steady_clock::time_point start_time =
+        std::chrono::steady_clock::now();
+    if (args.algorithm == "qsort") {
+      sort_array(arr, args.num);
+    } else if (args.algorithm == "std") {
+      std_sort_array(arr, args.num);
+    } else if (args.algorithm == "radix") {
+      radix_sort_array(arr, args.num, policy);
+    } else if (args.algorithm == "parallel") {
+      parallel_sort_array(arr, args.num, args.threads, policy);
+    } else {
+      fprintf(stderr, "Unknown sort algorithm %s\n", args.algorithm.c_str());
+      exit(0);
+    }
+    if (args.timing) {
+      std::chrono::duration<double> secs =
+          std::chrono::steady_clock::now() - start_time;
+      fprintf(stderr, "Sorted %zu elements with %s in %.6f seconds\n",
+              args.num, args.algorithm.c_str(), secs.count());
+    }
+    sorted = true;
+  }
+  if (!args.outfile.empty())
+    save_array(args.outfile, arr, args.num, sorted);
 
   // do any requested searches
   //
@@ -248,18 +2145,74 @@ int main(int argc, char *argv[]) {
   //     the impact of linear vs. binary search, but the cost of creating the
   //     array will get in the way of drawing good conclusions.
   if (args.bskey.first) {
-    int idx = binary_search(arr, 0, args.num - 1, args.bskey.second);
+    long idx = binary_search(arr, 0, (long)args.num - 1, args.bskey.second);
     if (idx != -1)
-      printf("a[%d] == %u\n", idx, arr[idx]);
+      printf("a[%ld] == %u\n", idx, arr[idx]);
     else
       printf("key %u not found\n", args.bskey.second);
   }
-  if (args.lskey.first) {
-    int idx = linear_search(arr, args.num, args.lskey.second);
-    if (idx != -1)
-      printf("a[%d] == %u\n", idx, arr[idx]);
-    else
-      printf("key %u not found\n", args.lskey.second);
+  //
+  // NB: the scans below use SIMD kernels (on many threads, for big arrays),
+  //     not linear_search()
+  bool any_scan = args.lskey.first || args.countkey.first ||
+                  args.allkey.first || !args.multikeys.empty();
+  if (any_scan) {
+    const scan_kernels_t &kernels = pick_kernels(args.kernel);
+    std::chrono::steady_clock::time_point start_time =
+        std::chrono::steady_clock::now();
+    if (args.lskey.first) {
+      long idx = scan_find_first(kernels, arr, args.num, args.lskey.second,
+                                 args.threads);
+      if (idx != -1)
+        printf("a[%ld] == %u\n", idx, arr[idx]);
+      else
+        printf("key %u not found\n", args.lskey.second);
+    }
+    if (args.countkey.first) {
+      printf("key %u appears %zu times\n", args.countkey.second,
+             scan_count(kernels, arr, args.num, args.countkey.second,
+                        args.threads));
+    }
+    if (args.allkey.first) {
+      for (size_t idx : scan_find_all(kernels, arr, args.num,
+                                      args.allkey.second, args.threads))
+        printf("a[%zu] == %u\n", idx, arr[idx]);
+    }
+    if (!args.multikeys.empty()) {
+      std::vector<long> first = scan_find_first_multi(
+          kernels, arr, args.num, args.multikeys, args.threads);
+      for (size_t j = 0; j < first.size(); ++j) {
+        if (first[j] != -1)
+          printf("a[%ld] == %u\n", first[j], arr[first[j]]);
+        else
+          printf("key %u not found\n", args.multikeys[j]);
+      }
+    }
+    if (args.timing) {
+      std::chrono::duration<double> secs =
+          std::chrono::steady_clock::now() - start_time;
+      fprintf(stderr, "Scanned %zu elements with %s kernels in %.6f seconds\n",
+              args.num, kernels.name, secs.count());
+    }
+  }
+
+  // look up many keys, with one or all search methods
+  //
+  // NB: to see the impact of the memory hierarchy, run this with -n values
+  //     that fit in L1, L2, L3, and only in DRAM
+  if (many_queries) {
+    std::vector<unsigned> keys =
+        args.queryfile.empty()
+            ? random_queries(arr, args.num, args.num_queries, args.seed + 1)
+            : read_queries(args.queryfile);
+    eytzinger_t index(arr, args.num, policy);
+    printf("method,elements,queries,found,seconds,lookups_per_sec\n");
+    if (args.method == "all") {
+      for (const char *m : {"linear", "binary", "eytzinger", "batch"})
+        run_searches(m, arr, args.num, index, keys);
+    } else {
+      run_searches(args.method, arr, args.num, index, keys);
+    }
   }
 
   // do any requested prints
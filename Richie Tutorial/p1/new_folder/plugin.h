@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+/// The plugin ABI.  A plugin function gets its input as a pointer and a length,
+/// so the host never has to copy the text (or build a std::string) to call it.
+/// It also gets a scratch buffer with room for at least `len` bytes.  It
+/// returns a pointer to its output, and sets *out_len to the output's length.
+/// The output is either the input itself (for functions, like simple_print,
+/// that don't change the text), or the scratch buffer.
+///
+/// NB: the output can't be longer than the input
+///
+/// NB: the scratch buffer never overlaps the input, so a function may write
+///     to it while it is still reading the input
+///
+/// NB: functions must have C linkage, so that dlsym can find them by name
+extern "C" {
+typedef const char *(*funct)(const char *text, size_t len, char *buf,
+                             size_t *out_len);
+}
@@ -1,10 +1,22 @@
 #include <iostream>
 #include <string>
 
+#include "plugin.h"
+
 // to export a function, it must have C linkage
 extern "C" {
 /// Print a newline-terminated message to the console
 ///
 /// @param message The message to print
-void simple_print(std::string message) { std::cout << message << std::endl; }
+/// @param len     The length of the message
+/// @param out_len Set to len, since the message passes through unchanged
+///
+/// @return the message
+const char *simple_print(const char *message, size_t len, char *,
+                         size_t *out_len) {
+  // NB: '\n' instead of endl, so that we don't flush after every message
+  std::cout.write(message, len) << '\n';
+  *out_len = len;
+  return message;
+}
 }
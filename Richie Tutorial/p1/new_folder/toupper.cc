@@ -1,16 +1,42 @@
-#include <iostream> // cout, endl
+#include <cctype>   // toupper
+#include <iostream> // cout
 #include <string>   // string
 #include <locale>   // locale and toupper
 
+#include "plugin.h"
+
 extern "C" {
 /// print a message in all caps
 ///
 /// @param message The message to print
-void print_upper(std::string message) {
+/// @param len     The length of the message
+/// @param out_len Set to len, since the message passes through unchanged
+///
+/// @return the message
+const char *print_upper(const char *message, size_t len, char *,
+                        size_t *out_len) {
     using namespace std;
     locale loc;
-    for (string::size_type i = 0; i < message.length(); ++i)
+    for (size_t i = 0; i < len; ++i)
         cout << toupper(message[i], loc);
-    cout << endl;
+    cout << '\n';
+    *out_len = len;
+    return message;
+}
+
+/// convert a message to all caps, for the next function in a pipeline
+///
+/// @param message The message to convert
+/// @param len     The length of the message
+/// @param buf     Where to put the converted message
+/// @param out_len Set to len
+///
+/// @return buf
+const char *to_upper(const char *message, size_t len, char *buf,
+                     size_t *out_len) {
+    for (size_t i = 0; i < len; ++i)
+        buf[i] = std::toupper((unsigned char)message[i]);
+    *out_len = len;
+    return buf;
 }
 }
@@ -1,29 +1,249 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include <unistd.h>
 #include <string>
-#include <map>
 #include <dlfcn.h>
 #include <vector>
 #include "menu.h"
+#include "plugin.h"
 
 using namespace std;
 
 /// The text to use in any module invocation
 string current_text = "";
 
-/// A collection of functions that we can invoke.
+/// One slot of the function registry
+struct slot_t {
+  string name;      ///< The name the function was registered as
+  uint64_t hash;    ///< The hash of name
+  funct f = nullptr; ///< The function, or nullptr if the slot is empty
+};
+
+/// The function registry: an open-addressing hash table (with linear probing)
+/// from names to functions.  A lookup hashes the name once, and then usually
+/// compares against a single slot, instead of walking a tree of string
+/// comparisons the way a std::map would.
 ///
-/// NB: functions must have C linkage!
-extern "C" {
-    typedef void(*funct)(string); // pointer to a function taking a string
-}
+/// NB: hot loops shouldn't look functions up at all.  Look each name up once,
+///     and then call through the funct that find() returned.
+class registry_t {
+  /// The slots (the number of slots is always a power of 2)
+  vector<slot_t> slots = vector<slot_t>(16);
+
+  /// The number of full slots
+  size_t count = 0;
 
-/// A map of string/function pairs
-map<string, funct> functions;
+  /// Hash a name (64-bit FNV-1a)
+  static uint64_t hash(const string &name) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : name)
+      h = (h ^ c) * 0x100000001b3ull;
+    return h;
+  }
+
+  /// Return the index of the slot holding name, or of the empty slot where it
+  /// would go
+  size_t probe(const string &name, uint64_t h) const {
+    size_t mask = slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask)
+      if (slots[i].f == nullptr || (slots[i].hash == h && slots[i].name == name))
+        return i;
+  }
+
+public:
+  /// Add a function, unless the name is already taken
+  ///
+  /// @return false if the name was already taken
+  bool insert(const string &name, funct f) {
+    // NB: stay at most half full, so that probe sequences stay short
+    if (2 * (count + 1) > slots.size()) {
+      vector<slot_t> old(slots.size() * 2);
+      old.swap(slots);
+      for (auto &s : old)
+        if (s.f != nullptr)
+          slots[probe(s.name, s.hash)] = s;
+    }
+    uint64_t h = hash(name);
+    slot_t &s = slots[probe(name, h)];
+    if (s.f != nullptr)
+      return false;
+    s = {name, h, f};
+    ++count;
+    return true;
+  }
+
+  /// Find a function by name
+  ///
+  /// @return the function, or nullptr if there is none with that name
+  funct find(const string &name) const {
+    return slots[probe(name, hash(name))].f;
+  }
+
+  /// Return the names of all registered functions
+  vector<string> names() const {
+    vector<string> res;
+    for (auto &s : slots)
+      if (s.f != nullptr)
+        res.push_back(s.name);
+    return res;
+  }
+};
+
+/// The registered functions
+registry_t functions;
 
 /// All of the currently open .so files
 vector<void*> open_handles;
 
+/// Open a .so, find a function in it, and register the function
+///
+/// @param so_name   The .so file
+/// @param func_name The function's name in the .so file
+/// @param reg_name  The name to remember the function by
+///
+/// @return true on success
+bool loadFunction(const string &so_name, const string &func_name,
+                  const string &reg_name) {
+  void *handle = dlopen(so_name.c_str(), RTLD_LAZY);
+  if (!handle) {
+    cout << "Error opening " << so_name << endl;
+    return false;
+  }
+  dlerror();
+  funct f = (funct)dlsym(handle, func_name.c_str());
+  char *error;
+  if ((error = dlerror()) != NULL || f == nullptr) {
+    cout << "Error locating " << func_name << " in " << so_name << endl;
+    dlclose(handle);
+    return false;
+  }
+  // save the function
+  functions.insert(reg_name, f);
+
+  // NB: we can't close the .so or we lose the reference to the function.
+  // save the handle here, clean it on exit from the program
+  open_handles.push_back(handle);
+  return true;
+}
+
+/// One line of a plugin manifest
+struct manifest_entry_t {
+  string so_name;   ///< The .so file
+  string func_name; ///< The function's name in the .so file
+  string reg_name;  ///< The name to register the function as
+  size_t lib;       ///< The index of so_name in the manifest's list of libraries
+};
+
+/// Read a manifest file.  Each line of the file is
+/// "<.so file> <function name> <name to register it as>"; blank lines and
+/// lines starting with '#' are ignored.
+///
+/// @param file    The manifest file
+/// @param entries The manifest's lines
+/// @param libs    The distinct .so files in the manifest
+///
+/// @return false on error
+bool readManifest(const string &file, vector<manifest_entry_t> &entries,
+                  vector<string> &libs) {
+  ifstream in(file);
+  if (!in) {
+    cerr << "Error opening " << file << endl;
+    return false;
+  }
+  string line;
+  while (getline(in, line)) {
+    if (line == "" || line[0] == '#')
+      continue;
+    manifest_entry_t e;
+    istringstream fields(line);
+    if (!(fields >> e.so_name >> e.func_name >> e.reg_name)) {
+      cerr << "Bad manifest line: " << line << endl;
+      return false;
+    }
+    e.lib = find(libs.begin(), libs.end(), e.so_name) - libs.begin();
+    if (e.lib == libs.size())
+      libs.push_back(e.so_name);
+    entries.push_back(e);
+  }
+  return true;
+}
+
+/// Load every function listed in a manifest file (see readManifest).
+///
+/// Each distinct .so is opened once, on its own thread, and by default with
+/// RTLD_NOW, so that all of its symbols are bound at startup instead of on the
+/// first call through each PLT entry.  The functions are then registered in
+/// manifest order.
+///
+/// NB: the dynamic loader holds a global lock while it maps and relocates a
+///     library, so the threads mostly overlap the file I/O and page faults,
+///     not the relocation work itself
+///
+/// @param file The manifest file
+/// @param lazy Use RTLD_LAZY instead of RTLD_NOW (to measure the difference)
+///
+/// @return true if every function was loaded
+bool loadManifest(const string &file, bool lazy) {
+  vector<manifest_entry_t> entries;
+  vector<string> libs;
+  if (!readManifest(file, entries, libs))
+    return false;
+
+  // Open the libraries and find the functions, one thread per library
+  auto t1 = chrono::high_resolution_clock::now();
+  vector<void *> handles(libs.size(), nullptr);
+  vector<funct> fs(entries.size(), nullptr);
+  vector<thread> threads;
+  for (size_t i = 0; i < libs.size(); ++i)
+    threads.emplace_back([&, i]() {
+      handles[i] = dlopen(libs[i].c_str(), lazy ? RTLD_LAZY : RTLD_NOW);
+      if (handles[i] == nullptr)
+        return;
+      for (size_t j = 0; j < entries.size(); ++j)
+        if (entries[j].lib == i)
+          fs[j] = (funct)dlsym(handles[i], entries[j].func_name.c_str());
+    });
+  for (auto &t : threads)
+    t.join();
+  auto t2 = chrono::high_resolution_clock::now();
+
+  // Register the functions, and keep the handles until exit
+  bool ok = true;
+  for (size_t i = 0; i < libs.size(); ++i) {
+    if (handles[i] == nullptr) {
+      cerr << "Error opening " << libs[i] << endl;
+      ok = false;
+    } else {
+      open_handles.push_back(handles[i]);
+    }
+  }
+  for (size_t j = 0; j < entries.size(); ++j) {
+    auto &e = entries[j];
+    if (fs[j] == nullptr) {
+      if (handles[e.lib] != nullptr)
+        cerr << "Error locating " << e.func_name << " in " << e.so_name
+             << endl;
+      ok = false;
+    } else {
+      functions.insert(e.reg_name, fs[j]);
+    }
+  }
+  cerr << "Loaded " << entries.size() << " functions from " << libs.size()
+       << " libraries (" << (lazy ? "RTLD_LAZY" : "RTLD_NOW") << ") in "
+       << chrono::duration<double, micro>(t2 - t1).count() << " us" << endl;
+  return ok;
+}
+
 /// Get text from the user
 void getText() {
   cout << "Enter some text :> ";
@@ -33,9 +253,8 @@ void getText() {
   }
 }
 
-/// Register a function.  First get the so name and open it, or fail.  Then
-/// get the function name and find it, or fail.  Then get a string to use to
-/// remember the function, and put it in the map.
+/// Register a function.  First get the so name, then the function name, then
+/// a string to use to remember the function, and then load it.
 void registerFunction() {
   string so_name, func_name, reg_name;
 
@@ -46,50 +265,31 @@ void registerFunction() {
     cin.clear();
     return;
   }
-  void *handle = dlopen(so_name.c_str(), RTLD_LAZY);
-  if (!handle) {
-    cout << "Error opening " << so_name << endl;
-    return;
-  }
 
   // function
   cout << "Enter the function name to load, or ctrl-D to return :> ";
   getline(cin, func_name);
   if (func_name == "") {
-    dlclose(handle);
     cin.clear();
     return;
   }
-  funct f = (funct)dlsym(handle, func_name.c_str());
-  char *error;
-  if ((error = dlerror()) != NULL) {
-    cout << "Error locating " << func_name << " in " << so_name << endl;
-    dlclose(handle);
-    return;
-  }
 
   // string key
   cout << "Enter the name to use when remembering this function, or ctrl-D to "
           "return :> ";
   getline(cin, reg_name);
   if (reg_name == "") {
-    dlclose(handle);
     cin.clear();
     return;
   }
-  // save the function
-  functions.insert(std::make_pair(reg_name, f));
-
-  // NB: we can't close the .so or we lose the reference to the function.
-  // save the handle here, clean it on exit from the program
-  open_handles.push_back(handle);
+  loadFunction(so_name, func_name, reg_name);
 }
 
-/// List all keys in the map
+/// List all registered function names
 void listKeys() {
   cout << "Functions (one per line)" << endl;
-  for (auto i = functions.begin(), e = functions.end(); i != e; ++i) {
-    cout << i->first << endl;
+  for (auto &name : functions.names()) {
+    cout << name << endl;
   }
   cout << endl;
 }
@@ -106,17 +306,459 @@ void invoke() {
   }
 
   // get function
-  auto it = functions.find(f_name);
-  if (it == functions.end()) {
+  funct f = functions.find(f_name);
+  if (f == nullptr) {
     cout << "Could not find function" << endl;
     return;
   }
 
   // invoke function
-  it->second(current_text);
+  vector<char> buf(current_text.size() + 1);
+  size_t len;
+  f(current_text.data(), current_text.size(), buf.data(), &len);
+}
+
+/// Look up every function in a comma-separated pipeline
+///
+/// @param registry The functions to look in
+/// @param pipeline Comma-separated names of registered functions
+/// @param stages   The functions, in pipeline order
+///
+/// @return false if a function is missing
+bool resolvePipeline(const registry_t &registry, const string &pipeline,
+                     vector<funct> &stages) {
+  size_t start = 0;
+  while (start <= pipeline.size()) {
+    size_t end = pipeline.find(',', start);
+    if (end == string::npos)
+      end = pipeline.size();
+    string name = pipeline.substr(start, end - start);
+    funct f = registry.find(name);
+    if (f == nullptr) {
+      cerr << "Could not find function " << name << endl;
+      return false;
+    }
+    stages.push_back(f);
+    start = end + 1;
+  }
+  return true;
+}
+
+/// Pick the scratch buffer for the next stage of a pipeline
+///
+/// @param bufs The two scratch buffers
+/// @param p    The next stage's input
+///
+/// @return whichever of the buffers doesn't hold p
+char *otherBuffer(vector<char> (&bufs)[2], const char *p) {
+  return p == bufs[0].data() ? bufs[1].data() : bufs[0].data();
+}
+
+/// Run every line of a file through a pipeline of registered functions, and
+/// report the throughput.  The functions are looked up once, before the timed
+/// loop, and each line is passed to the first function as a pointer into the
+/// file's contents, so the loop does no lookups, allocations, or copies (other
+/// than the ones the plugins make into the scratch buffers).
+///
+/// The first line is timed on its own, since it pays for any lazy binding of
+/// the plugins' own calls (to the C++ library, for instance) and for cold
+/// caches.
+///
+/// @param file     The input file
+/// @param pipeline Comma-separated names of registered functions
+/// @param repeats  How many times to run the whole file through
+void runBatch(const string &file, const string &pipeline, int repeats) {
+  // Resolve the pipeline
+  vector<funct> stages;
+  if (!resolvePipeline(functions, pipeline, stages))
+    return;
+
+  // Read the whole file, and find the start and length of every line
+  ifstream in(file, ios::binary);
+  if (!in) {
+    cerr << "Error opening " << file << endl;
+    return;
+  }
+  string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  vector<pair<size_t, size_t>> lines;
+  size_t longest = 0;
+  for (size_t pos = 0; pos < text.size();) {
+    const char *nl =
+        (const char *)memchr(text.data() + pos, '\n', text.size() - pos);
+    size_t end = nl ? nl - text.data() : text.size();
+    lines.push_back({pos, end - pos});
+    longest = max(longest, end - pos);
+    pos = end + 1;
+  }
+
+  // Two scratch buffers, so each stage can read one and write the other.
+  // NB: a pass-through stage returns its input, so the stage after it must get
+  //     whichever buffer the input *isn't* in, not just the next one in turn.
+  vector<char> bufs[2] = {vector<char>(longest + 1), vector<char>(longest + 1)};
+  auto run_line = [&](pair<size_t, size_t> &line) {
+    const char *p = text.data() + line.first;
+    size_t len = line.second;
+    for (size_t s = 0; s < stages.size(); ++s)
+      p = stages[s](p, len, otherBuffer(bufs, p), &len);
+  };
+  if (lines.empty())
+    return;
+  auto t0 = chrono::high_resolution_clock::now();
+  run_line(lines[0]);
+  auto t1 = chrono::high_resolution_clock::now();
+  for (int r = 0; r < repeats; ++r)
+    for (size_t i = (r == 0) ? 1 : 0; i < lines.size(); ++i)
+      run_line(lines[i]);
+  auto t2 = chrono::high_resolution_clock::now();
+  cout.flush();
+  double first = chrono::duration<double, micro>(t1 - t0).count();
+  double rest = chrono::duration<double, micro>(t2 - t1).count() /
+                max<double>(1, (double)lines.size() * repeats - 1);
+  cerr << "First line: " << first << " us, later lines: " << rest
+       << " us each" << endl;
+  double secs = chrono::duration<double>(t2 - t0).count();
+  double calls = (double)lines.size() * stages.size() * repeats;
+  cerr << "Lines: " << lines.size() * repeats << ", calls: " << (uint64_t)calls
+       << ", time: " << secs << " seconds, " << calls / secs / 1e6
+       << " million calls/second" << endl;
+}
+
+/// A function table for the hot-reload mode.  Once a table is published, it
+/// never changes; a reload builds a whole new table instead.
+struct table_t {
+  int generation;         ///< How many reloads came before this table
+  vector<void *> handles; ///< The libraries that the functions came from
+  registry_t functions;   ///< The functions, by name
+  vector<funct> stages;   ///< The pipeline, resolved against functions
+};
+
+/// The table that workers should use
+atomic<table_t *> current_table(nullptr);
+
+/// The epoch, which a reload advances after it publishes a new table
+atomic<uint64_t> global_epoch(1);
+
+/// Each worker's read-side epoch: 0 when it isn't using a table, and otherwise
+/// the epoch it saw before it loaded current_table.  Each gets its own line,
+/// since it is written on every invocation.
+struct alignas(128) reader_slot_t {
+  atomic<uint64_t> epoch{0};
+};
+
+/// Copy a library to a new temporary file.  mkstemp creates the file with
+/// O_EXCL and mode 0600, so nobody else can plant a symlink or a different
+/// library at the path we are about to dlopen.
+///
+/// @param lib  The library to copy
+/// @param path Set to the copy's path
+///
+/// @return true if every byte was copied, false on any error
+bool copyLibrary(const string &lib, string &path) {
+  path = "/tmp/plugin.XXXXXX";
+  int out = mkstemp(&path[0]);
+  if (out < 0) {
+    cerr << "Error making a copy of " << lib << ": " << strerror(errno) << endl;
+    return false;
+  }
+  int in = open(lib.c_str(), O_RDONLY);
+  bool ok = in >= 0;
+  char buf[1 << 16];
+  while (ok) {
+    ssize_t n = read(in, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    for (ssize_t done = 0; ok && done < n;) {
+      ssize_t w = write(out, buf + done, n - done);
+      if (w < 0 && errno != EINTR)
+        ok = false;
+      else if (w > 0)
+        done += w;
+    }
+  }
+  if (!ok)
+    cerr << "Error copying " << lib << ": " << strerror(errno) << endl;
+  if (in >= 0)
+    close(in);
+  if (close(out) != 0)
+    ok = false;
+  if (!ok)
+    unlink(path.c_str());
+  return ok;
+}
+
+/// Open every library in a manifest, and build a table from it.  Each library
+/// is copied to a fresh temporary file first, because dlopen returns the
+/// already-open handle for a path that is still loaded, which would keep us
+/// from picking up a rebuilt .so while the old table is still in use.
+///
+/// @param entries    The manifest's lines
+/// @param libs       The manifest's libraries
+/// @param pipeline   The functions the workers call
+/// @param generation The new table's generation
+///
+/// @return the table, or nullptr on error
+table_t *buildTable(const vector<manifest_entry_t> &entries,
+                    const vector<string> &libs, const string &pipeline,
+                    int generation) {
+  table_t *t = new table_t();
+  t->generation = generation;
+  bool ok = true;
+  for (size_t i = 0; i < libs.size() && ok; ++i) {
+    string copy;
+    if (!copyLibrary(libs[i], copy)) {
+      ok = false;
+      break;
+    }
+    void *h = dlopen(copy.c_str(), RTLD_NOW);
+    // NB: the mapping keeps the file alive, so we can remove its name now
+    unlink(copy.c_str());
+    if (h == nullptr) {
+      cerr << "Error opening " << libs[i] << ": " << dlerror() << endl;
+      ok = false;
+      break;
+    }
+    t->handles.push_back(h);
+  }
+  for (size_t j = 0; j < entries.size() && ok; ++j) {
+    funct f = (funct)dlsym(t->handles[entries[j].lib],
+                           entries[j].func_name.c_str());
+    if (f == nullptr) {
+      cerr << "Error locating " << entries[j].func_name << endl;
+      ok = false;
+    } else {
+      t->functions.insert(entries[j].reg_name, f);
+    }
+  }
+  if (ok)
+    ok = resolvePipeline(t->functions, pipeline, t->stages);
+  if (!ok) {
+    for (auto h : t->handles)
+      dlclose(h);
+    delete t;
+    return nullptr;
+  }
+  return t;
+}
+
+/// Wait for an RCU grace period: advance the epoch, then wait until every
+/// worker is either outside of its read-side section or entered it after the
+/// advance.  After that, no worker can still hold a table that was replaced
+/// before the call.
+///
+/// @param slots The workers' read-side epochs
+void synchronize(vector<reader_slot_t> &slots) {
+  uint64_t now = global_epoch.fetch_add(1) + 1;
+  for (auto &s : slots) {
+    while (true) {
+      uint64_t e = s.epoch.load();
+      if (e == 0 || e >= now)
+        break;
+      this_thread::yield();
+    }
+  }
+}
+
+/// Run worker threads that call a pipeline through the published table, while
+/// this thread reloads every library again and again, and report the
+/// workers' throughput and worst invocation latency.
+///
+/// A worker's hot path takes no locks: it stores the epoch in its slot, loads
+/// current_table, runs the pipeline, and clears its slot.  A reload builds a
+/// new table, publishes it with one atomic exchange, waits for a grace period
+/// (synchronize), and only then closes the old table's libraries.
+///
+/// @param manifest    The manifest of plugins to load
+/// @param pipeline    Comma-separated functions that the workers call
+/// @param seconds     How long to run
+/// @param workers     The number of worker threads
+/// @param interval_ms The time between reloads
+void runHotReload(const string &manifest, const string &pipeline, int seconds,
+                  int workers, int interval_ms) {
+  vector<manifest_entry_t> entries;
+  vector<string> libs;
+  if (!readManifest(manifest, entries, libs))
+    return;
+  table_t *first = buildTable(entries, libs, pipeline, 0);
+  if (first == nullptr)
+    return;
+  current_table = first;
+
+  string text = current_text != "" ? current_text : "hot reload test input";
+  vector<reader_slot_t> slots(workers);
+  atomic<bool> stop(false);
+  vector<uint64_t> calls(workers, 0);
+  vector<double> worst_us(workers, 0);
+  vector<thread> threads;
+  for (int w = 0; w < workers; ++w)
+    threads.emplace_back([&, w]() {
+      vector<char> bufs[2] = {vector<char>(text.size() + 1),
+                              vector<char>(text.size() + 1)};
+      uint64_t my_calls = 0;
+      double my_worst = 0;
+      while (!stop.load(memory_order_relaxed)) {
+        auto t1 = chrono::steady_clock::now();
+        // NB: seq_cst store, then load, so a reload can't miss our epoch
+        slots[w].epoch.store(global_epoch.load());
+        table_t *t = current_table.load();
+        const char *p = text.data();
+        size_t len = text.size();
+        for (size_t s = 0; s < t->stages.size(); ++s)
+          p = t->stages[s](p, len, otherBuffer(bufs, p), &len);
+        slots[w].epoch.store(0, memory_order_release);
+        auto t2 = chrono::steady_clock::now();
+        my_calls += t->stages.size();
+        my_worst =
+            max(my_worst, chrono::duration<double, micro>(t2 - t1).count());
+      }
+      calls[w] = my_calls;
+      worst_us[w] = my_worst;
+    });
+
+  // Reload until time runs out
+  auto start = chrono::steady_clock::now();
+  auto end = start + chrono::seconds(seconds);
+  int reloads = 0;
+  double worst_grace_us = 0;
+  while (chrono::steady_clock::now() + chrono::milliseconds(interval_ms) < end) {
+    this_thread::sleep_for(chrono::milliseconds(interval_ms));
+    table_t *fresh = buildTable(entries, libs, pipeline, reloads + 1);
+    if (fresh == nullptr)
+      break;
+    table_t *old = current_table.exchange(fresh);
+    auto g1 = chrono::steady_clock::now();
+    synchronize(slots);
+    auto g2 = chrono::steady_clock::now();
+    worst_grace_us =
+        max(worst_grace_us, chrono::duration<double, micro>(g2 - g1).count());
+    for (auto h : old->handles)
+      dlclose(h);
+    delete old;
+    ++reloads;
+  }
+  this_thread::sleep_until(end);
+  stop = true;
+  for (auto &t : threads)
+    t.join();
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start)
+                    .count();
+
+  uint64_t total = 0;
+  double worst = 0;
+  for (int w = 0; w < workers; ++w) {
+    total += calls[w];
+    worst = max(worst, worst_us[w]);
+  }
+  cout.flush();
+  cerr << "Workers: " << workers << ", calls: " << total << " ("
+       << total / secs / 1e6 << " million/second), reloads: " << reloads
+       << " (generation " << current_table.load()->generation << ")" << endl;
+  cerr << "Worst pipeline call: " << worst
+       << " us, worst grace period: " << worst_grace_us << " us" << endl;
+  table_t *last = current_table.exchange(nullptr);
+  for (auto h : last->handles)
+    dlclose(h);
+  delete last;
+}
+
+/// Print a help message
+void usage(char *progname) {
+  cout << progname << ": Register plugin functions and invoke them" << endl;
+  cout << "  -l [so:func:name] Register func from so as name (repeatable)"
+       << endl;
+  cout << "  -m [file]         Load every function listed in a manifest file"
+       << endl;
+  cout << "  -z                Bind manifest symbols lazily (RTLD_LAZY)" << endl;
+  cout << "  -f [file]         Batch mode: run each line of file through -p"
+       << endl;
+  cout << "  -p [list]         Comma-separated functions for batch mode" << endl;
+  cout << "  -r [int]          Number of passes over the file (default 1)"
+       << endl;
+  cout << "  -H [int]          Hot-reload mode: run workers on -p for this many"
+       << endl;
+  cout << "                    seconds, while reloading the -m plugins" << endl;
+  cout << "  -w [int]          Number of workers for -H (default 2)" << endl;
+  cout << "  -i [int]          Milliseconds between reloads for -H (default 100)"
+       << endl;
+  cout << "  -h                Print help (this message)" << endl;
+  cout << "Without -f, show the interactive menu" << endl;
 }
 
 int main(int argc, char **argv) {
+  // Parse the command line, registering functions as we go
+  string batch_file = "", pipeline = "", manifest = "";
+  int repeats = 1, hot_seconds = 0, workers = 2, interval_ms = 100;
+  bool lazy = false;
+  long opt;
+  while ((opt = getopt(argc, argv, "l:m:zf:p:r:H:w:i:h")) != -1) {
+    switch (opt) {
+    case 'l': {
+      string spec = optarg;
+      size_t a = spec.find(':'), b = spec.rfind(':');
+      if (a == string::npos || a == b) {
+        cerr << "Bad -l argument " << spec << endl;
+        return 0;
+      }
+      if (!loadFunction(spec.substr(0, a), spec.substr(a + 1, b - a - 1),
+                        spec.substr(b + 1)))
+        return 0;
+      break;
+    }
+    case 'm':
+      manifest = optarg;
+      break;
+    case 'z':
+      lazy = true;
+      break;
+    case 'f':
+      batch_file = optarg;
+      break;
+    case 'p':
+      pipeline = optarg;
+      break;
+    case 'r':
+      repeats = atoi(optarg);
+      break;
+    case 'H':
+      hot_seconds = atoi(optarg);
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    case 'i':
+      interval_ms = atoi(optarg);
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    }
+  }
+
+  // Hot-reload mode manages its own copies of the manifest's plugins
+  if (hot_seconds > 0) {
+    if (manifest == "") {
+      cerr << "-H needs a manifest (-m)" << endl;
+      return 0;
+    }
+    runHotReload(manifest, pipeline, hot_seconds, workers, interval_ms);
+    return 0;
+  }
+
+  // Load the manifest, if there is one
+  if (manifest != "" && !loadManifest(manifest, lazy))
+    return 0;
+
+  // Batch mode, instead of the menu
+  if (batch_file != "") {
+    runBatch(batch_file, pipeline, repeats);
+    for (auto i : open_handles)
+      dlclose(i);
+    return 0;
+  }
+
   // repeatedly print the menu and handle a choice
   int choice = -1;
   while (choice != 5) {
@@ -138,13 +780,13 @@ int main(int argc, char **argv) {
     switch (choice) {
     case 1:
       registerFunction();
-      break; 
+      break;
     case 2:
       listKeys();
-      break; 
+      break;
     case 3:
       invoke();
-      break; 
+      break;
     case 4:
       getText();
       break;
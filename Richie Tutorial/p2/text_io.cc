@@ -6,16 +6,29 @@
  * it can be configured to open files to serve as input and/or output.  It also
  * supports appending.  Finally, it allows for the input and/or output files to
  * be accessed as C file streams or Unix file descriptors.
+ *
+ * With -b, text_io becomes a benchmark of I/O "engines": it copies a file with
+ * each of several techniques (stdio, small and large read/write, mmap,
+ * sendfile, copy_file_range, io_uring), and reports the throughput and the
+ * number of system calls of each.  With -d, it measures the cost of calling
+ * back through a std::function instead of a template parameter.
  */
 
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <fcntl.h>
 #include <functional>
 #include <libgen.h>
+#include <linux/io_uring.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
+#include <vector>
 
 /**
  * Display a help message to explain how the command-line parameters for this
@@ -31,6 +44,15 @@ void usage(char *progname) {
   printf("  -o        Use file descriptor instead of stream for output file\n");
   printf("  -O [file] Specify a file to use for output, instead of stdout\n");
   printf("  -a        Open output file in append mode (only works with -O)\n");
+  printf("  -b        Benchmark I/O engines copying -I to -O (default "
+         "/dev/null)\n");
+  printf("  -e [name] Only benchmark this engine (fgets, fgets_inline, read,\n");
+  printf("            read_inline, lines, bigread, mmap, sendfile,\n");
+  printf("            copy_file_range, io_uring)\n");
+  printf("  -k [int]  Chunk size for the large-buffer engines (default 1MB)\n");
+  printf("  -q [int]  Number of io_uring operations in flight (default 8)\n");
+  printf("  -l        Read whole lines (with a large buffer) instead of chunks\n");
+  printf("  -d        Benchmark std::function vs. template dispatch on -I\n");
   printf("  -h        Print help (this message)\n");
 }
 
@@ -51,6 +73,24 @@ struct arg_t {
   /** append to output file? */
   bool append = false;
 
+  /** Should we benchmark the I/O engines? */
+  bool bench = false;
+
+  /** The only engine to benchmark ("" means all of them) */
+  std::string engine = "";
+
+  /** The chunk size for the large-buffer engines */
+  size_t chunk = 1 << 20;
+
+  /** The io_uring queue depth */
+  unsigned depth = 8;
+
+  /** Should the copy hand whole lines to the writer? */
+  bool lines = false;
+
+  /** Should we benchmark callback dispatch? */
+  bool dispatch = false;
+
   /** Is the user requesting a usage message? */
   bool usage = false;
 };
@@ -65,7 +105,7 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "aioI:O:h")) != -1) {
+  while ((opt = getopt(argc, argv, "aioI:O:be:k:q:ldh")) != -1) {
     switch (opt) {
     case 'a':
       args.append = true;
@@ -82,6 +122,24 @@ void parse_args(int argc, char **argv, arg_t &args) {
     case 'O':
       args.out_file = std::string(optarg);
       break;
+    case 'b':
+      args.bench = true;
+      break;
+    case 'e':
+      args.engine = std::string(optarg);
+      break;
+    case 'k':
+      args.chunk = atoi(optarg);
+      break;
+    case 'q':
+      args.depth = atoi(optarg);
+      break;
+    case 'l':
+      args.lines = true;
+      break;
+    case 'd':
+      args.dispatch = true;
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -92,12 +150,17 @@ void parse_args(int argc, char **argv, arg_t &args) {
 /**
  * Read text from a file stream and pass it to a callback function
  *
+ * NB: The callback's type is a template parameter, so each caller gets a copy
+ *     of this function that is specialized for its callback, and a lambda can
+ *     be inlined right into the loop.  Passing a std::function still works,
+ *     but then every call is indirect.
+ *
  * @param file The file stream to read from
  * @param cb   A callback function that operates on each line of text read from
  *             the stream.  It expects to take a pointer to some text, and the
  *             number of valid bytes reachable from that pointer.
  */
-void read_lines_file(FILE *file, std::function<void(const char *, size_t)> cb) {
+template <typename Callback> void read_lines_file(FILE *file, Callback &&cb) {
   // read data into this space on the stack
   char buffer[16];
 
@@ -140,12 +203,14 @@ void write_file(FILE *file, const char *buffer) {
 /**
  * Read text from a file descriptor and pass it to a callback function
  *
+ * NB: As with read_lines_file(), the callback's type is a template parameter.
+ *
  * @param fd The file descriptor to read from
  * @param cb A callback function that operates on each line of text provided by
  *           the user.  It expects to take a pointer to some text, and the
  *           number of valid bytes reachable from that pointer.
  */
-void read_lines_fd(int fd, std::function<void(const char *, size_t)> cb) {
+template <typename Callback> void read_lines_fd(int fd, Callback &&cb) {
   // read data into this space on the stack
   char buffer[12];
 
@@ -176,6 +241,71 @@ void read_lines_fd(int fd, std::function<void(const char *, size_t)> cb) {
   }
 }
 
+/**
+ * Find each line in a buffer, and pass it to a callback function.  memchr() is
+ * vectorized in glibc, so it examines 16-64 bytes per instruction while looking
+ * for '\n'.
+ *
+ * @param buf The text to split
+ * @param num The number of bytes in buf
+ * @param cb  A callback that takes a pointer to a line and its length
+ *            (including the '\n')
+ *
+ * @return The number of bytes at the end of buf that are not a complete line
+ */
+template <typename Callback>
+size_t split_lines(const char *buf, size_t num, Callback &&cb) {
+  const char *start = buf, *end = buf + num;
+  while (const char *nl = (const char *)memchr(start, '\n', end - start)) {
+    cb(start, nl + 1 - start);
+    start = nl + 1;
+  }
+  return end - start;
+}
+
+/**
+ * Read text from a file descriptor and pass it to a callback function, one
+ * whole line at a time.  We read into a large buffer, hand over every complete
+ * line in it, and move any partial line to the front of the buffer before the
+ * next read.  The buffer grows if a single line doesn't fit.
+ *
+ * NB: Unlike read_lines_fd(), the text given to the callback is *not*
+ *     null-terminated, so the callback must use the length.  The last line
+ *     might not end in '\n'.
+ *
+ * @param fd The file descriptor to read from
+ * @param cb A callback that takes a pointer to a line and its length
+ */
+template <typename Callback> void read_whole_lines_fd(int fd, Callback &&cb) {
+  std::vector<char> buffer(1 << 16);
+  size_t len = 0; // bytes of partial line at the front of the buffer
+  while (true) {
+    if (len == buffer.size())
+      buffer.resize(2 * buffer.size());
+    ssize_t bytes_read = read(fd, buffer.data() + len, buffer.size() - len);
+    if (bytes_read < 0) {
+      perror("read_whole_lines_fd::read()");
+      break;
+    } else if (bytes_read == 0) {
+      break;
+    }
+    // The partial line has no '\n', so the first line ends at the first '\n'
+    // in the new bytes.  After that, split whatever else we read.
+    size_t total = len + bytes_read;
+    char *nl = (char *)memchr(buffer.data() + len, '\n', bytes_read);
+    if (nl == nullptr) {
+      len = total;
+      continue;
+    }
+    cb(buffer.data(), nl + 1 - buffer.data());
+    size_t rest = nl + 1 - buffer.data();
+    len = split_lines(buffer.data() + rest, total - rest, cb);
+    memmove(buffer.data(), buffer.data() + total - len, len);
+  }
+  if (len > 0)
+    cb(buffer.data(), len);
+}
+
 /**
  * Write data (not exclusively text) to a file stream
  *
@@ -207,6 +337,586 @@ void write_fd(int fd, const char *buffer, size_t num) {
   }
 }
 
+/**
+ * Write an entire buffer to a file descriptor, retrying after short writes
+ *
+ * @param fd  The file descriptor to write to
+ * @param buf The data to write
+ * @param num The number of bytes to write
+ *
+ * @return true on success, false on error
+ */
+bool write_all(int fd, const char *buf, size_t num) {
+  while (num > 0) {
+    ssize_t bytes = write(fd, buf, num);
+    if (bytes < 0) {
+      perror("write_all::write()");
+      return false;
+    }
+    buf += bytes;
+    num -= bytes;
+  }
+  return true;
+}
+
+/**
+ * The configuration for one run of an I/O engine.  Every engine copies all of
+ * `in_fd` (which has `size` bytes) to `out_fd`.  Engines that make system calls
+ * the kernel doesn't count in /proc/self/io (see read_syscall_counts()) add
+ * them to `other_syscalls`.
+ */
+struct engine_job_t {
+  /** The file to copy from (positioned at offset 0) */
+  int in_fd;
+
+  /** The file to copy to (positioned at offset 0, and empty) */
+  int out_fd;
+
+  /** The number of bytes in the input file */
+  off_t size;
+
+  /** The buffer size for engines that use large buffers */
+  size_t chunk;
+
+  /** The number of io_uring operations to keep in flight */
+  unsigned depth;
+
+  /** System calls that aren't reads or writes */
+  size_t other_syscalls = 0;
+};
+
+/**
+ * The fgets() engine: read_lines_file() and write_file() on FILE* streams.
+ * The callback is a std::function (or, if Inline, a lambda of its own type).
+ */
+template <bool Inline> bool engine_fgets(engine_job_t &job) {
+  FILE *in = fdopen(dup(job.in_fd), "r");
+  FILE *out = fdopen(dup(job.out_fd), "w");
+  if (in == nullptr || out == nullptr) {
+    perror("engine_fgets::fdopen()");
+    return false;
+  }
+  auto print = [&](const char *buf, size_t) { write_file(out, buf); };
+  if (Inline)
+    read_lines_file(in, print);
+  else
+    read_lines_file(in, std::function<void(const char *, size_t)>(print));
+  fclose(in);
+  return fclose(out) == 0;
+}
+
+/**
+ * The read() engine: read_lines_fd() and write_fd() on file descriptors.  The
+ * callback is a std::function (or, if Inline, a lambda of its own type).
+ */
+template <bool Inline> bool engine_read(engine_job_t &job) {
+  auto print = [&](const char *buf, size_t num) {
+    write_fd(job.out_fd, buf, num);
+  };
+  if (Inline)
+    read_lines_fd(job.in_fd, print);
+  else
+    read_lines_fd(job.in_fd, std::function<void(const char *, size_t)>(print));
+  return true;
+}
+
+/**
+ * A callback for whole lines that collects them into a large buffer, and only
+ * calls write() when the buffer is full.  It is a struct with operator(), so
+ * it can be passed to the templated readers and inlined.
+ */
+struct buffered_fd_writer_t {
+  /** The file descriptor to write to */
+  int fd;
+
+  /** The buffered text */
+  std::vector<char> buf;
+
+  /** Create a writer for `fd` that writes `chunk` bytes at a time */
+  buffered_fd_writer_t(int fd, size_t chunk) : fd(fd) { buf.reserve(chunk); }
+
+  /** Add a line (or any text) to the buffer */
+  void operator()(const char *text, size_t num) {
+    if (buf.size() + num > buf.capacity())
+      flush();
+    if (num > buf.capacity())
+      write_fd(fd, text, num);
+    else
+      buf.insert(buf.end(), text, text + num);
+  }
+
+  /** Write everything that is buffered */
+  void flush() {
+    write_fd(fd, buf.data(), buf.size());
+    buf.clear();
+  }
+};
+
+/** The lines engine: read_whole_lines_fd() with a buffered writer */
+bool engine_lines(engine_job_t &job) {
+  buffered_fd_writer_t writer(job.out_fd, job.chunk);
+  read_whole_lines_fd(job.in_fd, writer);
+  writer.flush();
+  return true;
+}
+
+/** The bigread engine: read() and write() with a large, reused buffer */
+bool engine_bigread(engine_job_t &job) {
+  std::vector<char> buf(job.chunk);
+  while (true) {
+    ssize_t bytes = read(job.in_fd, buf.data(), buf.size());
+    if (bytes == 0)
+      return true;
+    if (bytes < 0) {
+      perror("engine_bigread::read()");
+      return false;
+    }
+    if (!write_all(job.out_fd, buf.data(), bytes))
+      return false;
+  }
+}
+
+/**
+ * The mmap engine: map the whole input file, and write() straight from the
+ * mapping, so the data is never copied into a buffer of ours
+ */
+bool engine_mmap(engine_job_t &job) {
+  if (job.size == 0)
+    return true;
+  char *data =
+      (char *)mmap(nullptr, job.size, PROT_READ, MAP_PRIVATE, job.in_fd, 0);
+  if (data == MAP_FAILED) {
+    perror("engine_mmap::mmap()");
+    return false;
+  }
+  // NB: the hint lets the kernel read ahead aggressively
+  madvise(data, job.size, MADV_SEQUENTIAL);
+  job.other_syscalls += 3; // mmap, madvise, munmap
+  bool ok = true;
+  for (off_t off = 0; ok && off < job.size; off += job.chunk)
+    ok = write_all(job.out_fd, data + off,
+                   std::min((off_t)job.chunk, job.size - off));
+  munmap(data, job.size);
+  return ok;
+}
+
+/** The sendfile engine: the kernel copies from the page cache to out_fd */
+bool engine_sendfile(engine_job_t &job) {
+  off_t remain = job.size;
+  while (remain > 0) {
+    ssize_t bytes = sendfile(job.out_fd, job.in_fd, nullptr, remain);
+    if (bytes <= 0) {
+      perror("engine_sendfile::sendfile()");
+      return false;
+    }
+    remain -= bytes;
+  }
+  return true;
+}
+
+/**
+ * The copy_file_range engine: like sendfile, but for file-to-file copies, and
+ * some filesystems can share the blocks instead of copying them
+ *
+ * NB: this only works when out_fd is a regular file
+ */
+bool engine_copy_file_range(engine_job_t &job) {
+  off_t remain = job.size;
+  while (remain > 0) {
+    ssize_t bytes =
+        copy_file_range(job.in_fd, nullptr, job.out_fd, nullptr, remain, 0);
+    if (bytes <= 0) {
+      perror("engine_copy_file_range::copy_file_range()");
+      return false;
+    }
+    remain -= bytes;
+  }
+  return true;
+}
+
+/**
+ * A minimal io_uring, set up with raw system calls (so we don't need liburing).
+ * The kernel and the program share two rings in memory: we put requests in the
+ * submission queue (SQ), and the kernel puts results in the completion queue
+ * (CQ).  One io_uring_enter() call can submit many requests and wait for many
+ * completions.
+ */
+struct uring_t {
+  /** The io_uring file descriptor */
+  int fd = -1;
+
+  /** Pointers into the shared SQ ring */
+  unsigned *sq_tail, *sq_mask, *sq_array;
+
+  /** The submission queue entries */
+  io_uring_sqe *sqes;
+
+  /** Pointers into the shared CQ ring */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+
+  /** The completion queue entries */
+  io_uring_cqe *cqes;
+
+  /** The number of SQEs we've filled but not yet submitted */
+  unsigned to_submit = 0;
+
+  /** The mappings, so that we can unmap them */
+  void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED, *sqe_ptr = MAP_FAILED;
+  size_t sq_len = 0, cq_len = 0, sqe_len = 0;
+
+  /** Create a ring with room for `entries` requests.  Returns false on error */
+  bool setup(unsigned entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+      return false;
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    sqe_len = p.sq_entries * sizeof(io_uring_sqe);
+    sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqe_ptr = mmap(nullptr, sqe_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqe_ptr == MAP_FAILED)
+      return false;
+    char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    sqes = (io_uring_sqe *)sqe_ptr;
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+  }
+
+  /** Release the ring */
+  ~uring_t() {
+    if (sq_ptr != MAP_FAILED)
+      munmap(sq_ptr, sq_len);
+    if (cq_ptr != MAP_FAILED)
+      munmap(cq_ptr, cq_len);
+    if (sqe_ptr != MAP_FAILED)
+      munmap(sqe_ptr, sqe_len);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  /** Queue a read or write (op) of len bytes at off, tagged with `tag` */
+  void prep(uint8_t op, int file, char *buf, unsigned len, off_t off,
+            uint64_t tag) {
+    unsigned tail = *sq_tail, idx = tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = file;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = tag;
+    sq_array[idx] = idx;
+    // NB: the kernel must see the SQE before it sees the new tail
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+  }
+
+  /** Submit everything queued, and wait for at least one completion */
+  bool submit_and_wait() {
+    int ret = syscall(__NR_io_uring_enter, fd, to_submit, 1,
+                      IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (ret < 0)
+      return false;
+    to_submit -= ret;
+    return true;
+  }
+};
+
+/**
+ * The io_uring engine: keep `depth` chunks in flight.  Each chunk is read at
+ * its offset, and when the read completes, written at the same offset of the
+ * output.  Since every write has an explicit offset, they can complete in any
+ * order.
+ *
+ * NB: writing at offsets requires a seekable output (a regular file or
+ *     /dev/null)
+ */
+bool engine_io_uring(engine_job_t &job) {
+  if (lseek(job.out_fd, 0, SEEK_CUR) < 0) {
+    fprintf(stderr, "engine_io_uring: output must be seekable\n");
+    return false;
+  }
+  uring_t ring;
+  if (!ring.setup(2 * job.depth)) {
+    perror("engine_io_uring::io_uring_setup()");
+    return false;
+  }
+  job.other_syscalls += 4; // io_uring_setup, three mmaps
+
+  // Each slot is one chunk that is being read or written
+  struct slot_t {
+    std::vector<char> buf;
+    off_t off = 0;
+    unsigned len = 0, done = 0;
+    bool writing = false, busy = false;
+  };
+  std::vector<slot_t> slots(job.depth);
+  off_t next_off = 0;
+  unsigned busy = 0;
+
+  // Start a read of the next chunk in a slot, if there is any file left
+  auto start_read = [&](unsigned i) {
+    slot_t &s = slots[i];
+    s.busy = next_off < job.size;
+    if (!s.busy)
+      return;
+    s.off = next_off;
+    s.len = std::min((off_t)job.chunk, job.size - next_off);
+    s.done = 0;
+    s.writing = false;
+    next_off += s.len;
+    ++busy;
+    ring.prep(IORING_OP_READ, job.in_fd, s.buf.data(), s.len, s.off, i);
+  };
+  for (unsigned i = 0; i < job.depth; ++i) {
+    slots[i].buf.resize(job.chunk);
+    start_read(i);
+  }
+
+  while (busy > 0) {
+    if (!ring.submit_and_wait()) {
+      perror("engine_io_uring::io_uring_enter()");
+      return false;
+    }
+    ++job.other_syscalls;
+    // Drain every completion that is ready
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      unsigned i = cqe->user_data;
+      int res = cqe->res;
+      ++head;
+      slot_t &s = slots[i];
+      if (res <= 0) {
+        fprintf(stderr, "engine_io_uring: %s failed: %s\n",
+                s.writing ? "write" : "read", strerror(res ? -res : EIO));
+        return false;
+      }
+      // Reads and writes may be short; resubmit whatever is left
+      s.done += res;
+      if (s.done < s.len) {
+        ring.prep(s.writing ? IORING_OP_WRITE : IORING_OP_READ,
+                  s.writing ? job.out_fd : job.in_fd, s.buf.data() + s.done,
+                  s.len - s.done, s.off + s.done, i);
+      } else if (!s.writing) {
+        s.writing = true;
+        s.done = 0;
+        ring.prep(IORING_OP_WRITE, job.out_fd, s.buf.data(), s.len, s.off, i);
+      } else {
+        --busy;
+        start_read(i);
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+/**
+ * Get the number of read-like and write-like system calls this process has
+ * made, as counted by the kernel
+ *
+ * @return The sum of the syscr and syscw fields of /proc/self/io
+ */
+size_t read_syscall_counts() {
+  FILE *f = fopen("/proc/self/io", "r");
+  if (f == nullptr)
+    return 0;
+  char name[64];
+  unsigned long long value, total = 0;
+  while (fscanf(f, "%63s %llu", name, &value) == 2) {
+    if (!strcmp(name, "syscr:") || !strcmp(name, "syscw:"))
+      total += value;
+  }
+  fclose(f);
+  return total;
+}
+
+/**
+ * Copy the input file to the output file with each I/O engine (or just the one
+ * named by args.engine), and report each engine's throughput and system calls.
+ * The output is truncated before each run, and its size is checked after.
+ *
+ * @param args The program arguments
+ *
+ * @return 0 on success, -1 on error
+ */
+int run_benchmark(arg_t &args) {
+  using namespace std::chrono;
+  struct engine_t {
+    const char *name;
+    bool (*run)(engine_job_t &);
+    bool needs_regular_out; // e.g., copy_file_range can't write to /dev/null
+  };
+  engine_t engines[] = {{"fgets", engine_fgets<false>, false},
+                        {"fgets_inline", engine_fgets<true>, false},
+                        {"read", engine_read<false>, false},
+                        {"read_inline", engine_read<true>, false},
+                        {"lines", engine_lines, false},
+                        {"bigread", engine_bigread, false},
+                        {"mmap", engine_mmap, false},
+                        {"sendfile", engine_sendfile, false},
+                        {"copy_file_range", engine_copy_file_range, true},
+                        {"io_uring", engine_io_uring, false}};
+
+  if (args.in_file == "") {
+    fprintf(stderr, "The benchmark needs an input file (-I)\n");
+    return -1;
+  }
+  if (args.chunk == 0 || args.depth == 0) {
+    fprintf(stderr, "The chunk size and queue depth must be positive\n");
+    return -1;
+  }
+  std::string out_file = args.out_file == "" ? "/dev/null" : args.out_file;
+  int in_fd = open(args.in_file.c_str(), O_RDONLY);
+  if (in_fd < 0) {
+    perror("open(in_file)");
+    return -1;
+  }
+  int out_fd = open(out_file.c_str(), O_WRONLY | O_CREAT, S_IRWXU);
+  if (out_fd < 0) {
+    perror("open(out_file)");
+    return -1;
+  }
+  struct stat in_st, out_st;
+  if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0) {
+    perror("fstat()");
+    return -1;
+  }
+  bool out_regular = S_ISREG(out_st.st_mode);
+
+  // Read the file once, so that every engine starts with a warm page cache
+  engine_job_t warm = {in_fd, open("/dev/null", O_WRONLY), in_st.st_size,
+                       args.chunk, args.depth};
+  engine_bigread(warm);
+  close(warm.out_fd);
+
+  // Reading /proc/self/io makes system calls of its own, so measure how many
+  size_t overhead = read_syscall_counts();
+  overhead = read_syscall_counts() - overhead;
+
+  printf("%-16s %10s %12s  %s\n", "engine", "MB/s", "syscalls", "check");
+  bool found = false;
+  for (engine_t &e : engines) {
+    if (args.engine != "" && args.engine != e.name)
+      continue;
+    found = true;
+    if (e.needs_regular_out && !out_regular) {
+      printf("%-16s %10s %12s  %s\n", e.name, "n/a", "n/a",
+             "needs a regular output file (-O)");
+      continue;
+    }
+    // Rewind the input, and empty the output
+    lseek(in_fd, 0, SEEK_SET);
+    lseek(out_fd, 0, SEEK_SET);
+    if (out_regular && ftruncate(out_fd, 0) < 0) {
+      perror("ftruncate()");
+      return -1;
+    }
+    engine_job_t job = {in_fd, out_fd, in_st.st_size, args.chunk, args.depth};
+
+    size_t calls_before = read_syscall_counts();
+    steady_clock::time_point t1 = steady_clock::now();
+    bool ok = e.run(job);
+    steady_clock::time_point t2 = steady_clock::now();
+    size_t calls = read_syscall_counts() - calls_before - overhead +
+                   job.other_syscalls;
+
+    const char *check = ok ? "ok" : "FAILED";
+    if (ok && out_regular) {
+      fstat(out_fd, &out_st);
+      if (out_st.st_size != in_st.st_size)
+        check = "SIZE MISMATCH";
+    }
+    duration<double> secs = duration_cast<duration<double>>(t2 - t1);
+    printf("%-16s %10.1f %12zu  %s\n", e.name,
+           in_st.st_size / secs.count() / 1000000.0, calls, check);
+  }
+  if (!found)
+    fprintf(stderr, "Unknown engine %s\n", args.engine.c_str());
+  close(in_fd);
+  close(out_fd);
+  return 0;
+}
+
+/**
+ * Measure what it costs to call back through a std::function, compared to a
+ * callback whose type is a template parameter.  The input file is loaded into
+ * memory and split into lines over and over, so that no system calls get in
+ * the way.  The callback just sums the line lengths and first characters.
+ *
+ * @param args The program arguments
+ *
+ * @return 0 on success, -1 on error
+ */
+int run_dispatch_benchmark(arg_t &args) {
+  using namespace std::chrono;
+  if (args.in_file == "") {
+    fprintf(stderr, "The benchmark needs an input file (-I)\n");
+    return -1;
+  }
+  int in_fd = open(args.in_file.c_str(), O_RDONLY);
+  if (in_fd < 0) {
+    perror("open(in_file)");
+    return -1;
+  }
+  std::vector<char> text;
+  read_lines_fd(in_fd, [&](const char *buf, size_t num) {
+    text.insert(text.end(), buf, buf + num);
+  });
+  close(in_fd);
+
+  // NB: with no lines, every per-line time would be a division by zero
+  if (text.empty()) {
+    printf("No lines in %s\n", args.in_file.c_str());
+    return 0;
+  }
+
+  // Repeat the split enough times to take a measurable amount of time
+  const int reps = 1 + (256 << 20) / (text.size() + 1);
+  size_t sum = 0;
+  auto count = [&](const char *line, size_t num) { sum += num + line[0]; };
+  std::function<void(const char *, size_t)> count_fn = count;
+
+  auto measure = [&](const char *name, auto &&run) {
+    sum = 0;
+    size_t lines = 0;
+    steady_clock::time_point t1 = steady_clock::now();
+    for (int r = 0; r < reps; ++r)
+      run(lines);
+    duration<double> secs = steady_clock::now() - t1;
+    printf("%-16s %10.2f ns/line %10.1f MB/s  (checksum %zu)\n", name,
+           secs.count() * 1e9 / lines,
+           (double)text.size() * reps / secs.count() / 1000000.0, sum);
+  };
+  measure("std::function", [&](size_t &lines) {
+    split_lines(text.data(), text.size(), [&](const char *l, size_t n) {
+      count_fn(l, n);
+      ++lines;
+    });
+  });
+  measure("template", [&](size_t &lines) {
+    split_lines(text.data(), text.size(), [&](const char *l, size_t n) {
+      count(l, n);
+      ++lines;
+    });
+  });
+  return 0;
+}
+
 int main(int argc, char **argv) {
   arg_t args;
   parse_args(argc, argv, args);
@@ -217,6 +927,14 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  // The benchmark opens its own files
+  if (args.bench) {
+    return run_benchmark(args);
+  }
+  if (args.dispatch) {
+    return run_dispatch_benchmark(args);
+  }
+
   // set up default input file
   FILE *in_stream = stdin;
   int in_fd = fileno(stdin);
@@ -260,17 +978,42 @@ int main(int argc, char **argv) {
 
   // Create C++ lambdas to hide differences between writing to a stream and
   // writing to a file descriptor.
-  std::function<void(const char *, size_t)> print_stream =
-      [&](const char *buf, size_t) { write_file(out_stream, buf); };
-  std::function<void(const char *, size_t)> print_fd =
-      [&](const char *buf, size_t num) { write_fd(out_fd, buf, num); };
+  //
+  // NB: each lambda has its own type, so we can't pick one with ?: the way we
+  //     could with std::function.  Instead, we spell out each combination, and
+  //     the compiler makes a specialized, fully-inlined copy of the reader for
+  //     each one.
+  // NB: whole lines aren't null-terminated, so print_stream uses fwrite()
+  auto print_stream = [&](const char *buf, size_t num) {
+    if (fwrite(buf, 1, num, out_stream) < num) {
+      perror("fwrite()");
+      clearerr(out_stream);
+    }
+  };
+  auto print_fd = [&](const char *buf, size_t num) {
+    write_fd(out_fd, buf, num);
+  };
 
   // Dispatch to the file descriptor or stream version of reading, and pass the
   // appropriate writing function
-  if (args.in_fd) {
-    read_lines_fd(in_fd, args.out_fd ? print_fd : print_stream);
+  if (args.lines) {
+    if (args.out_fd) {
+      buffered_fd_writer_t writer(out_fd, args.chunk);
+      read_whole_lines_fd(in_fd, writer);
+      writer.flush();
+    } else {
+      read_whole_lines_fd(in_fd, print_stream);
+    }
+  } else if (args.in_fd) {
+    if (args.out_fd)
+      read_lines_fd(in_fd, print_fd);
+    else
+      read_lines_fd(in_fd, print_stream);
   } else {
-    read_lines_file(in_stream, args.out_fd ? print_fd : print_stream);
+    if (args.out_fd)
+      read_lines_file(in_stream, print_fd);
+    else
+      read_lines_file(in_stream, print_stream);
   }
 
   // only close the input file if it wasn't stdin
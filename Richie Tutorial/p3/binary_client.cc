@@ -5,15 +5,32 @@
  * single message, and the server increments the number and sends it back twice.
  * If the client sends a zero, it means the communication is over.  If the
  * client sends a -1, it means the server should shut down.
+ *
+ * The client measures the latency of every round trip, and reports the median
+ * and 99th percentile.  With -r, it uses raw file descriptors and a ring buffer
+ * instead of FILE* streams.
+ *
+ * With -b, the client becomes a load generator: it opens several connections,
+ * keeps a window of pipelined requests in flight on each, sends at a fixed
+ * rate, and reports a latency histogram.  This is the tool to use when
+ * measuring any change to the p3 servers.
  */
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <deque>
+#include <errno.h>
 #include <libgen.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <string>
-#include <sys/time.h>
+#include <sys/uio.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 /**
  * Display a help message to explain how the command-line parameters for this
@@ -28,6 +45,14 @@ void usage(char *progname) {
   printf("  -n [int]    The number of times to send integers\n");
   printf("  -s [string] Name of the server (probably 'localhost')\n");
   printf("  -p [int]    Port number of the server\n");
+  printf("  -r          Use raw sockets and a ring buffer instead of FILE*\n");
+  printf("  -q          Quiet: don't print every number sent and received\n");
+  printf("  -b          Benchmark: generate load and report latency\n");
+  printf("  -c [int]    (-b) Number of concurrent connections\n");
+  printf("  -w [int]    (-b) Maximum requests in flight per connection\n");
+  printf("  -R [int]    (-b) Target requests/sec, total (0 = as fast as "
+         "possible)\n");
+  printf("  -d [int]    (-b) Duration of the benchmark, in seconds\n");
   printf("  -h          Print help (this message)\n");
 }
 
@@ -59,6 +84,27 @@ struct arg_t {
   /** The number to count up to */
   int num = 0;
 
+  /** Should we use raw socket I/O instead of a FILE*? */
+  bool raw = false;
+
+  /** Should we skip printing each number? */
+  bool quiet = false;
+
+  /** Should we run the load generator? */
+  bool bench = false;
+
+  /** The number of connections the load generator uses */
+  int conns = 1;
+
+  /** The number of requests the load generator keeps in flight, per conn */
+  int window = 1;
+
+  /** The total rate of requests the load generator sends (0 = unlimited) */
+  int rate = 0;
+
+  /** The number of seconds for which the load generator runs */
+  int seconds = 5;
+
   /** Is the user requesting a usage message? */
   bool usage = false;
 };
@@ -73,7 +119,7 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "p:s:n:h")) != -1) {
+  while ((opt = getopt(argc, argv, "p:s:n:rqbc:w:R:d:h")) != -1) {
     switch (opt) {
     case 's':
       args.server_name = std::string(optarg);
@@ -84,6 +130,27 @@ void parse_args(int argc, char **argv, arg_t &args) {
     case 'n':
       args.num = atoi(optarg);
       break;
+    case 'r':
+      args.raw = true;
+      break;
+    case 'q':
+      args.quiet = true;
+      break;
+    case 'b':
+      args.bench = true;
+      break;
+    case 'c':
+      args.conns = atoi(optarg);
+      break;
+    case 'w':
+      args.window = atoi(optarg);
+      break;
+    case 'R':
+      args.rate = atoi(optarg);
+      break;
+    case 'd':
+      args.seconds = atoi(optarg);
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -91,18 +158,133 @@ void parse_args(int argc, char **argv, arg_t &args) {
   }
 }
 
+/** The size, in bytes, of one request (or response) in our protocol */
+const std::size_t MSG_SIZE = 2 * sizeof(int);
+
+/**
+ * A fixed-size ring buffer of bytes.  We recv() straight into its free space
+ * (with one readv(), since the free space may wrap around the end), and parse
+ * frames straight out of it, so the buffer is allocated once and data is never
+ * shuffled around.
+ *
+ * NB: `head` and `tail` count bytes consumed and produced since the buffer was
+ *     made; the index into `data` is the count modulo the capacity.  As long
+ *     as the capacity is a multiple of the frame size, and frames are always
+ *     consumed whole, a frame never straddles the end of `data`.
+ */
+struct ring_buffer_t {
+  /** The storage for the ring */
+  std::vector<char> data;
+
+  /** The number of bytes ever consumed */
+  std::size_t head = 0;
+
+  /** The number of bytes ever received */
+  std::size_t tail = 0;
+
+  /** Create a ring buffer with the given capacity */
+  explicit ring_buffer_t(std::size_t capacity) : data(capacity) {}
+
+  /** The number of bytes received but not yet consumed */
+  std::size_t size() const { return tail - head; }
+
+  /** A pointer to the oldest byte that hasn't been consumed */
+  char *front() { return data.data() + head % data.size(); }
+
+  /** Discard the oldest `len` bytes */
+  void consume(std::size_t len) { head += len; }
+
+  /**
+   * Receive as many bytes as are available and fit in the free space
+   *
+   * @param sd The socket to read from
+   *
+   * @returns The result of readv(): bytes received, 0 on EOF, or -1 on error
+   */
+  ssize_t recv_from(int sd) {
+    std::size_t cap = data.size(), t = tail % cap, avail = cap - size();
+    std::size_t first = std::min(avail, cap - t);
+    iovec iov[2];
+    iov[0].iov_base = data.data() + t;
+    iov[0].iov_len = first;
+    iov[1].iov_base = data.data();
+    iov[1].iov_len = avail - first;
+    ssize_t recd = readv(sd, iov, iov[1].iov_len ? 2 : 1);
+    if (recd > 0)
+      tail += recd;
+    return recd;
+  }
+};
+
+/**
+ * Send an entire buffer over a raw socket, with as few send() calls as the
+ * kernel allows (usually one)
+ *
+ * @param sd  The socket to write to
+ * @param buf The bytes to send
+ * @param len The number of bytes to send
+ *
+ * @returns false on error
+ */
+bool send_all(int sd, const void *buf, std::size_t len) {
+  const char *next_byte = (const char *)buf;
+  while (len) {
+    ssize_t sent = send(sd, next_byte, len, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    next_byte += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+/**
+ * Disable Nagle's algorithm, so that small messages are sent right away instead
+ * of waiting (up to 40ms) to be coalesced with more data
+ *
+ * @param sd The socket to configure
+ */
+void set_nodelay(int sd) {
+  int tmp = 1;
+  if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &tmp, sizeof(int)) < 0) {
+    error_message_and_exit(0, errno, "setsockopt(TCP_NODELAY) failed: ");
+  }
+}
+
+/**
+ * Print the median and 99th-percentile round-trip latency
+ *
+ * @param latencies The latency of each round trip, in nanoseconds.  It will be
+ *                  sorted.
+ */
+void print_latencies(std::vector<uint64_t> &latencies) {
+  if (latencies.empty())
+    return;
+  std::sort(latencies.begin(), latencies.end());
+  std::size_t n = latencies.size();
+  printf("RTT latency (us): p50 %.1f, p99 %.1f, max %.1f\n",
+         latencies[n / 2] / 1000.0,
+         latencies[std::min(n - 1, n * 99 / 100)] / 1000.0,
+         latencies[n - 1] / 1000.0);
+}
+
 /**
  * Send binary integers over the network, and expect to receive as a response
  * their incremented value.  Exit upon receiving last_num.
  *
  * @param sd       The socket file descriptor to use for the echo operation
  * @param last_num The last number to send and receive.
+ * @param quiet    Should we skip printing each number?
  */
-void binary_client(int sd, int last_num) {
-  // vars for tracking connection duration, round trips
+void binary_client(int sd, int last_num, bool quiet) {
+  // vars for tracking connection duration, round trips, latency
+  using namespace std::chrono;
   int round_trips = 0;
-  struct timeval start_time, end_time;
-  gettimeofday(&start_time, nullptr);
+  steady_clock::time_point start_time = steady_clock::now(), send_time;
+  std::vector<uint64_t> latencies;
 
   // We'll use C streams (i.e., FILE*) instead of raw reads/writes.
   // We will also use binary I/O here, not text I/O.  Note that we still need to
@@ -123,7 +305,9 @@ void binary_client(int sd, int last_num) {
     int *next_xmit = data;
 
     // send the data
-    printf("send: %d\n", data[0]);
+    if (!quiet)
+      printf("send: %d\n", data[0]);
+    send_time = steady_clock::now();
     while (num_remain) {
       size_t sent = fwrite(next_xmit, sizeof(int), 2, socket);
       if (sent > 0) {
@@ -153,9 +337,10 @@ void binary_client(int sd, int last_num) {
 
     // If we sent 0, it means we're done, so exit gracefully
     if (data[0] == 0) {
-      gettimeofday(&end_time, nullptr);
-      printf("Completed %d increments in %ld seconds\n", round_trips,
-             (end_time.tv_sec - start_time.tv_sec));
+      duration<double> secs = steady_clock::now() - start_time;
+      printf("Completed %d increments in %.6f seconds\n", round_trips,
+             secs.count());
+      print_latencies(latencies);
       fclose(socket);
       return;
     }
@@ -185,8 +370,11 @@ void binary_client(int sd, int last_num) {
     }
 
     // report after receiving data, and check for termination condition
+    latencies.push_back(
+        duration_cast<nanoseconds>(steady_clock::now() - send_time).count());
     assert(data[0] == data[1]);
-    printf("recv: %d\n", data[0]);
+    if (!quiet)
+      printf("recv: %d\n", data[0]);
     round_trips++;
     if (data[0] >= last_num) {
       data[0] = data[1] = 0;
@@ -195,14 +383,100 @@ void binary_client(int sd, int last_num) {
 }
 
 /**
- * Connect to a server so that we can have bidirectional communication on the
- * socket (represented by a file descriptor) that this function returns
+ * Like binary_client(), but using the raw socket instead of a FILE*.  Each
+ * request goes out in one send() as soon as it is ready (TCP_NODELAY), and
+ * responses are received into a ring buffer.
+ *
+ * @param sd       The socket file descriptor to use for the echo operation
+ * @param last_num The last number to send and receive.
+ * @param quiet    Should we skip printing each number?
+ */
+void binary_client_raw(int sd, int last_num, bool quiet) {
+  // vars for tracking connection duration, round trips, latency
+  using namespace std::chrono;
+  int round_trips = 0;
+  steady_clock::time_point start_time = steady_clock::now(), send_time;
+  std::vector<uint64_t> latencies;
+
+  // Our messages are tiny, so don't let the kernel delay them
+  set_nodelay(sd);
+  ring_buffer_t in(64 * MSG_SIZE);
+
+  // The initial data to send.  Note that -1 is a special case to close the
+  // server
+  int data[2] = {1, 1};
+  if (last_num == -1) {
+    data[0] = data[1] = -1;
+  }
+
+  while (true) {
+    if (!quiet)
+      printf("send: %d\n", data[0]);
+    send_time = steady_clock::now();
+    if (!send_all(sd, data, sizeof(data))) {
+      perror("binary_client_raw::send()");
+      close(sd);
+      return;
+    }
+
+    // If we sent -1, don't wait for a response from the server
+    if (data[0] == -1) {
+      close(sd);
+      return;
+    }
+
+    // If we sent 0, it means we're done, so exit gracefully
+    if (data[0] == 0) {
+      duration<double> secs = steady_clock::now() - start_time;
+      printf("Completed %d increments in %.6f seconds\n", round_trips,
+             secs.count());
+      print_latencies(latencies);
+      close(sd);
+      return;
+    }
+
+    // Receive until there is a full response in the ring
+    while (in.size() < MSG_SIZE) {
+      ssize_t recd = in.recv_from(sd);
+      if (recd == 0) {
+        // Remote end of socket was closed, so terminate
+        close(sd);
+        return;
+      } else if (recd < 0 && errno != EINTR) {
+        perror("binary_client_raw::readv()");
+        close(sd);
+        return;
+      }
+    }
+    memcpy(data, in.front(), MSG_SIZE);
+    in.consume(MSG_SIZE);
+
+    // report after receiving data, and check for termination condition
+    latencies.push_back(
+        duration_cast<nanoseconds>(steady_clock::now() - send_time).count());
+    assert(data[0] == data[1]);
+    if (!quiet)
+      printf("recv: %d\n", data[0]);
+    round_trips++;
+    if (data[0] >= last_num) {
+      data[0] = data[1] = 0;
+    }
+  }
+}
+
+/**
+ * Figure out the address of a server
+ *
+ * NB: gethostbyname() returns a pointer to static storage, so this must not
+ *     run on several threads at once.  The load generator resolves the name
+ *     once, and hands the address to each connection's thread.
  *
  * @param hostname The name of the server (ip or DNS) to connect to
  * @param port     The server's port that we should use
+ *
+ * @return The server's address
  */
-int connect_to_server(std::string hostname, std::size_t port) {
-  // figure out the IP address that we need to use and put it in a sockaddr_in
+sockaddr_in resolve_server(std::string hostname, std::size_t port) {
   struct hostent *host = gethostbyname(hostname.c_str());
   if (host == nullptr) {
     fprintf(stderr, "connect_to_server():DNS error %s\n", hstrerror(h_errno));
@@ -211,9 +485,19 @@ int connect_to_server(std::string hostname, std::size_t port) {
   sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr =
-      inet_addr(inet_ntoa(*(struct in_addr *)*host->h_addr_list));
+  memcpy(&addr.sin_addr, host->h_addr_list[0], sizeof(addr.sin_addr));
   addr.sin_port = htons(port);
+  return addr;
+}
+
+/**
+ * Connect to a server whose address we already know
+ *
+ * @param addr The server's address
+ *
+ * @return The connected socket
+ */
+int connect_to_address(const sockaddr_in &addr) {
   // create the socket and try to connect to it
   int sd = socket(AF_INET, SOCK_STREAM, 0);
   if (sd < 0) {
@@ -226,6 +510,222 @@ int connect_to_server(std::string hostname, std::size_t port) {
   return sd;
 }
 
+/**
+ * Connect to a server so that we can have bidirectional communication on the
+ * socket (represented by a file descriptor) that this function returns
+ *
+ * @param hostname The name of the server (ip or DNS) to connect to
+ * @param port     The server's port that we should use
+ */
+int connect_to_server(std::string hostname, std::size_t port) {
+  return connect_to_address(resolve_server(hostname, port));
+}
+
+/**
+ * A latency histogram in the style of HdrHistogram.  Values are grouped into
+ * buckets whose width grows with the value, so that every value is recorded
+ * with better than 1% precision, from nanoseconds to hours, in a fixed 60KB.
+ *
+ * Values below 2^(SUB_BITS+1) get a bucket each.  Above that, each power of two
+ * [2^e, 2^(e+1)) is split into 2^SUB_BITS equal buckets.
+ *
+ * NB: each connection's thread records into its own histogram, and they sit
+ *     side by side in a vector, so we align to 128 bytes to keep one thread's
+ *     total and max off the cache lines (and adjacent-sector prefetch pairs)
+ *     that its neighbors are writing.
+ */
+struct alignas(128) histogram_t {
+  /** log2 of the number of buckets per power of two */
+  static const int SUB_BITS = 7;
+
+  /** The number of buckets per power of two */
+  static const uint64_t SUB = 1ull << SUB_BITS;
+
+  /** The count for each bucket */
+  std::vector<uint64_t> counts = std::vector<uint64_t>(2 * SUB + 63 * SUB);
+
+  /** The total number of values recorded */
+  uint64_t total = 0;
+
+  /** The largest value recorded */
+  uint64_t max = 0;
+
+  /** Find the bucket for a value */
+  static std::size_t index_of(uint64_t v) {
+    if (v < 2 * SUB)
+      return v;
+    int e = 63 - __builtin_clzll(v); // e > SUB_BITS
+    uint64_t top = v >> (e - SUB_BITS); // in [SUB, 2*SUB)
+    return 2 * SUB + (e - SUB_BITS - 1) * SUB + (top - SUB);
+  }
+
+  /** The largest value that would be placed in a bucket */
+  static uint64_t value_of(std::size_t idx) {
+    if (idx < 2 * SUB)
+      return idx;
+    int e = (idx - 2 * SUB) / SUB + SUB_BITS + 1;
+    uint64_t top = (idx - 2 * SUB) % SUB + SUB;
+    return ((top + 1) << (e - SUB_BITS)) - 1;
+  }
+
+  /** Record one value */
+  void record(uint64_t v) {
+    ++counts[index_of(v)];
+    ++total;
+    max = std::max(max, v);
+  }
+
+  /** Add all of another histogram's values into this one */
+  void merge(const histogram_t &o) {
+    for (std::size_t i = 0; i < counts.size(); ++i)
+      counts[i] += o.counts[i];
+    total += o.total;
+    max = std::max(max, o.max);
+  }
+
+  /** The value at or below which `pct` percent of the values fall */
+  uint64_t percentile(double pct) const {
+    uint64_t target = std::max<uint64_t>(1, total * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen >= target)
+        return std::min(value_of(i), max);
+    }
+    return max;
+  }
+};
+
+/**
+ * The load generator's work on one connection.  Requests are scheduled at fixed
+ * intervals.  Each request's latency is measured from when it was *supposed*
+ * to be sent, not from when it was actually sent: if the server stalls and the
+ * window fills up, the requests that pile up behind the stall are charged for
+ * the time they spent waiting.  A closed-loop client that only measures from
+ * the actual send time hides those stalls ("coordinated omission").
+ *
+ * @param args  The program arguments
+ * @param addr  The server's address
+ * @param id    Which connection this is (used to stagger start times)
+ * @param hist  The histogram of latencies, in nanoseconds
+ */
+void load_connection(const arg_t &args, const sockaddr_in &addr, int id,
+                     histogram_t &hist) {
+  using namespace std::chrono;
+  int sd = connect_to_address(addr);
+  set_nodelay(sd);
+
+  // The ring must hold a full window of responses
+  ring_buffer_t in(std::max(64, args.window) * MSG_SIZE);
+
+  // The intended send time and value of every request in flight.  The server
+  // answers in order, so the oldest one is always answered next.
+  std::deque<std::pair<steady_clock::time_point, int>> inflight;
+  std::vector<int> out;
+  int next_value = 1;
+
+  // Each connection sends at rate/conns, staggered so that the connections
+  // don't all send at the same moment
+  nanoseconds interval(0);
+  if (args.rate > 0)
+    interval = nanoseconds((uint64_t)1000000000 * args.conns / args.rate);
+  steady_clock::time_point start = steady_clock::now();
+  steady_clock::time_point end = start + seconds(args.seconds);
+  steady_clock::time_point next_send = start + interval * id / args.conns;
+
+  while (true) {
+    steady_clock::time_point now = steady_clock::now();
+    bool sending = now < end;
+    if (!sending && inflight.empty())
+      break;
+
+    // Send every request that is due and fits in the window, in one send()
+    out.clear();
+    while (sending && (int)inflight.size() < args.window &&
+           (interval.count() == 0 || next_send <= now)) {
+      inflight.emplace_back(interval.count() == 0 ? now : next_send,
+                            next_value);
+      out.push_back(next_value);
+      out.push_back(next_value);
+      next_value = next_value % 1000000000 + 1;
+      next_send += interval;
+    }
+    if (!send_all(sd, out.data(), out.size() * sizeof(int))) {
+      error_message_and_exit(0, errno, "Error in send(): ");
+    }
+
+    // Wait for responses, but not past the time when the next request is due
+    timespec timeout = {1, 0};
+    if (sending && interval.count() > 0 && (int)inflight.size() < args.window) {
+      nanoseconds wait = std::max(nanoseconds(0), next_send - now);
+      timeout.tv_sec = wait.count() / 1000000000;
+      timeout.tv_nsec = wait.count() % 1000000000;
+    }
+    pollfd pfd = {sd, POLLIN, 0};
+    int ready = ppoll(&pfd, 1, &timeout, nullptr);
+    if (ready < 0 && errno != EINTR) {
+      error_message_and_exit(0, errno, "Error in ppoll(): ");
+    }
+    if (ready <= 0)
+      continue;
+
+    ssize_t recd = in.recv_from(sd);
+    if (recd == 0) {
+      fprintf(stderr, "Server closed connection %d\n", id);
+      break;
+    } else if (recd < 0 && errno != EINTR) {
+      error_message_and_exit(0, errno, "Error in readv(): ");
+    }
+    now = steady_clock::now();
+    while (in.size() >= MSG_SIZE) {
+      int *data = (int *)in.front();
+      assert(data[0] == data[1] && data[0] == inflight.front().second + 1);
+      hist.record(duration_cast<nanoseconds>(now - inflight.front().first)
+                      .count());
+      inflight.pop_front();
+      in.consume(MSG_SIZE);
+    }
+  }
+
+  // Tell the server that this client is done
+  int bye[2] = {0, 0};
+  send_all(sd, bye, sizeof(bye));
+  close(sd);
+}
+
+/**
+ * Run the load generator: one thread per connection, each with its own
+ * histogram, merged at the end.
+ *
+ * @param args The program arguments
+ */
+void run_benchmark(const arg_t &args) {
+  using namespace std::chrono;
+  printf("%d connections, window %d, target rate %d/sec, %d seconds\n",
+         args.conns, args.window, args.rate, args.seconds);
+
+  sockaddr_in addr = resolve_server(args.server_name, args.port);
+  std::vector<histogram_t> hists(args.conns);
+  std::vector<std::thread> threads;
+  steady_clock::time_point start = steady_clock::now();
+  for (int i = 0; i < args.conns; ++i)
+    threads.emplace_back(
+        [&, i]() { load_connection(args, addr, i, hists[i]); });
+  for (auto &t : threads)
+    t.join();
+  duration<double> secs = steady_clock::now() - start;
+
+  histogram_t all;
+  for (auto &h : hists)
+    all.merge(h);
+  printf("Completed %lu requests in %.3f seconds (%.0f requests/sec)\n",
+         all.total, secs.count(), all.total / secs.count());
+  printf("Latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+         all.percentile(50) / 1000.0, all.percentile(90) / 1000.0,
+         all.percentile(99) / 1000.0, all.percentile(99.9) / 1000.0,
+         all.max / 1000.0);
+}
+
 int main(int argc, char *argv[]) {
   // parse the command line arguments
   arg_t args;
@@ -235,6 +735,12 @@ int main(int argc, char *argv[]) {
     exit(0);
   }
 
+  // The load generator makes its own connections
+  if (args.bench) {
+    run_benchmark(args);
+    return 0;
+  }
+
   // Set up the client socket for communicating.  This will exit the program on
   // any error.
   int sd = connect_to_server(args.server_name, args.port);
@@ -243,6 +749,9 @@ int main(int argc, char *argv[]) {
   // the socket
   printf("Connected\n");
   // NB: binary_client closes the connection before returning
-  binary_client(sd, args.num);
+  if (args.raw)
+    binary_client_raw(sd, args.num, args.quiet);
+  else
+    binary_client(sd, args.num, args.quiet);
   return 0;
 }
@@ -5,15 +5,28 @@
  * single message, and the server increments the number and sends it back twice.
  * If the client sends a zero, it means the communication is over.  If the
  * client sends a -1, it means the server should shut down.
+ *
+ * By default, the server handles one client at a time.  With -c, it uses an
+ * epoll() event loop to serve many clients at once, and it lets each client
+ * pipeline its requests (send many before reading any responses).  With -r,
+ * the one-client-at-a-time server uses raw file descriptors and a ring buffer
+ * instead of FILE* streams.
  */
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <netinet/tcp.h>
 #include <string>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <vector>
 
 /**
  * Display a help message to explain how the command-line parameters for this
@@ -26,6 +39,8 @@ void usage(char *progname) {
          "sending binary data over a network.\n",
          basename(progname));
   printf("  -p [int]    Port number of the server\n");
+  printf("  -c          Serve many (pipelining) clients at once via epoll()\n");
+  printf("  -r          Use raw sockets and a ring buffer instead of FILE*\n");
   printf("  -h          Print help (this message)\n");
 }
 
@@ -77,7 +92,9 @@ int create_server_socket(std::size_t port) {
     close(sd);
     error_message_and_exit(0, errno, "Error binding socket to local address: ");
   }
-  if (listen(sd, 0) < 0) {
+  // NB: with a backlog of 0, clients that arrive while we're busy with another
+  //     client may be refused
+  if (listen(sd, SOMAXCONN) < 0) {
     close(sd);
     error_message_and_exit(0, errno, "Error listening on socket: ");
   }
@@ -89,6 +106,12 @@ struct arg_t {
   /** The port on which the program will listen for connections */
   size_t port = 0;
 
+  /** Should we serve many clients at once? */
+  bool concurrent = false;
+
+  /** Should the one-client-at-a-time server use raw socket I/O? */
+  bool raw = false;
+
   /** Is the user requesting a usage message? */
   bool usage = false;
 };
@@ -103,11 +126,17 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+  while ((opt = getopt(argc, argv, "p:crh")) != -1) {
     switch (opt) {
     case 'p':
       args.port = atoi(optarg);
       break;
+    case 'c':
+      args.concurrent = true;
+      break;
+    case 'r':
+      args.raw = true;
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -115,6 +144,105 @@ void parse_args(int argc, char **argv, arg_t &args) {
   }
 }
 
+/** The size, in bytes, of one request (or response) in our protocol */
+const std::size_t MSG_SIZE = 2 * sizeof(int);
+
+/** The number of bytes of requests we'll read from a client at a time */
+const std::size_t IN_BUF_SIZE = 64 * 1024;
+
+/**
+ * A fixed-size ring buffer of bytes.  We recv() straight into its free space
+ * (with one readv(), since the free space may wrap around the end), and parse
+ * frames straight out of it, so the buffer is allocated once and data is never
+ * shuffled around.
+ *
+ * NB: `head` and `tail` count bytes consumed and produced since the buffer was
+ *     made; the index into `data` is the count modulo the capacity.  As long
+ *     as the capacity is a multiple of the frame size, and frames are always
+ *     consumed whole, a frame never straddles the end of `data`.
+ */
+struct ring_buffer_t {
+  /** The storage for the ring */
+  std::vector<char> data;
+
+  /** The number of bytes ever consumed */
+  std::size_t head = 0;
+
+  /** The number of bytes ever received */
+  std::size_t tail = 0;
+
+  /** Create a ring buffer with the given capacity */
+  explicit ring_buffer_t(std::size_t capacity) : data(capacity) {}
+
+  /** The number of bytes received but not yet consumed */
+  std::size_t size() const { return tail - head; }
+
+  /** A pointer to the oldest byte that hasn't been consumed */
+  char *front() { return data.data() + head % data.size(); }
+
+  /** Discard the oldest `len` bytes */
+  void consume(std::size_t len) { head += len; }
+
+  /**
+   * Receive as many bytes as are available and fit in the free space
+   *
+   * @param sd The socket to read from
+   *
+   * @returns The result of readv(): bytes received, 0 on EOF, or -1 on error
+   */
+  ssize_t recv_from(int sd) {
+    std::size_t cap = data.size(), t = tail % cap, avail = cap - size();
+    std::size_t first = std::min(avail, cap - t);
+    iovec iov[2];
+    iov[0].iov_base = data.data() + t;
+    iov[0].iov_len = first;
+    iov[1].iov_base = data.data();
+    iov[1].iov_len = avail - first;
+    ssize_t recd = readv(sd, iov, iov[1].iov_len ? 2 : 1);
+    if (recd > 0)
+      tail += recd;
+    return recd;
+  }
+};
+
+/**
+ * Send an entire buffer over a raw socket, with as few send() calls as the
+ * kernel allows (usually one)
+ *
+ * @param sd  The socket to write to
+ * @param buf The bytes to send
+ * @param len The number of bytes to send
+ *
+ * @returns false on error
+ */
+bool send_all(int sd, const void *buf, std::size_t len) {
+  const char *next_byte = (const char *)buf;
+  while (len) {
+    ssize_t sent = send(sd, next_byte, len, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    next_byte += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+/**
+ * Disable Nagle's algorithm, so that small messages are sent right away instead
+ * of waiting (up to 40ms) to be coalesced with more data
+ *
+ * @param sd The socket to configure
+ */
+void set_nodelay(int sd) {
+  int tmp = 1;
+  if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &tmp, sizeof(int)) < 0) {
+    error_message_and_exit(0, errno, "setsockopt(TCP_NODELAY) failed: ");
+  }
+}
+
 /**
  * Receive binary integers over the network, increment them, and send them back.
  * Exit upon receiving a zero.  Return false upon receiving a -1.
@@ -123,9 +251,9 @@ void parse_args(int argc, char **argv, arg_t &args) {
  */
 bool binary_server(int sd) {
   // vars for tracking connection duration, round trips
+  using namespace std::chrono;
   int round_trips = 0;
-  struct timeval start_time, end_time;
-  gettimeofday(&start_time, nullptr);
+  steady_clock::time_point start_time = steady_clock::now();
 
   // We'll use C streams (i.e., FILE*) instead of raw reads/writes.
   // We will also use binary I/O here, not text I/O.  Note that we still need to
@@ -171,9 +299,9 @@ bool binary_server(int sd) {
 
     // On 0, close this client and wait for another
     if (data[0] == 0) {
-      gettimeofday(&end_time, nullptr);
-      printf("Completed %d increments in %ld seconds\n", round_trips,
-             (end_time.tv_sec - start_time.tv_sec));
+      duration<double> secs = steady_clock::now() - start_time;
+      printf("Completed %d increments in %.6f seconds (%.0f round trips/sec)\n",
+             round_trips, secs.count(), round_trips / secs.count());
       fclose(socket);
       return true;
     }
@@ -210,6 +338,358 @@ bool binary_server(int sd) {
   }
 }
 
+/**
+ * Like binary_server(), but using the raw socket instead of a FILE*.  Requests
+ * are received into a ring buffer, and every complete request from each recv()
+ * is answered, with all of the responses going back in a single send().  This
+ * means that a client may pipeline its requests.
+ *
+ * @param sd The socket file descriptor to use for the binary data server
+ */
+bool binary_server_raw(int sd) {
+  // vars for tracking connection duration, round trips
+  using namespace std::chrono;
+  int round_trips = 0;
+  steady_clock::time_point start_time = steady_clock::now();
+
+  // Our messages are tiny, so don't let the kernel delay them
+  set_nodelay(sd);
+
+  // NB: these buffers are reused for every batch of requests
+  ring_buffer_t in(IN_BUF_SIZE);
+  std::vector<int> out;
+  out.reserve(IN_BUF_SIZE / sizeof(int));
+
+  while (true) {
+    ssize_t recd = in.recv_from(sd);
+    if (recd == 0) {
+      // Remote end of socket was closed, so terminate
+      close(sd);
+      return true;
+    } else if (recd < 0) {
+      // If the error wasn't EINTR, then terminate
+      if (errno == EINTR)
+        continue;
+      perror("binary_server_raw::readv()");
+      close(sd);
+      return true;
+    }
+
+    // Answer every complete request, and note if we've reached 0 or -1
+    out.clear();
+    bool finished = false, keep_going = true;
+    while (in.size() >= MSG_SIZE) {
+      int *data = (int *)in.front();
+      assert(data[0] == data[1]);
+      int value = data[0];
+      in.consume(MSG_SIZE);
+      if (value == -1 || value == 0) {
+        finished = true;
+        keep_going = (value == 0);
+        break;
+      }
+      out.push_back(value + 1);
+      out.push_back(value + 1);
+      ++round_trips;
+    }
+
+    // Send the whole batch of responses at once
+    if (!send_all(sd, out.data(), out.size() * sizeof(int))) {
+      perror("binary_server_raw::send()");
+      close(sd);
+      return true;
+    }
+
+    if (finished) {
+      if (keep_going) {
+        duration<double> secs = steady_clock::now() - start_time;
+        printf("Completed %d increments in %.6f seconds (%.0f round "
+               "trips/sec)\n",
+               round_trips, secs.count(), round_trips / secs.count());
+      }
+      close(sd);
+      return keep_going;
+    }
+  }
+}
+
+/** The most events we will take from a single call to epoll_wait() */
+const int MAX_EVENTS = 256;
+
+/**
+ * The state of one client in the concurrent server.  Requests are received into
+ * a buffer, answered in place (by incrementing them), and sent back as a batch.
+ * If the client isn't reading fast enough, the unsent responses wait in `out`.
+ */
+struct conn_t {
+  /** The socket for this client */
+  int sd = -1;
+
+  /** Bytes received from the client (a prefix of which may be requests) */
+  std::vector<char> in = std::vector<char>(IN_BUF_SIZE);
+
+  /** The number of valid bytes in `in` */
+  std::size_t in_len = 0;
+
+  /** Responses that the socket couldn't accept yet */
+  std::vector<char> out;
+
+  /** Did the client send a 0?  If so, close once `out` is empty */
+  bool done = false;
+
+  /** The number of requests answered for this client */
+  int round_trips = 0;
+
+  /** The time when the client connected */
+  std::chrono::steady_clock::time_point start_time;
+};
+
+/** The outcome of servicing a client in the concurrent server */
+enum class conn_status { OPEN, CLOSE, SHUTDOWN };
+
+/**
+ * Send unsent responses, followed by some new ones, using a single writev() for
+ * both whenever the socket has room.  Anything that can't be sent without
+ * blocking is saved in c.out.
+ *
+ * @param c    The client to send to
+ * @param resp New responses to send after the ones already in c.out
+ * @param len  The number of bytes in resp
+ *
+ * @returns false if the connection failed
+ */
+bool send_responses(conn_t &c, const char *resp, std::size_t len) {
+  while (!c.out.empty() || len > 0) {
+    iovec iov[2];
+    iov[0].iov_base = c.out.data();
+    iov[0].iov_len = c.out.size();
+    iov[1].iov_base = (void *)resp;
+    iov[1].iov_len = len;
+    ssize_t sent = writev(c.sd, iov, 2);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      if (errno != ECONNRESET && errno != EPIPE)
+        perror("binary_server::writev()");
+      return false;
+    }
+    std::size_t from_out = std::min((std::size_t)sent, c.out.size());
+    c.out.erase(c.out.begin(), c.out.begin() + from_out);
+    resp += sent - from_out;
+    len -= sent - from_out;
+  }
+  c.out.insert(c.out.end(), resp, resp + len);
+  return true;
+}
+
+/**
+ * Read as many requests as the client has sent, and answer all the complete
+ * ones with one batch of responses per read().  Since the socket is
+ * edge-triggered, we keep going until read() says EAGAIN... unless the client
+ * isn't reading its responses, in which case we stop reading until it catches
+ * up.
+ *
+ * @param c The client to service
+ *
+ * @returns What should be done with the client
+ */
+conn_status serve_requests(conn_t &c) {
+  while (c.out.empty() && !c.done) {
+    ssize_t recd = read(c.sd, c.in.data() + c.in_len, c.in.size() - c.in_len);
+    if (recd == 0) {
+      return conn_status::CLOSE;
+    } else if (recd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return conn_status::OPEN;
+      if (errno != ECONNRESET)
+        perror("binary_server::read()");
+      return conn_status::CLOSE;
+    }
+    c.in_len += recd;
+
+    // Answer every complete request in place, stopping early on 0 or -1
+    //
+    // NB: c.in comes from operator new, so it is suitably aligned for ints
+    std::size_t num = c.in_len / MSG_SIZE, i;
+    int *data = (int *)c.in.data();
+    for (i = 0; i < num; ++i) {
+      assert(data[2 * i] == data[2 * i + 1]);
+      if (data[2 * i] == -1)
+        return conn_status::SHUTDOWN;
+      if (data[2 * i] == 0) {
+        c.done = true;
+        break;
+      }
+      ++data[2 * i];
+      ++data[2 * i + 1];
+    }
+    c.round_trips += i;
+    if (!send_responses(c, c.in.data(), i * MSG_SIZE))
+      return conn_status::CLOSE;
+
+    // Keep any partial request at the front of the buffer
+    std::size_t used = num * MSG_SIZE;
+    memmove(c.in.data(), c.in.data() + used, c.in_len - used);
+    c.in_len -= used;
+  }
+  return (c.done && c.out.empty()) ? conn_status::CLOSE : conn_status::OPEN;
+}
+
+/**
+ * Raise the soft limit on open descriptors to the hard limit, since every
+ * client costs the concurrent server a descriptor, and the default soft limit
+ * is often just 1024
+ */
+void raise_fd_limit() {
+  rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) != 0)
+      perror("Error raising RLIMIT_NOFILE");
+  }
+}
+
+/**
+ * Serve many clients at once with an edge-triggered epoll() loop.  Once per
+ * second, report the aggregate rate of round trips across all clients.  Return
+ * when any client sends -1.
+ *
+ * NB: running out of descriptors (EMFILE/ENFILE) is not fatal.  We keep a
+ *     spare descriptor, and when we run out we give it up, accept the
+ *     connection, and close it right away.  Otherwise the connection would
+ *     stay in the backlog, and (since the listening socket is level-triggered)
+ *     epoll_wait() would keep reporting it without our ever making progress.
+ *
+ * @param serverSd The listening socket
+ */
+void concurrent_binary_server(int serverSd) {
+  using namespace std::chrono;
+
+  // NB: the listening socket must not block, in case a client gives up between
+  //     epoll_wait() and accept()
+  int flags = fcntl(serverSd, F_GETFL, 0);
+  if (flags < 0 || fcntl(serverSd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    error_message_and_exit(0, errno, "Error setting O_NONBLOCK: ");
+  }
+
+  int epfd = epoll_create1(0);
+  if (epfd < 0) {
+    error_message_and_exit(0, errno, "Error calling epoll_create1(): ");
+  }
+  int spareFd = open("/dev/null", O_RDONLY);
+  // NB: a null pointer identifies the listening socket
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, serverSd, &ev) < 0) {
+    error_message_and_exit(0, errno, "Error calling epoll_ctl(): ");
+  }
+
+  // Stats for the aggregate report
+  int num_clients = 0;
+  uint64_t total_trips = 0, interval_trips = 0;
+  steady_clock::time_point start_time = steady_clock::now();
+  steady_clock::time_point interval_start = start_time;
+
+  epoll_event events[MAX_EVENTS];
+  bool keep_going = true;
+  while (keep_going) {
+    int num = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+    if (num < 0 && errno != EINTR) {
+      error_message_and_exit(0, errno, "Error calling epoll_wait(): ");
+    }
+    for (int i = 0; i < num && keep_going; ++i) {
+      conn_t *c = (conn_t *)events[i].data.ptr;
+      if (c == nullptr) {
+        sockaddr_in clientAddr;
+        socklen_t clientAddrSize = sizeof(clientAddr);
+        int connSd = accept4(serverSd, (sockaddr *)&clientAddr,
+                             &clientAddrSize, SOCK_NONBLOCK);
+        if (connSd < 0) {
+          if (errno == EMFILE || errno == ENFILE) {
+            char buf[1024];
+            fprintf(stderr, "Dropping a connection: %s\n",
+                    strerror_r(errno, buf, sizeof(buf)));
+            if (spareFd >= 0) {
+              close(spareFd);
+              connSd = accept(serverSd, nullptr, nullptr);
+              if (connSd >= 0)
+                close(connSd);
+              spareFd = open("/dev/null", O_RDONLY);
+            }
+          } else if (errno == ENOBUFS || errno == ENOMEM) {
+            // Back off: epoll_wait() will report the connection again
+            char buf[1024];
+            fprintf(stderr, "Error accepting request from client: %s\n",
+                    strerror_r(errno, buf, sizeof(buf)));
+          } else if (errno != EINTR && errno != EAGAIN &&
+                     errno != ECONNABORTED && errno != EPROTO) {
+            error_message_and_exit(0, errno,
+                                   "Error accepting request from client: ");
+          }
+          continue;
+        }
+        set_nodelay(connSd);
+        c = new conn_t();
+        c->sd = connSd;
+        c->start_time = steady_clock::now();
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connSd, &ev) < 0) {
+          error_message_and_exit(0, errno, "Error calling epoll_ctl(): ");
+        }
+        ++num_clients;
+        continue;
+      }
+
+      // Finish any old responses before reading new requests
+      int before = c->round_trips;
+      conn_status status = conn_status::CLOSE;
+      if (send_responses(*c, nullptr, 0))
+        status = serve_requests(*c);
+      total_trips += c->round_trips - before;
+      interval_trips += c->round_trips - before;
+      if (status == conn_status::SHUTDOWN) {
+        keep_going = false;
+      }
+      if (status != conn_status::OPEN) {
+        duration<double> secs = steady_clock::now() - c->start_time;
+        if (status == conn_status::CLOSE)
+          printf("Completed %d increments in %.6f seconds (%.0f round "
+                 "trips/sec)\n",
+                 c->round_trips, secs.count(), c->round_trips / secs.count());
+        // NB: close() removes the socket from the epoll set
+        close(c->sd);
+        delete c;
+        --num_clients;
+      }
+    }
+
+    // Report the aggregate throughput about once per second
+    steady_clock::time_point now = steady_clock::now();
+    duration<double> secs = now - interval_start;
+    if (secs.count() >= 1.0) {
+      if (interval_trips > 0)
+        printf("%d clients: %.0f round trips/sec\n", num_clients,
+               interval_trips / secs.count());
+      interval_trips = 0;
+      interval_start = now;
+    }
+  }
+
+  // NB: any clients still connected are dropped when the process exits
+  duration<double> secs = steady_clock::now() - start_time;
+  printf("Served %lu round trips in %.6f seconds (%.0f round trips/sec)\n",
+         total_trips, secs.count(), total_trips / secs.count());
+  close(epfd);
+  if (spareFd >= 0)
+    close(spareFd);
+}
+
 int main(int argc, char *argv[]) {
   // parse the command line arguments
   arg_t args;
@@ -223,6 +703,14 @@ int main(int argc, char *argv[]) {
   // any error.
   int serverSd = create_server_socket(args.port);
 
+  // The concurrent server runs until a client sends -1
+  if (args.concurrent) {
+    raise_fd_limit();
+    concurrent_binary_server(serverSd);
+    close(serverSd);
+    return 0;
+  }
+
   // We will keep going until we get a client who sends a -1 as its first
   // value
   bool keep_going = true;
@@ -240,7 +728,7 @@ int main(int argc, char *argv[]) {
     printf("Connected to %s\n", inet_ntop(AF_INET, &clientAddr.sin_addr,
                                           clientname, sizeof(clientname)));
     // NB: binary_server closes the connection before returning
-    keep_going = binary_server(connSd);
+    keep_going = args.raw ? binary_server_raw(connSd) : binary_server(connSd);
   }
   close(serverSd);
   return 0;
@@ -182,11 +182,14 @@ int main(int argc, char **argv) {
 
   // Send two messages, with enough time between them that the server should be
   // able to see other clients also sending messages
-  write_to_server(sd, "Hello");
+  //
+  // NB: the server frames messages by looking for '\n', so every message must
+  //     end with one
+  write_to_server(sd, "Hello\n");
   sleep(s);
-  // NB: second message is longer... watch what happens on the server, where the
-  //     buffer size is just 16...
-  write_to_server(sd, "Thanks for all the good times.  Farewell.");
+  // NB: second message is longer than the server's old 16-byte buffer... the
+  //     server buffers each client's bytes, so it still prints one message
+  write_to_server(sd, "Thanks for all the good times.  Farewell.\n");
   close(sd);
 
   printf("Closing client %d\n", getpid());
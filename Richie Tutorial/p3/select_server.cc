@@ -3,15 +3,25 @@
  *
  * Select_server is half of a client/server pair that demonstrates how a server
  * can use select() so that a single-threaded server can manage multiple client
- * connections.
+ * connections.  It can also use epoll() in edge-triggered mode, which is how a
+ * server scales to tens of thousands of mostly-idle connections, and it can run
+ * one epoll() loop per thread, so that a busy server can use every core.
  */
 
 #include <arpa/inet.h>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 /** Print a message to inform the user of how to use this program */
 void usage(char *progname) {
@@ -19,6 +29,9 @@ void usage(char *progname) {
          "select().\n",
          basename(progname));
   printf("  -p [int]    Port number of the server\n");
+  printf("  -e          Use epoll() (edge-triggered) instead of select()\n");
+  printf("  -t [int]    Run this many epoll() threads, each with its own\n");
+  printf("              SO_REUSEPORT listening socket (implies -e)\n");
   printf("  -h          Print help (this message)\n");
 }
 
@@ -42,9 +55,12 @@ void error_message_and_exit(std::size_t code, std::size_t err,
 /**
  * Create a server socket that we can use to listen for new incoming requests
  *
- * @param port The port on which the program should listen for new connections
+ * @param port      The port on which the program should listen for new
+ *                  connections
+ * @param reuseport Should several sockets be allowed to listen on this port?
+ *                  If so, the kernel spreads new connections among them.
  */
-int create_server_socket(std::size_t port) {
+int create_server_socket(std::size_t port, bool reuseport) {
   // A socket is just a kind of file descriptor.  We want our connections to use
   // IPV4 and TCP:
   int sd = socket(AF_INET, SOCK_STREAM, 0);
@@ -58,6 +74,11 @@ int create_server_socket(std::size_t port) {
     close(sd);
     error_message_and_exit(0, errno, "setsockopt(SO_REUSEADDR) failed: ");
   }
+  if (reuseport &&
+      setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &tmp, sizeof(int)) < 0) {
+    close(sd);
+    error_message_and_exit(0, errno, "setsockopt(SO_REUSEPORT) failed: ");
+  }
 
   // bind the socket to the server's address and the provided port, and then
   // start listening for connections
@@ -70,7 +91,10 @@ int create_server_socket(std::size_t port) {
     close(sd);
     error_message_and_exit(0, errno, "Error binding socket to local address: ");
   }
-  if (listen(sd, 0) < 0) {
+  // NB: a backlog of 0 is fine for a demo, but when thousands of clients
+  //     connect at once, the kernel will drop SYNs unless we allow a long
+  //     queue of not-yet-accepted connections
+  if (listen(sd, SOMAXCONN) < 0) {
     close(sd);
     error_message_and_exit(0, errno, "Error listening on socket: ");
   }
@@ -85,6 +109,12 @@ struct arg_t {
   /** The port on which the program will listen for connections */
   size_t port = 0;
 
+  /** Should we use epoll() instead of select()? */
+  bool epoll = false;
+
+  /** The number of epoll() threads to run (0 means single-threaded) */
+  int threads = 0;
+
   /** Is the user requesting a usage message? */
   bool usage = false;
 };
@@ -99,11 +129,17 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+  while ((opt = getopt(argc, argv, "p:et:h")) != -1) {
     switch (opt) {
     case 'p':
       args.port = atoi(optarg);
       break;
+    case 'e':
+      args.epoll = true;
+      break;
+    case 't':
+      args.threads = atoi(optarg);
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -111,60 +147,220 @@ void parse_args(int argc, char **argv, arg_t &args) {
   }
 }
 
+/** The longest message we will buffer before treating it as complete */
+const std::size_t MAX_MESSAGE = 4096;
+
+/** The most events we will take from a single call to epoll_wait() */
+const int MAX_EVENTS = 256;
+
 /**
- * When a client sends a message, we use this to read from the client socket. As
- * in previous examples, we can get ourselves into some trouble if we don't know
- * how long the message is... in this case, we read up to 16 bytes at a time. In
- * a real program, we'd need to buffer each client's inputs so that we could
- * read a full message before processing it.
+ * Each event loop counts the work it does, so that we can see how evenly the
+ * kernel is spreading connections among threads.  Only the loop's own thread
+ * writes to it, so no synchronization is needed until the thread is joined.
  *
- * @param sd The socket corresponding to the client who sent a message
- *
- * @returns True if the socket should remain open for future messages
+ * NB: We align to 128 bytes so that two threads' stats never share a cache
+ *     line (or an adjacent-sector prefetch pair).
+ */
+struct alignas(128) loop_stats_t {
+  /** The number of connections this loop has accepted */
+  std::size_t connections = 0;
+
+  /** The number of complete messages this loop has received */
+  std::size_t messages = 0;
+};
+
+/**
+ * Each connected client has a socket and a buffer.  TCP is a byte stream, so a
+ * single read might return part of a message, or several messages at once.  We
+ * keep whatever we've received in the buffer until a full message (ending in
+ * '\n') is available.
  */
-bool handle_client_input(int sd) {
-  // Receive up to 16 bytes of data... save the last byte as '\0'
-  char buf[17] = {0};
-  ssize_t recd = read(sd, buf, sizeof(buf) - 1);
+struct client_t {
+  /** The socket corresponding to this client */
+  int sd = -1;
 
-  // Handle errors
-  if (recd < 0 && errno != EINTR) {
-    error_message_and_exit(0, errno, "Error in read(): ");
-    return false;
+  /** Bytes from the client that are not yet part of a complete message */
+  std::string pending;
+};
+
+/**
+ * Put a socket into nonblocking mode, so that reads and accepts return EAGAIN
+ * instead of waiting when there is nothing to do.
+ *
+ * @param sd The socket to modify
+ */
+void set_nonblocking(int sd) {
+  int flags = fcntl(sd, F_GETFL, 0);
+  if (flags < 0 || fcntl(sd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    error_message_and_exit(0, errno, "Error setting O_NONBLOCK: ");
   }
-  // EOF means the client closed the connection
-  else if (recd == 0) {
-    return false;
+}
+
+/**
+ * Accept one pending connection on the (nonblocking) server socket.  The new
+ * socket is also nonblocking.
+ *
+ * @param serverSd The listening socket
+ *
+ * NB: running out of descriptors (EMFILE/ENFILE) is not fatal.  We keep one
+ *     spare descriptor per thread, and when we run out we give it up, accept
+ *     the connection, and close it right away.  Otherwise it would sit in the
+ *     backlog forever, since edge-triggered epoll() won't report it again.
+ *
+ * @returns The new connection's socket, or -1 if no connections are pending
+ */
+int accept_client(int serverSd) {
+  static thread_local int spareFd = open("/dev/null", O_RDONLY);
+  while (true) {
+    sockaddr_in clientname;
+    socklen_t size = sizeof(clientname);
+    int connSd = accept4(serverSd, (struct sockaddr *)&clientname, &size,
+                         SOCK_NONBLOCK);
+    if (connSd >= 0) {
+      printf("Connected to %s:%d\n", inet_ntoa(clientname.sin_addr),
+             ntohs(clientname.sin_port));
+      return connSd;
+    }
+    // NB: ECONNABORTED means the client gave up before we got to it, which
+    //     isn't our problem
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return -1;
+    } else if (errno == EMFILE || errno == ENFILE) {
+      char buf[1024];
+      fprintf(stderr, "Can't accept a connection: %s\n",
+              strerror_r(errno, buf, sizeof(buf)));
+      if (spareFd < 0)
+        return -1;
+      // NB: accept() fails this way even when nothing is pending, so stop
+      //     once the backlog is empty
+      close(spareFd);
+      connSd = accept(serverSd, nullptr, nullptr);
+      if (connSd >= 0)
+        close(connSd);
+      spareFd = open("/dev/null", O_RDONLY);
+      if (connSd < 0)
+        return -1;
+    } else if (errno == ENOBUFS || errno == ENOMEM) {
+      // Back off: the next event on the listening socket will try again
+      char buf[1024];
+      fprintf(stderr, "Error accepting connection from client: %s\n",
+              strerror_r(errno, buf, sizeof(buf)));
+      return -1;
+    } else if (errno != EINTR && errno != ECONNABORTED && errno != EPROTO) {
+      error_message_and_exit(0, errno,
+                             "Error accepting connection from client: ");
+    }
   }
-  // Otherwise, print whatever data we received
-  else {
-    printf("Message from client %d: %s\n", sd, buf);
-    return true;
+}
+
+/**
+ * Raise the soft limit on open descriptors to the hard limit, since every
+ * client costs us a descriptor, and the default soft limit is often just 1024
+ */
+void raise_fd_limit() {
+  rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+    lim.rlim_cur = lim.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &lim) != 0)
+      perror("Error raising RLIMIT_NOFILE");
   }
 }
 
-int main(int argc, char **argv) {
-  // parse the command line arguments
-  arg_t args;
-  parse_args(argc, argv, args);
-  if (args.usage) {
-    usage(argv[0]);
-    exit(0);
+/**
+ * Print every complete message in a client's buffer, and then remove those
+ * messages from the buffer.  A message that grows beyond MAX_MESSAGE without a
+ * newline is printed anyway, so that a misbehaving client can't make us buffer
+ * without bound.
+ *
+ * @param client The client whose messages should be printed
+ * @param eof    True if the client has closed the connection, in which case
+ *               any leftover bytes form the final message
+ *
+ * @returns The number of messages printed
+ */
+std::size_t print_messages(client_t &client, bool eof) {
+  std::size_t count = 0;
+  std::size_t start = 0;
+  while (start < client.pending.size()) {
+    const char *base = client.pending.data() + start;
+    std::size_t avail = client.pending.size() - start;
+    const char *nl = (const char *)memchr(base, '\n', avail);
+    std::size_t len;
+    if (nl != nullptr) {
+      len = nl - base;
+    } else if (avail >= MAX_MESSAGE || eof) {
+      len = avail < MAX_MESSAGE ? avail : MAX_MESSAGE;
+    } else {
+      break; // wait for the rest of the message
+    }
+    printf("Message from client %d: %.*s\n", client.sd, (int)len, base);
+    start += len + (nl != nullptr ? 1 : 0);
+    ++count;
   }
+  client.pending.erase(0, start);
+  return count;
+}
 
-  // Set up the server socket for listening.  This will exit the program on any
-  // error.
-  int serverSd = create_server_socket(args.port);
+/**
+ * When a client sends a message, we use this to read from the client socket.
+ * The socket is nonblocking, so we keep reading until the kernel says there is
+ * no more data (EAGAIN).  That is required for edge-triggered epoll, which
+ * won't notify us again about data that was already available, and it is
+ * harmless for select().
+ *
+ * @param client   The client who sent a message
+ * @param messages A count to increase by the number of messages received
+ *
+ * @returns True if the socket should remain open for future messages
+ */
+bool handle_client_input(client_t &client, std::size_t &messages) {
+  char buf[4096];
+  while (true) {
+    ssize_t recd = read(client.sd, buf, sizeof(buf));
+    if (recd > 0) {
+      client.pending.append(buf, recd);
+      messages += print_messages(client, false);
+    }
+    // EOF means the client closed the connection
+    else if (recd == 0) {
+      messages += print_messages(client, true);
+      return false;
+    }
+    // We've drained the socket, so wait for the next notification
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return true;
+    }
+    // A reset connection is just a client that went away rudely
+    else if (errno == ECONNRESET) {
+      return false;
+    } else if (errno != EINTR) {
+      error_message_and_exit(0, errno, "Error in read(): ");
+    }
+  }
+}
 
+/**
+ * Use select() to wait for activity on any socket.  This is simple, but every
+ * wakeup costs O(FD_SETSIZE) work, and descriptors >= FD_SETSIZE can't be used.
+ *
+ * @param serverSd The (nonblocking) listening socket
+ */
+void run_select_loop(int serverSd) {
   // Initialize a set of active sockets, and add the listening socket to it
   fd_set active_sds;
   FD_ZERO(&active_sds);
   FD_SET(serverSd, &active_sds);
 
+  // Each client's buffer is found by its socket number
+  std::vector<client_t> clients(FD_SETSIZE);
+  std::size_t messages = 0;
+
   while (true) {
     // wait for input to come in on any of the active sockets
     fd_set read_fd_set = active_sds;
     if (select(FD_SETSIZE, &read_fd_set, nullptr, nullptr, nullptr) < 0) {
+      if (errno == EINTR)
+        continue;
       error_message_and_exit(0, errno, "Error calling select(): ");
     }
 
@@ -172,28 +368,29 @@ int main(int argc, char **argv) {
     // process them.
     //
     // NB: FD_SETSIZE is a constant, defined as 1024 in Linux.  If your server
-    //     might need to handle more than 1024 active connections using this
-    //     technique, then you'll need to use poll() instead.
+    //     might need to handle more than 1024 active connections, then use the
+    //     epoll() version of this server instead.
     for (int i = 0; i < FD_SETSIZE; ++i) {
       if (FD_ISSET(i, &read_fd_set)) {
-        // if this socket is the server socket, it means we have a new incoming
-        // connection that we need to add to the set.
+        // if this socket is the server socket, it means we have new incoming
+        // connections that we need to add to the set.
         if (i == serverSd) {
-          sockaddr_in clientname;
-          socklen_t size = sizeof(clientname);
-          int connSd = accept(serverSd, (struct sockaddr *)&clientname, &size);
-          if (connSd < 0) {
-            error_message_and_exit(0, errno,
-                                   "Error accepting connection from client: ");
+          int connSd;
+          while ((connSd = accept_client(serverSd)) >= 0) {
+            if (connSd >= FD_SETSIZE) {
+              fprintf(stderr, "Too many clients for select()\n");
+              close(connSd);
+              continue;
+            }
+            clients[connSd].sd = connSd;
+            clients[connSd].pending.clear();
+            FD_SET(connSd, &active_sds);
           }
-          printf("Connected to %s:%d\n", inet_ntoa(clientname.sin_addr),
-                 ntohs(clientname.sin_port));
-          FD_SET(connSd, &active_sds);
         }
         // Otherwise the socket is already in the set, which means that a client
         // just sent data
         else {
-          if (!handle_client_input(i)) {
+          if (!handle_client_input(clients[i], messages)) {
             close(i);
             FD_CLR(i, &active_sds);
           }
@@ -202,3 +399,177 @@ int main(int argc, char **argv) {
     }
   }
 }
+
+/**
+ * Use edge-triggered epoll() to wait for activity.  The kernel hands back only
+ * the sockets that have new activity, so each wakeup costs O(active sockets),
+ * no matter how many idle connections are open.
+ *
+ * NB: With EPOLLET, we are only told when new data arrives, so every handler
+ *     must consume everything that is available (until EAGAIN).
+ *
+ * @param serverSd The (nonblocking) listening socket
+ * @param stopFd   An eventfd that becomes readable when the loop should
+ *                 return, or -1 to run forever
+ * @param stats    Where to count this loop's connections and messages
+ */
+void run_epoll_loop(int serverSd, int stopFd, loop_stats_t &stats) {
+  int epfd = epoll_create1(0);
+  if (epfd < 0) {
+    error_message_and_exit(0, errno, "Error calling epoll_create1(): ");
+  }
+
+  // The listening socket is registered with a null pointer; every client is
+  // registered with a pointer to its client_t, so no lookup is needed
+  epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = nullptr;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, serverSd, &ev) < 0) {
+    error_message_and_exit(0, errno, "Error calling epoll_ctl(): ");
+  }
+
+  // The stop eventfd is level-triggered and never read, so that one write
+  // wakes every loop that is watching it
+  client_t stopper;
+  stopper.sd = stopFd;
+  if (stopFd >= 0) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stopper;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, stopFd, &ev) < 0) {
+      error_message_and_exit(0, errno, "Error calling epoll_ctl(): ");
+    }
+  }
+
+  epoll_event events[MAX_EVENTS];
+  while (true) {
+    int num = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (num < 0) {
+      if (errno == EINTR)
+        continue;
+      error_message_and_exit(0, errno, "Error calling epoll_wait(): ");
+    }
+    for (int i = 0; i < num; ++i) {
+      client_t *client = (client_t *)events[i].data.ptr;
+      // time to shut down
+      //
+      // NB: open clients are reclaimed when the process exits
+      if (client == &stopper) {
+        close(epfd);
+        return;
+      }
+      // new connections: accept all of them, since we won't be told again
+      if (client == nullptr) {
+        int connSd;
+        while ((connSd = accept_client(serverSd)) >= 0) {
+          client_t *c = new client_t();
+          c->sd = connSd;
+          ++stats.connections;
+          ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+          ev.data.ptr = c;
+          if (epoll_ctl(epfd, EPOLL_CTL_ADD, connSd, &ev) < 0) {
+            error_message_and_exit(0, errno, "Error calling epoll_ctl(): ");
+          }
+        }
+      }
+      // NB: close() removes the socket from the epoll set
+      else if (!handle_client_input(*client, stats.messages)) {
+        close(client->sd);
+        delete client;
+      }
+    }
+  }
+}
+
+/**
+ * Run one epoll() loop per thread.  Each thread has its own SO_REUSEPORT
+ * listening socket, so the kernel load-balances new connections among the
+ * threads, and the threads never share a lock, a socket, or a client.  When
+ * the user presses ctrl-C, stop every loop and report what each one did.
+ *
+ * @param port        The port on which to listen
+ * @param num_threads The number of threads (and event loops) to run
+ */
+void run_multi_reactor(std::size_t port, int num_threads) {
+  // Block SIGINT and SIGTERM before making threads, so that they inherit the
+  // mask and only this thread (via sigwait) ever sees the signals
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+
+  int stopFd = eventfd(0, EFD_NONBLOCK);
+  if (stopFd < 0) {
+    error_message_and_exit(0, errno, "Error calling eventfd(): ");
+  }
+
+  std::vector<loop_stats_t> stats(num_threads);
+  std::vector<int> sds(num_threads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    sds[i] = create_server_socket(port, true);
+    set_nonblocking(sds[i]);
+    // NB: with port 0, the kernel picks a port for the first socket, and the
+    //     rest must join it, or each thread would listen on its own port
+    if (i == 0 && port == 0) {
+      sockaddr_in addr;
+      socklen_t len = sizeof(addr);
+      if (getsockname(sds[0], (struct sockaddr *)&addr, &len) < 0) {
+        error_message_and_exit(0, errno, "Error calling getsockname(): ");
+      }
+      port = ntohs(addr.sin_port);
+      printf("Listening on port %zu\n", port);
+    }
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back(
+        [&, i]() { run_epoll_loop(sds[i], stopFd, stats[i]); });
+  }
+
+  // Wait for ctrl-C, then wake every loop and wait for it to finish
+  int sig;
+  sigwait(&sigs, &sig);
+  uint64_t one = 1;
+  if (write(stopFd, &one, sizeof(one)) != sizeof(one)) {
+    error_message_and_exit(0, errno, "Error writing eventfd: ");
+  }
+  std::size_t total_conns = 0, total_msgs = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i].join();
+    close(sds[i]);
+    printf("Thread %d: %zu connections, %zu messages\n", i,
+           stats[i].connections, stats[i].messages);
+    total_conns += stats[i].connections;
+    total_msgs += stats[i].messages;
+  }
+  printf("Total: %zu connections, %zu messages\n", total_conns, total_msgs);
+  close(stopFd);
+}
+
+int main(int argc, char **argv) {
+  // parse the command line arguments
+  arg_t args;
+  parse_args(argc, argv, args);
+  if (args.usage) {
+    usage(argv[0]);
+    exit(0);
+  }
+  raise_fd_limit();
+
+  // The multi-threaded server makes its own sockets
+  if (args.threads > 0) {
+    run_multi_reactor(args.port, args.threads);
+    return 0;
+  }
+
+  // Set up the server socket for listening.  This will exit the program on any
+  // error.  Both loops accept until EAGAIN, so the socket must be nonblocking.
+  int serverSd = create_server_socket(args.port, false);
+  set_nonblocking(serverSd);
+
+  if (args.epoll) {
+    loop_stats_t stats;
+    run_epoll_loop(serverSd, -1, stats);
+  } else
+    run_select_loop(serverSd);
+}
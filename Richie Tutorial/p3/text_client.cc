@@ -2,16 +2,22 @@
  * text_client.cc
  *
  * Text_client is half of a client/server pair that shows how to send text to a
- * server and get a reply.
+ * server and get a reply.  In streaming mode, it pipes all of stdin to the
+ * server and all of the replies to stdout, without waiting for each reply
+ * before sending more.
  */
 
 #include <arpa/inet.h>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <netdb.h>
 #include <string>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 /**
  * Display a help message to explain how the command-line parameters for this
@@ -25,6 +31,7 @@ void usage(char *progname) {
          basename(progname));
   printf("  -s [string] Name of the server (probably 'localhost')\n");
   printf("  -p [int]    Port number of the server\n");
+  printf("  -S          Stream stdin to the server and replies to stdout\n");
   printf("  -h          Print help (this message)\n");
 }
 
@@ -53,6 +60,9 @@ struct arg_t {
   /** The port on which the program will connect to the above server */
   size_t port = 0;
 
+  /** Should we stream, instead of sending one line at a time? */
+  bool stream = false;
+
   /** Is the user requesting a usage message? */
   bool usage = false;
 };
@@ -67,7 +77,7 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "p:s:h")) != -1) {
+  while ((opt = getopt(argc, argv, "p:s:Sh")) != -1) {
     switch (opt) {
     case 's':
       args.server_name = std::string(optarg);
@@ -75,6 +85,9 @@ void parse_args(int argc, char **argv, arg_t &args) {
     case 'p':
       args.port = atoi(optarg);
       break;
+    case 'S':
+      args.stream = true;
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -214,6 +227,93 @@ void echo_client(int sd, bool verbose) {
   }
 }
 
+/** The size of the chunks in which the streaming client moves data */
+const std::size_t STREAM_CHUNK = 256 * 1024;
+
+/**
+ * Copy everything from one file descriptor to another in large chunks, until
+ * the source reaches EOF
+ *
+ * NB: when `to` is a socket, we use send() with MSG_NOSIGNAL, so that if the
+ *     server has closed the connection we get EPIPE and report it, instead of
+ *     being killed by SIGPIPE
+ *
+ * @param from      The descriptor to read
+ * @param to        The descriptor to write
+ * @param to_socket Is `to` a socket?
+ * @param prefix    The text to display before any error message
+ *
+ * @return The number of bytes copied
+ */
+std::size_t copy_fd(int from, int to, bool to_socket, const char *prefix) {
+  std::vector<char> buf(STREAM_CHUNK);
+  std::size_t total = 0;
+  while (true) {
+    ssize_t rcd = read(from, buf.data(), buf.size());
+    if (rcd == 0) {
+      return total;
+    } else if (rcd < 0) {
+      if (errno == EINTR)
+        continue;
+      error_message_and_exit(0, errno, prefix);
+    }
+    char *next_byte = buf.data();
+    std::size_t remain = rcd;
+    while (remain) {
+      ssize_t sent = to_socket ? send(to, next_byte, remain, MSG_NOSIGNAL)
+                               : write(to, next_byte, remain);
+      if (sent <= 0) {
+        if (errno != EINTR) {
+          error_message_and_exit(0, errno, prefix);
+        }
+      } else {
+        next_byte += sent;
+        remain -= sent;
+      }
+    }
+    total += rcd;
+  }
+}
+
+/**
+ * Send all of stdin to the server, and write all of the server's replies to
+ * stdout.  One thread sends while the other receives, so we never wait for a
+ * reply before sending more: throughput is bounded by bandwidth, not by the
+ * number of lines times the round-trip time.
+ *
+ * NB: Both directions must run at once.  If we sent everything before reading
+ *     anything, the server would eventually block on a full send buffer, stop
+ *     reading, and then we would block too.
+ *
+ * @param sd      The socket file descriptor to use for the echo operation
+ * @param verbose Should stats be printed (to stderr) upon completion?
+ */
+void stream_client(int sd, bool verbose) {
+  using namespace std::chrono;
+  steady_clock::time_point start_time = steady_clock::now();
+
+  std::size_t sentBytes = 0, recdBytes = 0;
+  std::thread sender([&]() {
+    sentBytes = copy_fd(STDIN_FILENO, sd, true, "Error sending stdin: ");
+    // Tell the server that there is no more data; it will finish echoing what
+    // it has and then close its end
+    if (shutdown(sd, SHUT_WR) < 0) {
+      error_message_and_exit(0, errno, "Error in shutdown(): ");
+    }
+  });
+  recdBytes =
+      copy_fd(sd, STDOUT_FILENO, false, "Error receiving to stdout: ");
+  sender.join();
+
+  if (verbose) {
+    duration<double> secs = steady_clock::now() - start_time;
+    fprintf(stderr,
+            "Sent %ld bytes, received %ld bytes in %.6f seconds (%.2f MB/s)\n",
+            sentBytes, recdBytes, secs.count(),
+            recdBytes / secs.count() / 1000000.0);
+  }
+}
+
 int main(int argc, char *argv[]) {
   // parse the command line arguments
   arg_t args;
@@ -229,6 +329,13 @@ int main(int argc, char *argv[]) {
 
   // Run the client code to interact with the server.  When it finishes, close
   // the socket.
+  //
+  // NB: in streaming mode, stdout is just the echoed data
+  if (args.stream) {
+    stream_client(sd, true);
+    close(sd);
+    return 0;
+  }
   printf("Connected\n");
   echo_client(sd, true);
   // NB: ignore errors in close
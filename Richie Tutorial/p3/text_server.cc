@@ -2,15 +2,20 @@
  * text_server.cc
  *
  * Text_server is half of a client/server pair that shows how to receive text
- * from a client and send a reply.
+ * from a client and send a reply.  For bulk transfers, it can echo with a large
+ * buffer, or it can use splice() to move data socket->pipe->socket without
+ * ever copying it into the program.
  */
 
 #include <arpa/inet.h>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <fcntl.h>
 #include <string>
-#include <sys/time.h>
 #include <unistd.h>
+#include <vector>
 
 /** Print a message to inform the user of how to use this program */
 void usage(char *progname) {
@@ -18,6 +23,8 @@ void usage(char *progname) {
          "sending text over a network.\n",
          basename(progname));
   printf("  -p [int]    Port number of the server\n");
+  printf("  -b [int]    Size of the echo buffer, in bytes (default 16)\n");
+  printf("  -z          Echo with splice() (zero-copy) instead of recv/send\n");
   printf("  -h          Print help (this message)\n");
 }
 
@@ -30,6 +37,12 @@ struct arg_t {
   /** The port on which the program will listen for connections */
   size_t port = 0;
 
+  /** The size of the buffer used for recv() and send() */
+  size_t bufsize = 16;
+
+  /** Should we echo with splice() instead of recv()/send()? */
+  bool splice = false;
+
   /** Is the user requesting a usage message? */
   bool usage = false;
 };
@@ -44,11 +57,24 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+  while ((opt = getopt(argc, argv, "p:b:zh")) != -1) {
     switch (opt) {
     case 'p':
       args.port = atoi(optarg);
       break;
+    case 'b': {
+      // NB: strtoul() accepts "-1" (as ULONG_MAX), so check for a sign too
+      char *end;
+      args.bufsize = strtoul(optarg, &end, 10);
+      if (args.bufsize == 0 || *end != '\0' || strchr(optarg, '-')) {
+        fprintf(stderr, "Invalid buffer size for -b: %s\n", optarg);
+        exit(0);
+      }
+      break;
+    }
+    case 'z':
+      args.splice = true;
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -112,30 +138,43 @@ int create_server_socket(std::size_t port) {
 }
 
 
+/**
+ * Report how many bytes were echoed, and how fast
+ *
+ * @param bytes      The number of bytes echoed back to the client
+ * @param start_time When the client connected
+ */
+void print_echo_stats(std::size_t bytes,
+                      std::chrono::steady_clock::time_point start_time) {
+  using namespace std::chrono;
+  duration<double> secs = steady_clock::now() - start_time;
+  printf("Echoed %ld bytes in %.6f seconds (%.2f MB/s)\n", bytes,
+         secs.count(), bytes / secs.count() / 1000000.0);
+}
+
 /**
  * Receive text over the provided socket file descriptor, and send it back to
  * the client.  When the client sends an EOF, return.
  *
  * @param sd      The socket file descriptor to use for the echo operation
  * @param verbose Should stats be printed upon completion?
+ * @param buf     The buffer to receive into.  Its size determines how much we
+ *                receive at a time.
  */
-void echo_server(int sd, bool verbose) {
+void echo_server(int sd, bool verbose, std::vector<char> &buf) {
   // vars for tracking connection duration, bytes transmitted
   size_t xmitBytes = 0;
-  struct timeval start_time, end_time;
-  if (verbose) {
-    gettimeofday(&start_time, nullptr);
-  }
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
 
   // read data for as long as there is data, and always send it back
   while (true) {
-    // Receive up to 16 bytes of data
+    // Receive up to buf.size() bytes of data
     //
-    // NB: we should receive more data at a time, but we'll keep it small so
-    //     that it's easier to see how the server handles full buffers
-    char buf[16] = {0};
+    // NB: by default the buffer is only 16 bytes, so that it's easier to see
+    //     how the server handles full buffers.  Use -b to make it bigger.
     // NB: see text_client for explanation of why we receive data like this
-    ssize_t rcd = recv(sd, buf, sizeof(buf), 0);
+    ssize_t rcd = recv(sd, buf.data(), buf.size(), 0);
     if (rcd <= 0) {
       if (errno != EINTR) {
         if (rcd == 0) {
@@ -152,11 +191,10 @@ void echo_server(int sd, bool verbose) {
       // Immediately send back whatever we got
       //
       // NB: see text_client for explanation of why we send data like this
-      xmitBytes += rcd;
-      char *next_byte = buf;
+      char *next_byte = buf.data();
       std::size_t remain = rcd;
       while (remain) {
-        std::size_t sent = send(sd, next_byte, remain, 0);
+        ssize_t sent = send(sd, next_byte, remain, 0);
         if (sent <= 0) {
           if (errno != EINTR) {
             error_message_and_exit(0, errno, "Error in send(): ");
@@ -171,9 +209,69 @@ void echo_server(int sd, bool verbose) {
     }
   }
   if (verbose) {
-    gettimeofday(&end_time, nullptr);
-    printf("Transmitted %ld bytes in %ld seconds\n", xmitBytes,
-           (end_time.tv_sec - start_time.tv_sec));
+    print_echo_stats(xmitBytes, start_time);
+  }
+}
+
+/**
+ * Like echo_server(), but the data never enters our address space.  splice()
+ * moves pages from the socket into a pipe, and then from the pipe back to the
+ * socket, so each chunk costs two system calls and no copies into user memory,
+ * no matter how big the chunk is.
+ *
+ * NB: splice() requires one end of each transfer to be a pipe, which is why we
+ *     need the pipe in the middle.
+ *
+ * @param sd      The socket file descriptor to use for the echo operation
+ * @param verbose Should stats be printed upon completion?
+ */
+void echo_server_splice(int sd, bool verbose) {
+  // vars for tracking connection duration, bytes transmitted
+  size_t xmitBytes = 0;
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+
+  // The pipe's capacity limits how much we can move per splice(), so make it
+  // big.  If the kernel won't allow 1MB, the default (64KB) still works.
+  int pipefd[2];
+  if (pipe(pipefd) < 0) {
+    error_message_and_exit(0, errno, "Error in pipe(): ");
+  }
+  fcntl(pipefd[1], F_SETPIPE_SZ, 1 << 20);
+  int pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+  if (pipe_size <= 0)
+    pipe_size = 1 << 16;
+
+  while (true) {
+    // socket -> pipe
+    ssize_t rcd = splice(sd, nullptr, pipefd[1], nullptr, pipe_size,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (rcd == 0) {
+      break;
+    } else if (rcd < 0) {
+      if (errno == EINTR)
+        continue;
+      error_message_and_exit(0, errno, "Error in splice(socket->pipe): ");
+    }
+    // pipe -> socket, until the pipe is empty again
+    std::size_t remain = rcd;
+    while (remain) {
+      ssize_t sent = splice(pipefd[0], nullptr, sd, nullptr, remain,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (sent <= 0) {
+        if (errno != EINTR) {
+          error_message_and_exit(0, errno, "Error in splice(pipe->socket): ");
+        }
+      } else {
+        remain -= sent;
+      }
+    }
+    xmitBytes += rcd;
+  }
+  close(pipefd[0]);
+  close(pipefd[1]);
+  if (verbose) {
+    print_echo_stats(xmitBytes, start_time);
   }
 }
 
@@ -190,6 +288,9 @@ int main(int argc, char *argv[]) {
   // error.
   int serverSd = create_server_socket(args.port);
 
+  // The echo buffer is allocated once, and reused for every client
+  std::vector<char> buf(args.bufsize);
+
   // Use accept() to wait for a client to connect.  When it connects, service
   // it.  When it disconnects, then and only then will we accept a new client.
   while (true) {
@@ -204,7 +305,10 @@ int main(int argc, char *argv[]) {
     char clientname[1024];
     printf("Connected to %s\n", inet_ntop(AF_INET, &clientAddr.sin_addr,
                                           clientname, sizeof(clientname)));
-    echo_server(connSd, true);
+    if (args.splice)
+      echo_server_splice(connSd, true);
+    else
+      echo_server(connSd, true, buf);
     // NB: ignore errors in close()
     close(connSd);
   }
@@ -5,21 +5,46 @@
  * them interact.  This includes:
  * - Working on the same data (a counter)
  * - Working on different data (multiple counters)
- * - Producer/consumer interaction via a queue
+ * - Sharing one logical counter without sharing its cache lines (a slot per
+ *   thread, summed on read), or sharing it through a flat combiner
+ * - Producer/consumer interaction via a queue (lock-based, a lock-free
+ *   bounded multi-producer/multi-consumer ring, or a lock-free
+ *   single-producer/single-consumer ring for every producer/consumer pair)
+ * - Fork-join parallelism on a persistent work-stealing thread pool, compared
+ *   with splitting the same irregular work up front
  *
  * NB: we show both lock-based and nonblocking (via atomic) interactions
+ *
+ * Every test runs under a small harness, which can sweep the thread count,
+ * pin threads to CPUs, repeat runs, read hardware performance counters, and
+ * append a summary to a CSV file.
  */
 
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
 #include <functional>
+#include <climits>
 #include <libgen.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <sched.h>
 #include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <thread>
+#include <tuple>
 #include <unistd.h>
+#include <vector>
 
 /**
  * Display a help message to explain how the command-line parameters for this
@@ -31,8 +56,22 @@ void usage(char *progname) {
   printf("%s: Use threads to collaborate on a task.\n", basename(progname));
   printf("  -n [int]    Number of work units per thread\n");
   printf("  -t [int]    Number of threads to run\n");
+  printf("  -p [int]    Number of producer threads for queue tests (default 1)\n");
+  printf("  -q [int]    Capacity of each bounded queue (default 1024)\n");
+  printf("  -d [int]    Depth of the task tree for -b steal (default 16)\n");
+  printf("  -k [int]    Items per push/pop batch in queue and mpmc (default 1)\n");
+  printf("  -w [string] How queue test threads wait\n");
+  printf("              (options: spin, yield, condvar, futex; default spin)\n");
   printf("  -b [string] Behavior of the program\n");
-  printf("              (options: counter, counters, queue\n");
+  printf("              (options: counter, counters, sharded, combining,\n");
+  printf("               queue, mpmc, spsc, steal)\n");
+  printf("  -T [list]   Sweep these thread counts instead of -t (e.g. 1,2,4,8),\n");
+  printf("              or 'auto' for powers of 2 up to the number of CPUs\n");
+  printf("  -a [string] Pin threads to CPUs (options: none, compact, scatter)\n");
+  printf("  -r [int]    Number of runs for each thread count (default 1)\n");
+  printf("  -e          Count cycles, LLC misses and HITMs with perf_event_open\n");
+  printf("  -H [hex]    Raw event code for HITM (default 0x04d2, for Intel)\n");
+  printf("  -C [file]   Append a CSV summary of each thread count to a file\n");
   printf("  -h          Print help (this message)\n");
 }
 
@@ -44,13 +83,82 @@ struct arg_t {
   /** The number of threads to use in the program */
   int num_threads = 1;
 
+  /** The number of threads that are producers, in the queue tests */
+  int num_producers = 1;
+
+  /** The capacity of each bounded queue */
+  int capacity = 1024;
+
+  /** The maximum depth of the irregular task tree */
+  int depth = 16;
+
+  /** The number of items that queue and mpmc move per push or pop */
+  int batch = 1;
+
+  /** How threads in the queue test wait: "spin", "yield", "condvar", or
+   *  "futex" */
+  std::string wait = "spin";
+
   /** name of the behavior to demonstrate */
   std::string behavior = "counter";
 
+  /** The thread counts to sweep (empty means just num_threads) */
+  std::vector<int> sweep;
+
+  /** How to pin threads to CPUs: "none", "compact", or "scatter" */
+  std::string affinity = "none";
+
+  /** The number of runs for each thread count */
+  int repeats = 1;
+
+  /** Read hardware performance counters? */
+  bool perf = false;
+
+  /** The raw PMU event code for loads that hit a modified line in another
+   *  core's cache (MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM/XSNP_FWD on Intel) */
+  uint64_t hitm_event = 0x04d2;
+
+  /** The CSV file to append to (empty for none) */
+  std::string csv_file = "";
+
   /** Display a usage message? */
   bool usage = false;
 };
 
+/**
+ * Parse a thread-count sweep: either a comma-separated list, or "auto" for 1,
+ * 2, 4, ... up to the number of CPUs we may run on
+ *
+ * @param list The text to parse
+ *
+ * @return the thread counts
+ */
+std::vector<int> parse_sweep(const char *list) {
+  std::vector<int> res;
+  if (std::string(list) == "auto") {
+    cpu_set_t set;
+    int ncpu = 1;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+      ncpu = CPU_COUNT(&set);
+    for (int t = 1; t < ncpu; t *= 2)
+      res.push_back(t);
+    res.push_back(ncpu);
+    return res;
+  }
+  for (const char *c = list; *c;) {
+    if (atoi(c) < 1) {
+      fprintf(stderr, "Invalid thread count in -T %s\n", list);
+      exit(0);
+    }
+    res.push_back(atoi(c));
+    while (*c && *c != ',')
+      ++c;
+    if (*c == ',')
+      ++c;
+  }
+  return res;
+}
+
 /**
  * Parse the command-line arguments, and use them to populate the provided args
  * object.
@@ -61,17 +169,54 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "n:t:b:h")) != -1) {
+  while ((opt = getopt(argc, argv, "n:t:p:q:d:k:w:b:T:a:r:eH:C:h")) != -1) {
     switch (opt) {
     case 'n':
       args.num_ints = atoi(optarg);
       break;
     case 't':
       args.num_threads = atoi(optarg);
+      if (args.num_threads < 1) {
+        fprintf(stderr, "Invalid thread count for -t: %s\n", optarg);
+        exit(0);
+      }
+      break;
+    case 'p':
+      args.num_producers = atoi(optarg);
+      break;
+    case 'q':
+      args.capacity = atoi(optarg);
+      break;
+    case 'd':
+      args.depth = atoi(optarg);
+      break;
+    case 'k':
+      args.batch = atoi(optarg);
+      break;
+    case 'w':
+      args.wait = std::string(optarg);
       break;
     case 'b':
       args.behavior = std::string(optarg);
       break;
+    case 'T':
+      args.sweep = parse_sweep(optarg);
+      break;
+    case 'a':
+      args.affinity = std::string(optarg);
+      break;
+    case 'r':
+      args.repeats = atoi(optarg);
+      break;
+    case 'e':
+      args.perf = true;
+      break;
+    case 'H':
+      args.hitm_event = strtoull(optarg, nullptr, 16);
+      break;
+    case 'C':
+      args.csv_file = std::string(optarg);
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -79,33 +224,374 @@ void parse_args(int argc, char **argv, arg_t &args) {
   }
 }
 
+/** The number of hardware counters that perf_counters_t reads */
+const int NUM_COUNTERS = 3;
+
+/** The names of those counters, for output */
+const char *COUNTER_NAMES[NUM_COUNTERS] = {"cycles", "llc_misses", "hitm"};
+
+/**
+ * perf_counters_t counts hardware events (cycles, last-level cache misses, and
+ * loads that found their line modified in another core's cache, which is what
+ * a cache line bouncing between cores looks like) for this process, including
+ * every thread that it creates after the counters are opened.
+ *
+ * NB: inherited counters only include a thread's counts once it has exited,
+ *     so read() is only meaningful after the threads are joined.
+ *
+ * NB: many VMs don't expose hardware counters.  Counters that can't be opened
+ *     are reported as missing, instead of ending the program.
+ */
+class perf_counters_t {
+  /** The counters' file descriptors, or -1 for counters that aren't open */
+  int fds[NUM_COUNTERS] = {-1, -1, -1};
+
+public:
+  /**
+   * Open the counters, disabled
+   *
+   * @param args The arguments to the program (nothing opens unless -e)
+   */
+  explicit perf_counters_t(arg_t &args) {
+    if (!args.perf)
+      return;
+    uint32_t types[NUM_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                    PERF_TYPE_RAW};
+    uint64_t configs[NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES,
+                                      PERF_COUNT_HW_CACHE_MISSES,
+                                      args.hitm_event};
+    static bool warned[NUM_COUNTERS] = {false, false, false};
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+      perf_event_attr attr = {};
+      attr.size = sizeof(attr);
+      attr.type = types[i];
+      attr.config = configs[i];
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fds[i] < 0 && !warned[i]) {
+        fprintf(stderr, "perf counter %s unavailable: %s\n", COUNTER_NAMES[i],
+                strerror(errno));
+        warned[i] = true;
+      }
+    }
+  }
+
+  /** Close the counters */
+  ~perf_counters_t() {
+    for (int fd : fds)
+      if (fd >= 0)
+        close(fd);
+  }
+
+  /** Zero the counters and start counting */
+  void start() {
+    for (int fd : fds)
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+  }
+
+  /** Stop counting */
+  void stop() {
+    for (int fd : fds)
+      if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  }
+
+  /**
+   * Read one counter
+   *
+   * @param i     The counter to read
+   * @param value Where to put its count
+   *
+   * @return false if the counter isn't available
+   */
+  bool read(int i, uint64_t &value) {
+    return fds[i] >= 0 && ::read(fds[i], &value, sizeof(value)) ==
+                              (ssize_t)sizeof(value);
+  }
+};
+
+/** sample_t describes one timed run of a test */
+struct sample_t {
+  /** Which part of the test was timed (most tests have just one part) */
+  std::string phase;
+
+  /** The elapsed time */
+  double seconds;
+
+  /** The CPU time used by all threads of the process during the run */
+  double cpu_seconds;
+
+  /** Whether each hardware counter was read */
+  bool have[NUM_COUNTERS];
+
+  /** The hardware counters' counts */
+  uint64_t counts[NUM_COUNTERS];
+};
+
+/** The runs that have been timed for the current thread count */
+std::vector<sample_t> samples;
+
+/**
+ * Report the time of a run, and save it (with its hardware counters) for the
+ * summary
+ *
+ * @param phase       Which part of the test was timed
+ * @param seconds     The elapsed time
+ * @param cpu_seconds The CPU time used during the run
+ * @param counters    The counters for the run (already stopped)
+ */
+void record_sample(const std::string &phase, double seconds, double cpu_seconds,
+                   perf_counters_t &counters) {
+  printf("Total time: %lf seconds\n", seconds);
+  printf("CPU time: %lf seconds\n", cpu_seconds);
+  sample_t smp;
+  smp.phase = phase;
+  smp.seconds = seconds;
+  smp.cpu_seconds = cpu_seconds;
+  for (int i = 0; i < NUM_COUNTERS; ++i) {
+    smp.counts[i] = 0;
+    smp.have[i] = counters.read(i, smp.counts[i]);
+  }
+  samples.push_back(smp);
+}
+
+/**
+ * Return the CPU time that all of the threads of this process have used
+ *
+ * NB: unlike wall-clock time, this shows the cost of threads that spin while
+ *     they wait
+ */
+double cpu_time() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Return the order in which to pin threads to CPUs, among the CPUs that this
+ * process may use:
+ * - compact fills all the hardware threads of a core, then all the cores of a
+ *   socket, before moving on, so threads share caches as much as possible
+ * - scatter puts consecutive threads on different sockets, then on different
+ *   cores, so threads share as little as possible
+ *
+ * @param policy "compact" or "scatter"
+ */
+std::vector<int> cpu_order(const std::string &policy) {
+  struct cpu_t {
+    int cpu, package, core, core_rank, smt;
+  };
+  // Read a small integer from the cpu's topology directory in sysfs
+  auto topology = [](int cpu, const char *file) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+             cpu, file);
+    int res = 0;
+    FILE *f = fopen(path, "r");
+    if (f != nullptr) {
+      if (fscanf(f, "%d", &res) != 1)
+        res = 0;
+      fclose(f);
+    }
+    return res;
+  };
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  sched_getaffinity(0, sizeof(set), &set);
+  std::vector<cpu_t> cpus;
+  for (int c = 0; c < CPU_SETSIZE; ++c)
+    if (CPU_ISSET(c, &set))
+      cpus.push_back({c, topology(c, "physical_package_id"),
+                      topology(c, "core_id"), 0, 0});
+  // Number the cores within each package, and the threads within each core
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    std::vector<int> cores;
+    for (size_t j = 0; j < cpus.size(); ++j) {
+      if (cpus[j].package != cpus[i].package)
+        continue;
+      if (cpus[j].core == cpus[i].core && cpus[j].cpu < cpus[i].cpu)
+        cpus[i].smt++;
+      if (cpus[j].core < cpus[i].core &&
+          std::find(cores.begin(), cores.end(), cpus[j].core) == cores.end())
+        cores.push_back(cpus[j].core);
+    }
+    cpus[i].core_rank = cores.size();
+  }
+  std::sort(cpus.begin(), cpus.end(), [&](const cpu_t &a, const cpu_t &b) {
+    if (policy == "scatter")
+      return std::make_tuple(a.smt, a.core_rank, a.package) <
+             std::make_tuple(b.smt, b.core_rank, b.package);
+    return std::make_tuple(a.package, a.core_rank, a.smt) <
+           std::make_tuple(b.package, b.core_rank, b.smt);
+  });
+  std::vector<int> order;
+  for (auto &c : cpus)
+    order.push_back(c.cpu);
+  return order;
+}
+
+/**
+ * Pin the calling thread to one CPU
+ *
+ * @param cpu The CPU to run on
+ */
+void pin_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    perror("sched_setaffinity");
+}
+
 /**
  * Launch a bunch of threads that all execute the same task, and time how long
- * it takes to launch threads, run code, and wait for all threads to end.
+ * it takes for all of them to finish running it.
  *
- * @param args The arguments to the program
- * @param task The task that each thread should run
+ * NB: the threads are created (and pinned, if requested) first, and wait at a
+ *     start barrier.  The clock starts when they are released, and stops when
+ *     the last one finishes its task, so thread creation and join aren't part
+ *     of the measured time.
+ *
+ * @param args  The arguments to the program
+ * @param task  The task that each thread should run
+ * @param phase Which part of the test is being timed
  */
-void run_timed_test(arg_t &args, std::function<void(int)> task) {
+void run_timed_test(arg_t &args, std::function<void(int)> task,
+                    const std::string &phase = "") {
   using namespace std::chrono;
+  std::vector<int> cpus;
+  if (args.affinity != "none")
+    cpus = cpu_order(args.affinity);
+  perf_counters_t counters(args);
 
-  // Note: we will include the time to create and destroy threads as part of the
-  // measured time.  As long as the time to do the work is big enough, that's
-  // OK.
-  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+  // The start barrier: threads check in, then wait for `go`
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<high_resolution_clock::time_point> ends(args.num_threads);
 
   // Launch all the threads
-  std::thread threads[args.num_threads];
+  std::vector<std::thread> threads;
   for (int i = 0; i < args.num_threads; ++i)
-    threads[i] = std::thread(task, i);
+    threads.emplace_back([&, i]() {
+      if (!cpus.empty())
+        pin_to_cpu(cpus[i % cpus.size()]);
+      ready++;
+      while (!go)
+        std::this_thread::yield();
+      task(i);
+      ends[i] = high_resolution_clock::now();
+    });
+  while (ready != args.num_threads)
+    std::this_thread::yield();
+  counters.start();
+  double c1 = cpu_time();
+  high_resolution_clock::time_point t1 = high_resolution_clock::now();
+  go = true;
+
   // Wait for all threads to finish
   for (auto &th : threads)
     th.join();
+  counters.stop();
+  double c2 = cpu_time();
 
   // report total time
-  high_resolution_clock::time_point t2 = high_resolution_clock::now();
+  high_resolution_clock::time_point t2 = *std::max_element(ends.begin(), ends.end());
   duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
-  printf("Total time: %lf seconds\n", time_span.count());
+  record_sample(phase, time_span.count(), c2 - c1, counters);
+}
+
+/**
+ * The header line of the CSV file.  Scripts find columns by position, so new
+ * columns are only ever added at the end, and main() won't append to a file
+ * whose header is different.
+ *
+ * @return The header, without a newline
+ */
+std::string csv_header() {
+  std::string header = "behavior,phase,threads,affinity,num_ints,runs,"
+                       "median_s,stddev_s,min_s";
+  for (int i = 0; i < NUM_COUNTERS; ++i)
+    header += std::string(",") + COUNTER_NAMES[i];
+  return header + ",cpu_s,batch";
+}
+
+/**
+ * Summarize the samples for the current thread count: the median, standard
+ * deviation and minimum of the times, the median CPU time, and the mean of
+ * each hardware counter.
+ * Print the summary if there was more than one run or there are counters,
+ * and append it to the CSV file if there is one.  Then clear the samples.
+ *
+ * @param args The arguments to the program
+ * @param csv  The CSV file, or nullptr
+ */
+void report_samples(arg_t &args, FILE *csv) {
+  // Summarize each phase separately, in the order they first ran
+  std::vector<std::string> phases;
+  for (auto &smp : samples)
+    if (std::find(phases.begin(), phases.end(), smp.phase) == phases.end())
+      phases.push_back(smp.phase);
+  for (auto &phase : phases) {
+    std::vector<double> times, cpus;
+    double mean = 0;
+    double count_sum[NUM_COUNTERS] = {0, 0, 0};
+    bool have[NUM_COUNTERS] = {true, true, true};
+    for (auto &smp : samples) {
+      if (smp.phase != phase)
+        continue;
+      times.push_back(smp.seconds);
+      cpus.push_back(smp.cpu_seconds);
+      mean += smp.seconds;
+      for (int i = 0; i < NUM_COUNTERS; ++i) {
+        have[i] = have[i] && smp.have[i];
+        count_sum[i] += smp.counts[i];
+      }
+    }
+    int n = times.size();
+    mean /= n;
+    std::sort(times.begin(), times.end());
+    std::sort(cpus.begin(), cpus.end());
+    double median =
+        (n % 2) ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+    double cpu_median =
+        (n % 2) ? cpus[n / 2] : (cpus[n / 2 - 1] + cpus[n / 2]) / 2;
+    double var = 0;
+    for (double t : times)
+      var += (t - mean) * (t - mean);
+    double stddev = (n > 1) ? std::sqrt(var / (n - 1)) : 0;
+
+    const char *name = phase.empty() ? args.behavior.c_str() : phase.c_str();
+    if (n > 1 || args.perf) {
+      printf("%s: Threads/Runs/Median/Stddev/Min = (%d, %d, %lf, %lf, %lf)\n",
+             name, args.num_threads, n, median, stddev, times[0]);
+      printf("%s: median CPU time = %lf\n", name, cpu_median);
+      for (int i = 0; i < NUM_COUNTERS; ++i)
+        if (have[i])
+          printf("%s: mean %s = %.0lf\n", name, COUNTER_NAMES[i],
+                 count_sum[i] / n);
+    }
+    if (csv != nullptr) {
+      // NB: the columns must match csv_header(), so new ones go at the end
+      fprintf(csv, "%s,%s,%d,%s,%d,%d,%lf,%lf,%lf", args.behavior.c_str(),
+              phase.c_str(), args.num_threads, args.affinity.c_str(),
+              args.num_ints, n, median, stddev, times[0]);
+      for (int i = 0; i < NUM_COUNTERS; ++i) {
+        if (have[i])
+          fprintf(csv, ",%.0lf", count_sum[i] / n);
+        else
+          fprintf(csv, ",");
+      }
+      fprintf(csv, ",%lf,%d\n", cpu_median, args.batch);
+      fflush(csv);
+    }
+  }
+  samples.clear();
 }
 
 /**
@@ -178,90 +664,1404 @@ void run_counters_test(arg_t &args) {
 }
 
 /**
- * The queue test has a single lock-based shared queue, and the first thread
- * inserts into it (producer), while all other threads remove from it
- * (consumers).
+ * A sharded counter has one slot per thread, each on its own 128-byte line.
+ * A thread only ever writes to its own slot, so increments never contend:
+ * there is no lock, and not even a fetch-and-add, just a load and a store to
+ * a line that stays in the writer's cache.  Reads pay instead, by summing
+ * every slot.  That is the right trade when there are many more increments
+ * than reads (statistics, metrics, reference counts that are rarely checked).
+ *
+ * NB: a read that races with increments returns some value between the
+ *     counts at the start and the end of the read, which is all you can ask
+ *     of a counter that is changing.
+ */
+class sharded_counter_t {
+  /** A slot, padded like the counters in run_counters_test */
+  struct alignas(128) slot_t {
+    /** This thread's part of the count */
+    std::atomic<uint64_t> value{0};
+  };
+
+  /** The slots, one per thread */
+  std::vector<slot_t> slots;
+
+public:
+  /**
+   * Construct a sharded counter
+   *
+   * @param num_threads The number of threads that will increment it
+   */
+  explicit sharded_counter_t(int num_threads) : slots(num_threads) {}
+
+  /**
+   * Add to the counter
+   *
+   * @param id The calling thread's id (only one thread may use each id)
+   * @param n  The amount to add
+   */
+  void add(int id, uint64_t n = 1) {
+    // NB: we're the only writer, so this doesn't need to be a fetch_add
+    std::atomic<uint64_t> &v = slots[id].value;
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  /** Read the counter, by summing all of the slots */
+  uint64_t read() {
+    uint64_t sum = 0;
+    for (auto &s : slots)
+      sum += s.value.load(std::memory_order_relaxed);
+    return sum;
+  }
+};
+
+/**
+ * A flat-combining counter (Hendler et al., SPAA 2010) keeps one shared value,
+ * but threads don't all fight over it.  Each thread publishes its increment in
+ * its own slot, and then tries to become the "combiner" by grabbing a lock.
+ * The winner applies every published request to the value in one pass, and
+ * marks each one done.  The others just watch their own slot until it is
+ * cleared.  Under contention, the value's cache line stays with the one
+ * combiner, and many increments are applied per lock acquisition.
+ */
+class combining_counter_t {
+  /** A published request, padded so each thread watches its own line */
+  struct alignas(128) slot_t {
+    /** The amount to add, or 0 when there is no pending request */
+    std::atomic<uint64_t> request{0};
+  };
+
+  /** The publication list, one slot per thread */
+  std::vector<slot_t> slots;
+
+  /** Whether some thread is currently combining */
+  alignas(128) std::atomic<bool> combining{false};
+
+  /** The count (only written by the combiner) */
+  std::atomic<uint64_t> value{0};
+
+public:
+  /**
+   * Construct a flat-combining counter
+   *
+   * @param num_threads The number of threads that will increment it
+   */
+  explicit combining_counter_t(int num_threads) : slots(num_threads) {}
+
+  /**
+   * Add to the counter, and return once the addition has been applied
+   *
+   * @param id The calling thread's id (only one thread may use each id)
+   * @param n  The amount to add (must not be 0)
+   */
+  void add(int id, uint64_t n = 1) {
+    std::atomic<uint64_t> &mine = slots[id].request;
+    mine.store(n, std::memory_order_release);
+    while (mine.load(std::memory_order_acquire) != 0) {
+      if (combining.load(std::memory_order_relaxed) ||
+          combining.exchange(true, std::memory_order_acquire)) {
+        // Someone else is combining, and will probably get our request
+        std::this_thread::yield();
+        continue;
+      }
+      // We are the combiner: apply everyone's requests, including ours
+      uint64_t v = value.load(std::memory_order_relaxed);
+      for (auto &s : slots) {
+        uint64_t r = s.request.load(std::memory_order_acquire);
+        if (r != 0) {
+          v += r;
+          s.request.store(0, std::memory_order_release);
+        }
+      }
+      value.store(v, std::memory_order_relaxed);
+      combining.store(false, std::memory_order_release);
+    }
+  }
+
+  /** Read the counter */
+  uint64_t read() { return value.load(std::memory_order_acquire); }
+};
+
+/**
+ * Run a counter test on a counter type with add(id) and read() methods, and
+ * check that no increments were lost
+ *
+ * @param args    The bundle of arguments to the program
+ * @param counter The counter to test
+ */
+template <typename C> void run_shared_counter_test(arg_t &args, C &counter) {
+  auto workload = [&](int id) {
+    for (int i = 0; i < args.num_ints; ++i)
+      counter.add(id);
+  };
+  run_timed_test(args, workload);
+  uint64_t expected = (uint64_t)args.num_threads * args.num_ints;
+  uint64_t total = counter.read();
+  printf("Total: %lu (expected %lu)\n", total, expected);
+  if (total != expected)
+    printf("Error: lost increments\n");
+}
+
+/**
+ * The sharded test is like the counter test, but with a sharded_counter_t, so
+ * it should scale perfectly
+ *
+ * @param args The bundle of arguments to the program
+ */
+void run_sharded_test(arg_t &args) {
+  sharded_counter_t counter(args.num_threads);
+  run_shared_counter_test(args, counter);
+}
+
+/**
+ * The combining test is like the counter test, but with a flat-combining
+ * counter instead of a mutex
+ *
+ * @param args The bundle of arguments to the program
+ */
+void run_combining_test(arg_t &args) {
+  combining_counter_t counter(args.num_threads);
+  run_shared_counter_test(args, counter);
+}
+
+/**
+ * Check that the queue tests have at least one producer and one consumer
+ *
+ * @param args The bundle of arguments to the program
+ *
+ * @return true if the thread counts make sense
+ */
+bool check_producers(arg_t &args) {
+  if (args.num_producers < 1 || args.num_threads <= args.num_producers) {
+    printf("queue tests need at least one producer (-p) and one consumer\n");
+    return false;
+  }
+  if (args.batch < 1 || args.batch > args.capacity) {
+    printf("batch size (-k) must be between 1 and the capacity (-q)\n");
+    return false;
+  }
+  return true;
+}
+
+/** The ways a thread can wait for another thread to do something */
+enum wait_kind_t {
+  WAIT_SPIN,    // Keep checking, forever
+  WAIT_YIELD,   // Check SPIN_TRIES times, then yield the CPU between checks
+  WAIT_CONDVAR, // Sleep on a std::condition_variable
+  WAIT_FUTEX    // Sleep on a futex
+};
+
+/** The number of times WAIT_YIELD checks before it starts yielding */
+const int SPIN_TRIES = 100;
+
+/**
+ * Turn the name of a wait strategy into a wait_kind_t
+ *
+ * @param name The name ("spin", "yield", "condvar", or "futex")
+ * @param kind The result
+ *
+ * @return false if the name is invalid
+ */
+bool parse_wait(const std::string &name, wait_kind_t &kind) {
+  if (name == "spin")
+    kind = WAIT_SPIN;
+  else if (name == "yield")
+    kind = WAIT_YIELD;
+  else if (name == "condvar")
+    kind = WAIT_CONDVAR;
+  else if (name == "futex")
+    kind = WAIT_FUTEX;
+  else
+    return false;
+  return true;
+}
+
+/**
+ * Sleep until the futex word at `addr` no longer holds `val` (or a spurious
+ * wakeup).  The kernel checks the value while holding its own lock, so a wake
+ * that changes the word first can't be missed.
+ */
+void futex_wait(std::atomic<int> &addr, int val) {
+  static_assert(sizeof(std::atomic<int>) == sizeof(int), "bad futex word");
+  syscall(SYS_futex, (int *)&addr, FUTEX_WAIT_PRIVATE, val, nullptr, nullptr,
+          0);
+}
+
+/** Wake up to `n` threads sleeping on the futex word at `addr` */
+void futex_wake(std::atomic<int> &addr, int n) {
+  syscall(SYS_futex, (int *)&addr, FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+}
+
+/**
+ * wait_count_t is a count that threads add to, which other threads can wait
+ * on until it reaches a target, using any of the wait strategies
+ */
+class wait_count_t {
+  /** How to wait */
+  wait_kind_t kind;
+
+  /** The count (and also the futex word, for WAIT_FUTEX) */
+  std::atomic<int> count{0};
+
+  /** The number of threads asleep in wait(), so add() can skip waking */
+  std::atomic<int> sleepers{0};
+
+  /** For WAIT_CONDVAR */
+  std::mutex lock;
+  std::condition_variable cv;
+
+public:
+  /** Construct a count of 0 that uses the given wait strategy */
+  explicit wait_count_t(wait_kind_t kind) : kind(kind) {}
+
+  /** Read the count */
+  int load() { return count.load(); }
+
+  /** Add to the count, and wake any waiters */
+  void add(int n) {
+    count += n;
+    // NB: seq_cst on both sides means that either add() sees the sleeper, or
+    //     the sleeper sees the new count
+    if (sleepers == 0)
+      return;
+    if (kind == WAIT_CONDVAR) {
+      std::lock_guard<std::mutex> lk(lock);
+      cv.notify_all();
+    } else if (kind == WAIT_FUTEX) {
+      futex_wake(count, INT_MAX);
+    }
+  }
+
+  /** Wait until the count equals `target` */
+  void wait(int target) {
+    int c;
+    switch (kind) {
+    case WAIT_SPIN:
+      while (count != target) {
+      }
+      break;
+    case WAIT_YIELD:
+      for (int i = 0; count != target; ++i)
+        if (i >= SPIN_TRIES)
+          std::this_thread::yield();
+      break;
+    case WAIT_CONDVAR: {
+      std::unique_lock<std::mutex> lk(lock);
+      sleepers++;
+      cv.wait(lk, [&]() { return count == target; });
+      sleepers--;
+      break;
+    }
+    case WAIT_FUTEX:
+      while ((c = count) != target) {
+        sleepers++;
+        if (count == c)
+          futex_wait(count, c);
+        sleepers--;
+      }
+      break;
+    }
+  }
+};
+
+/**
+ * The queue test has a single lock-based shared queue, and the first
+ * num_producers threads insert into it (producers), while all other threads
+ * remove from it (consumers).
+ *
+ * When a consumer finds the queue empty, it waits according to -w:
+ * - spin: release the lock and immediately try again
+ * - yield: like spin, but after SPIN_TRIES misses in a row, yield the CPU
+ *   before each retry
+ * - condvar: sleep on a condition variable, which producers signal
+ * - futex: sleep on a futex word that producers bump after each push
+ * All threads then wait for the last consumer in the same way.  Spinning can
+ * react fastest, but the CPU time it burns is taken from everyone else, which
+ * really hurts when there are more threads than cores.
+ *
+ * With -k, each lock acquisition moves a batch of items instead of one: a
+ * producer fills a local buffer and pushes all of it at once, and a consumer
+ * pops up to a batch into a local buffer and then processes it without the
+ * lock.  That divides the number of lock round trips by the batch size.
  *
  * @param args The bundle of arguments to the program
  */
 void run_queue_test(arg_t &args) {
+  if (!check_producers(args))
+    return;
+  wait_kind_t kind;
+  if (!parse_wait(args.wait, kind)) {
+    printf("invalid wait strategy %s\n", args.wait.c_str());
+    exit(0);
+  }
+
   // A queue, and the lock that protects it
   std::mutex lock;
   std::queue<int> my_queue;
 
-  // If the consumer threads get ahead of the producer, they may see an empty
+  // For consumers to sleep until the queue isn't empty: a condition variable
+  // for WAIT_CONDVAR, or a futex word (with a count of sleepers, so producers
+  // don't make a system call when nobody is asleep) for WAIT_FUTEX
+  std::condition_variable not_empty;
+  std::atomic<int> pushes(0);
+  std::atomic<int> sleepers(0);
+
+  // If the consumer threads get ahead of the producers, they may see an empty
   // queue, without emptiness indicating that the experiment is over.  An atomic
-  // flag lets us know when we are really done.
-  std::atomic<bool> done(false);
+  // count of finished producers lets us know when we are really done.
+  std::atomic<int> done(0);
 
   // A few counters, for making sure the results are sane
   std::atomic<int64_t> sum(0);
-  std::atomic<int> count(0);
+  wait_count_t count(kind);
+
+  // Wake consumers after a push (or all of them, when production ends)
+  auto wake = [&](bool all) {
+    if (kind == WAIT_CONDVAR) {
+      if (all) {
+        std::lock_guard<std::mutex> sync(lock);
+        not_empty.notify_all();
+      } else {
+        not_empty.notify_one();
+      }
+    } else if (kind == WAIT_FUTEX) {
+      pushes++;
+      if (sleepers > 0)
+        futex_wake(pushes, all ? INT_MAX : 1);
+    }
+  };
+
+  // The producers make num_ints work for each consumer, split among them
+  const int consumers = args.num_threads - args.num_producers;
+  const int total = consumers * args.num_ints;
 
   // note that the workload lambda captures the above variables, so they will be
   // shared by all threads who run the workload
   auto workload = [&](int id) {
-    if (id == 0) {
-      // thread 0 is the producer thread.  It will make num_ints work for each
-      // consumer
-      for (int i = 0; i < (args.num_threads - 1) * args.num_ints; ++i) {
-        std::lock_guard<std::mutex> sync(lock);
-        my_queue.push(i);
+    if (id < args.num_producers) {
+      // threads [0, num_producers) are the producer threads.  Producer `id`
+      // makes every num_producers-th work item, starting at `id`.
+      std::vector<int> buf;
+      for (int i = id; i < total; i += args.num_producers) {
+        buf.push_back(i);
+        if ((int)buf.size() < args.batch && i + args.num_producers < total)
+          continue;
+        {
+          std::lock_guard<std::mutex> sync(lock);
+          for (int v : buf)
+            my_queue.push(v);
+        }
+        buf.clear();
+        wake(false);
       }
       // production is done :)
-      done = true;
+      done++;
+      wake(true);
     }
     // other threads are consumers.  They track how many times they succeed in
     // popping from the queue
     else {
       int64_t my_sum = 0;
       int my_count = 0;
+      int misses = 0;
+      std::vector<int> buf;
       while (true) {
-        std::lock_guard<std::mutex> sync(lock);
-        if (my_queue.empty() && done)
-          break; // NB: implicitly releases lock
-        else if (!my_queue.empty()) {
-          my_sum += my_queue.front();
-          ++my_count;
-          my_queue.pop();
+        // NB: for WAIT_FUTEX, read the futex word before checking the queue,
+        //     so that a push after the check changes it and stops us sleeping
+        int seen = pushes;
+        std::unique_lock<std::mutex> sync(lock);
+        if (!my_queue.empty()) {
+          while (!my_queue.empty() && (int)buf.size() < args.batch) {
+            buf.push_back(my_queue.front());
+            my_queue.pop();
+          }
+          sync.unlock();
+          for (int v : buf)
+            my_sum += v;
+          my_count += buf.size();
+          buf.clear();
+          misses = 0;
+          continue;
+        }
+        if (done == args.num_producers)
+          break;
+        // The queue is empty but we're not done, so wait for a producer
+        if (kind == WAIT_CONDVAR) {
+          not_empty.wait(sync);
+          continue;
+        }
+        sync.unlock();
+        if (kind == WAIT_YIELD && ++misses > SPIN_TRIES) {
+          std::this_thread::yield();
+        } else if (kind == WAIT_FUTEX) {
+          sleepers++;
+          futex_wait(pushes, seen);
+          sleepers--;
         }
-        // if the queue is empty but we're not done, release the lock and loop
-        // around, so that hopefully the consumer can have a chance to do some
-        // creating.
       }
       // The consumer thread is done: print its work, and update global sums
       printf("Thread/Count/Sum = (%d, %d, %ld)\n", id, my_count, my_sum);
       // NB: atomic<int> has thread-safe operator+=
       sum += my_sum;
-      count += my_count;
+      count.add(my_count);
     }
     // Everyone waits until all the work is done
-    while (count != (args.num_threads - 1) * args.num_ints) {
-    }
+    count.wait(total);
     // Producer outputs data that helps us to be sure things were correct
     if (id == 0)
       printf("Total Sum: %ld\n", sum.load());
   };
   run_timed_test(args, workload);
+  printf("Throughput: %.0lf items/second\n", total / samples.back().seconds);
 }
 
-int main(int argc, char **argv) {
-  arg_t args;
-  parse_args(argc, argv, args);
+/**
+ * A bounded, lock-free, multi-producer/multi-consumer queue, as described by
+ * Dmitry Vyukov.  It is a ring of slots, each with a sequence number that says
+ * whose turn it is to use the slot:
+ * - slot i is free for the push at position pos when its sequence is pos
+ * - it is full, for the pop at position pos, when its sequence is pos + 1
+ * A push or pop claims its position with one compare-and-swap on the head
+ * (or tail) counter, and then hands the slot over by bumping its sequence.
+ * So producers never touch the tail, consumers never touch the head, and
+ * threads only contend on a slot when the queue is nearly full or empty.
+ *
+ * NB: each slot gets its own cache line, so that a producer filling one slot
+ *     doesn't slow down a consumer emptying the next one.  The head and tail
+ *     get 128 bytes each, for the same reason as the padded counters above.
+ */
+template <typename T> class mpmc_queue_t {
+  /** A slot in the ring */
+  struct alignas(64) slot_t {
+    /** Whose turn it is to use this slot */
+    std::atomic<size_t> seq;
 
-  // if help was requested, give help, then quit
-  if (args.usage) {
-    usage(argv[0]);
+    /** The value in the slot */
+    T value;
+  };
+
+  /** The ring of slots */
+  std::vector<slot_t> slots;
+
+  /** capacity - 1, for turning positions into slot indices */
+  size_t mask;
+
+  /** The position of the next push */
+  alignas(128) std::atomic<size_t> head;
+
+  /** The position of the next pop */
+  alignas(128) std::atomic<size_t> tail;
+
+public:
+  /**
+   * Construct a queue
+   *
+   * @param capacity The number of slots (rounded up to a power of 2)
+   */
+  explicit mpmc_queue_t(size_t capacity) : head(0), tail(0) {
+    size_t cap = 2;
+    while (cap < capacity)
+      cap *= 2;
+    slots = std::vector<slot_t>(cap);
+    mask = cap - 1;
+    for (size_t i = 0; i < cap; ++i)
+      slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  /**
+   * Try to insert a value
+   *
+   * @return false if the queue is full
+   */
+  bool try_push(const T &v) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (true) {
+      slot_t &s = slots[pos & mask];
+      size_t seq = s.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        // The slot is free: claim the position, or retry with the new head
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          s.value = v;
+          s.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false; // the slot still holds the value from one lap ago
+      } else {
+        pos = head.load(std::memory_order_relaxed); // another push got here
+      }
+    }
+  }
+
+  /**
+   * Try to insert several values with one compare-and-swap.  This only
+   * succeeds when all `n` slots starting at the head are free.
+   *
+   * @param v The values
+   * @param n The number of values (at most the capacity)
+   *
+   * @return false if there is not room for all of them
+   */
+  bool try_push_n(const T *v, size_t n) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (true) {
+      size_t i = 0;
+      intptr_t diff = 0;
+      for (; i < n; ++i) {
+        size_t seq = slots[(pos + i) & mask].seq.load(std::memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)(pos + i);
+        if (diff != 0)
+          break;
+      }
+      if (i == n) {
+        if (head.compare_exchange_weak(pos, pos + n,
+                                       std::memory_order_relaxed)) {
+          for (i = 0; i < n; ++i) {
+            slot_t &s = slots[(pos + i) & mask];
+            s.value = v[i];
+            s.seq.store(pos + i + 1, std::memory_order_release);
+          }
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * Try to remove up to `n` values with one compare-and-swap
+   *
+   * @param v Where to put the values
+   * @param n The most values to remove
+   *
+   * @return the number of values removed (0 if the queue is empty)
+   */
+  size_t try_pop_n(T *v, size_t n) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      // Count the full slots, starting at the tail
+      size_t i = 0;
+      intptr_t diff = 0;
+      for (; i < n; ++i) {
+        size_t seq = slots[(pos + i) & mask].seq.load(std::memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)(pos + i + 1);
+        if (diff != 0)
+          break;
+      }
+      if (i == 0 && diff < 0)
+        return 0;
+      if (i == 0) {
+        pos = tail.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (tail.compare_exchange_weak(pos, pos + i, std::memory_order_relaxed)) {
+        for (size_t j = 0; j < i; ++j) {
+          slot_t &s = slots[(pos + j) & mask];
+          v[j] = s.value;
+          s.seq.store(pos + j + mask + 1, std::memory_order_release);
+        }
+        return i;
+      }
+    }
+  }
+
+  /**
+   * Try to remove a value
+   *
+   * @return false if the queue is empty
+   */
+  bool try_pop(T &v) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      slot_t &s = slots[pos & mask];
+      size_t seq = s.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          v = s.value;
+          // NB: the slot is free again for the push one lap from now
+          s.seq.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false; // the slot hasn't been filled yet
+      } else {
+        pos = tail.load(std::memory_order_relaxed); // another pop got here
+      }
+    }
+  }
+};
+
+/**
+ * A bounded, lock-free, single-producer/single-consumer queue.  With only one
+ * thread on each end, there's no need for compare-and-swap: the producer is
+ * the only writer of head, and the consumer is the only writer of tail.  Each
+ * side also keeps a private copy of the other side's counter, and only
+ * re-reads the shared one when its copy says the queue is full (or empty), so
+ * most operations touch no shared cache line except the slot itself.
+ */
+template <typename T> class spsc_queue_t {
+  /** The ring of values */
+  std::vector<T> buf;
+
+  /** capacity - 1, for turning positions into indices */
+  size_t mask;
+
+  /** The position of the next push (written only by the producer) */
+  alignas(128) std::atomic<size_t> head;
+
+  /** The producer's copy of tail */
+  size_t cached_tail = 0;
+
+  /** The position of the next pop (written only by the consumer) */
+  alignas(128) std::atomic<size_t> tail;
+
+  /** The consumer's copy of head */
+  size_t cached_head = 0;
+
+public:
+  /**
+   * Construct a queue
+   *
+   * @param capacity The number of slots (rounded up to a power of 2)
+   */
+  explicit spsc_queue_t(size_t capacity) : head(0), tail(0) {
+    size_t cap = 2;
+    while (cap < capacity)
+      cap *= 2;
+    buf.resize(cap);
+    mask = cap - 1;
+  }
+
+  /**
+   * Try to insert a value (only call this from the producer)
+   *
+   * @return false if the queue is full
+   */
+  bool try_push(const T &v) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - cached_tail > mask) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      if (h - cached_tail > mask)
+        return false;
+    }
+    buf[h & mask] = v;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Try to remove a value (only call this from the consumer)
+   *
+   * @return false if the queue is empty
+   */
+  bool try_pop(T &v) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == cached_head) {
+      cached_head = head.load(std::memory_order_acquire);
+      if (t == cached_head)
+        return false;
+    }
+    v = buf[t & mask];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+/**
+ * The mpmc test is like the queue test, but with a lock-free bounded queue.
+ * When a push finds the queue full, or a pop finds it empty, the thread yields
+ * the CPU and tries again.  With -k, every push and pop moves a batch of
+ * items with one compare-and-swap.
+ *
+ * @param args The bundle of arguments to the program
+ */
+void run_mpmc_test(arg_t &args) {
+  if (!check_producers(args))
+    return;
+  mpmc_queue_t<int> my_queue(args.capacity);
+  std::atomic<int> done(0);
+  std::atomic<int64_t> sum(0);
+  std::atomic<int> count(0);
+  const int consumers = args.num_threads - args.num_producers;
+  const int total = consumers * args.num_ints;
+
+  auto workload = [&](int id) {
+    std::vector<int> buf(args.batch);
+    if (id < args.num_producers) {
+      size_t n = 0;
+      for (int i = id; i < total; i += args.num_producers) {
+        buf[n++] = i;
+        if ((int)n < args.batch && i + args.num_producers < total)
+          continue;
+        while (!my_queue.try_push_n(buf.data(), n))
+          std::this_thread::yield();
+        n = 0;
+      }
+      done++;
+    } else {
+      int64_t my_sum = 0;
+      int my_count = 0;
+      while (true) {
+        // NB: every push finished before `done` was incremented, so if the
+        //     queue is empty after we see `done`, it will stay empty
+        bool finished = done == args.num_producers;
+        size_t n = my_queue.try_pop_n(buf.data(), args.batch);
+        if (n == 0) {
+          if (finished)
+            break;
+          std::this_thread::yield();
+          continue;
+        }
+        for (size_t j = 0; j < n; ++j)
+          my_sum += buf[j];
+        my_count += n;
+      }
+      printf("Thread/Count/Sum = (%d, %d, %ld)\n", id, my_count, my_sum);
+      sum += my_sum;
+      count += my_count;
+    }
+    while (count != total) {
+    }
+    if (id == 0)
+      printf("Total Sum: %ld\n", sum.load());
+  };
+  run_timed_test(args, workload);
+}
+
+/**
+ * The spsc test gives every (producer, consumer) pair its own
+ * single-producer/single-consumer queue.  Each producer deals its work items
+ * out to the consumers round-robin, skipping any consumer whose queue is full,
+ * and each consumer polls the queues from all of the producers.  Nothing is
+ * shared by more than two threads.
+ *
+ * @param args The bundle of arguments to the program
+ */
+void run_spsc_test(arg_t &args) {
+  if (!check_producers(args))
+    return;
+  const int producers = args.num_producers;
+  const int consumers = args.num_threads - producers;
+  const int total = consumers * args.num_ints;
+
+  // queues[p * consumers + c] goes from producer p to consumer c
+  std::vector<std::unique_ptr<spsc_queue_t<int>>> queues;
+  for (int i = 0; i < producers * consumers; ++i)
+    queues.emplace_back(new spsc_queue_t<int>(args.capacity));
+  std::atomic<int> done(0);
+  std::atomic<int64_t> sum(0);
+  std::atomic<int> count(0);
+
+  auto workload = [&](int id) {
+    if (id < producers) {
+      int next = 0;
+      for (int i = id; i < total; i += producers) {
+        while (!queues[id * consumers + next]->try_push(i)) {
+          // NB: only yield after every consumer's queue turned out to be full
+          if (++next == consumers) {
+            next = 0;
+            std::this_thread::yield();
+          }
+        }
+        if (++next == consumers)
+          next = 0;
+      }
+      done++;
+    } else {
+      int c = id - producers;
+      int64_t my_sum = 0;
+      int my_count = 0;
+      int v;
+      while (true) {
+        // Check `done` before polling, so that a full pass that finds every
+        // queue empty after all producers finished means we are done
+        bool finished = done == producers;
+        bool got = false;
+        for (int p = 0; p < producers; ++p) {
+          while (queues[p * consumers + c]->try_pop(v)) {
+            my_sum += v;
+            ++my_count;
+            got = true;
+          }
+        }
+        if (!got) {
+          if (finished)
+            break;
+          std::this_thread::yield();
+        }
+      }
+      printf("Thread/Count/Sum = (%d, %d, %ld)\n", id, my_count, my_sum);
+      sum += my_sum;
+      count += my_count;
+    }
+    while (count != total) {
+    }
+    if (id == 0)
+      printf("Total Sum: %ld\n", sum.load());
+  };
+  run_timed_test(args, workload);
+}
+
+/**
+ * A Chase-Lev work-stealing deque, with the C11 memory orderings from Lê et al.
+ * (PPoPP 2013).  The owner pushes and pops at the bottom, like a stack, so it
+ * works on the newest (smallest, most cache-warm) task.  Thieves take from the
+ * top, so they get the oldest task, which in fork-join code is usually the
+ * biggest.  The owner only pays for a compare-and-swap when it is down to the
+ * last task, and might be racing with a thief for it.
+ *
+ * NB: the buffer has a fixed size, and push() reports when it is full.  Callers
+ *     can just run the task themselves in that case.
+ */
+template <typename T> class ws_deque_t {
+  /** The ring of tasks */
+  std::vector<std::atomic<T>> buf;
+
+  /** capacity - 1, for turning positions into indices */
+  int64_t mask;
+
+  /** The oldest task's position (advanced by thieves, and by the last pop) */
+  alignas(128) std::atomic<int64_t> top;
+
+  /** One past the newest task's position (written only by the owner) */
+  alignas(128) std::atomic<int64_t> bottom;
+
+public:
+  /**
+   * Construct a deque
+   *
+   * @param capacity The number of slots (rounded up to a power of 2)
+   */
+  explicit ws_deque_t(size_t capacity) : top(0), bottom(0) {
+    size_t cap = 2;
+    while (cap < capacity)
+      cap *= 2;
+    buf = std::vector<std::atomic<T>>(cap);
+    mask = cap - 1;
+  }
+
+  /**
+   * Add a task at the bottom (only call this from the owner)
+   *
+   * @return false if the deque is full
+   */
+  bool push(T x) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    if (b - t > mask)
+      return false;
+    buf[b & mask].store(x, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * Take the newest task (only call this from the owner)
+   *
+   * @return the task, or nullptr if the deque is empty
+   */
+  T pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    // NB: the thieves must see the smaller bottom before we read top, or we
+    //     could both take the last task
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T x = buf[b & mask].load(std::memory_order_relaxed);
+    if (t == b) {
+      // Last task: whoever moves top first gets it
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed))
+        x = nullptr;
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return x;
+  }
+
+  /**
+   * Take the oldest task (any thread may call this)
+   *
+   * @return the task, or nullptr if the deque was empty or we lost a race
+   */
+  T steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b)
+      return nullptr;
+    T x = buf[t & mask].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed))
+      return nullptr;
+    return x;
+  }
+};
+
+/**
+ * A task_group_t counts the tasks that were spawned into it and haven't
+ * finished yet, so that the spawner can wait for them (a "join")
+ */
+struct task_group_t {
+  /** The number of unfinished tasks */
+  std::atomic<int> pending{0};
+};
+
+/**
+ * A persistent pool of threads that share work by stealing.  Each worker has a
+ * Chase-Lev deque.  spawn() puts a task on the caller's own deque, and a worker
+ * with nothing to do steals from a random victim.  wait() doesn't block: it
+ * runs tasks (its own first, then stolen ones) until the group is done, so a
+ * worker that is joining on its children can run those children itself.
+ *
+ * The thread that constructs the pool is worker 0, and must be the only
+ * thread outside of the pool that calls spawn() or wait().  The other workers
+ * live until the pool is destroyed, and sleep on a condition variable when
+ * there are no tasks anywhere, so an idle pool costs nothing.
+ */
+class ws_pool_t {
+  /** A spawned task, and the group to notify when it finishes */
+  struct task_t {
+    /** The code to run */
+    std::function<void()> fn;
+
+    /** The group to which the task belongs */
+    task_group_t *group;
+  };
+
+  /** Per-worker state, padded so that workers don't share cache lines */
+  struct alignas(128) worker_t {
+    /** This worker's tasks */
+    ws_deque_t<task_t *> deque{4096};
+
+    /** The number of tasks this worker ran */
+    std::atomic<uint64_t> executed{0};
+
+    /** The number of those tasks that it stole from another worker */
+    std::atomic<uint64_t> steals{0};
+
+    /** The state of the xorshift generator for choosing victims */
+    uint64_t rng;
+  };
+
+  /** The workers' state */
+  std::vector<std::unique_ptr<worker_t>> workers;
+
+  /** The threads for workers 1..n-1 */
+  std::vector<std::thread> threads;
+
+  /** The CPUs to pin workers to (worker i gets cpus[i % size]), or empty */
+  std::vector<int> cpus;
+
+  /** The caller's affinity before the pool pinned it, to restore at the end */
+  cpu_set_t saved_affinity;
+
+  /** The number of spawned tasks that haven't finished */
+  std::atomic<int> outstanding{0};
+
+  /** Set when the pool is shutting down */
+  std::atomic<bool> stop{false};
+
+  /** Idle workers sleep on this, while there are no outstanding tasks */
+  std::mutex idle_lock;
+  std::condition_variable idle_cv;
+
+  /** The index of the calling thread's worker, or -1 for other threads */
+  static inline thread_local int me = -1;
+
+  /**
+   * Find a task for worker `id`: its own newest task, or else a task stolen
+   * from a few randomly chosen victims
+   */
+  task_t *find_task(int id) {
+    worker_t &w = *workers[id];
+    task_t *t = w.deque.pop();
+    if (t != nullptr)
+      return t;
+    int n = workers.size();
+    for (int attempt = 0; attempt < 2 * n && n > 1; ++attempt) {
+      w.rng ^= w.rng << 13;
+      w.rng ^= w.rng >> 7;
+      w.rng ^= w.rng << 17;
+      int victim = w.rng % n;
+      if (victim == id)
+        continue;
+      t = workers[victim]->deque.steal();
+      if (t != nullptr) {
+        w.steals.fetch_add(1, std::memory_order_relaxed);
+        return t;
+      }
+    }
+    return nullptr;
+  }
+
+  /** Run a task on worker `id`, and then report that it finished */
+  void execute(int id, task_t *t) {
+    t->fn();
+    t->group->pending.fetch_sub(1, std::memory_order_release);
+    workers[id]->executed.fetch_add(1, std::memory_order_relaxed);
+    delete t;
+    outstanding.fetch_sub(1, std::memory_order_release);
+  }
+
+  /** The main loop of workers 1..n-1 */
+  void worker_loop(int id) {
+    me = id;
+    if (!cpus.empty())
+      pin_to_cpu(cpus[id % cpus.size()]);
+    while (true) {
+      task_t *t = find_task(id);
+      if (t != nullptr) {
+        execute(id, t);
+        continue;
+      }
+      if (outstanding.load(std::memory_order_acquire) > 0) {
+        // There is work somewhere, but we couldn't steal it this time
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lk(idle_lock);
+      idle_cv.wait(lk, [&]() { return outstanding > 0 || stop; });
+      if (stop)
+        return;
+    }
+  }
+
+public:
+  /**
+   * Construct a pool, and make the calling thread its worker 0
+   *
+   * @param num_threads The number of workers, including the caller
+   * @param cpus        The CPUs to pin the workers to (from cpu_order()), or
+   *                    empty to leave them unpinned.  The caller is pinned
+   *                    too, until the pool is destroyed.
+   */
+  explicit ws_pool_t(int num_threads, const std::vector<int> &cpus = {})
+      : cpus(cpus) {
+    for (int i = 0; i < num_threads; ++i) {
+      workers.emplace_back(new worker_t());
+      workers[i]->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+    }
+    me = 0;
+    if (!cpus.empty()) {
+      sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity);
+      pin_to_cpu(cpus[0]);
+    }
+    for (int i = 1; i < num_threads; ++i)
+      threads.emplace_back(&ws_pool_t::worker_loop, this, i);
+  }
+
+  /** Shut down the pool, once all of its tasks have finished */
+  ~ws_pool_t() {
+    {
+      std::lock_guard<std::mutex> lk(idle_lock);
+      stop = true;
+    }
+    idle_cv.notify_all();
+    for (auto &th : threads)
+      th.join();
+    me = -1;
+    if (!cpus.empty() &&
+        sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity) != 0)
+      perror("sched_setaffinity");
+  }
+
+  /** Return the number of workers */
+  int size() { return workers.size(); }
+
+  /**
+   * Spawn a task into a group.  It will run on this worker or a thief.
+   *
+   * @param group The group to which the task belongs
+   * @param fn    The task
+   */
+  void spawn(task_group_t &group, std::function<void()> fn) {
+    task_t *t = new task_t{std::move(fn), &group};
+    group.pending.fetch_add(1, std::memory_order_relaxed);
+    if (outstanding.fetch_add(1, std::memory_order_acq_rel) == 0) {
+      // NB: taking the lock means an idle worker is either already asleep (and
+      //     will get the notification) or hasn't checked `outstanding` yet
+      std::lock_guard<std::mutex> lk(idle_lock);
+      idle_cv.notify_all();
+    }
+    if (!workers[me]->deque.push(t))
+      execute(me, t);
+  }
+
+  /**
+   * Run tasks until every task in a group has finished
+   *
+   * @param group The group to wait for
+   */
+  void wait(task_group_t &group) {
+    while (group.pending.load(std::memory_order_acquire) > 0) {
+      task_t *t = find_task(me);
+      if (t != nullptr)
+        execute(me, t);
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  /** Print how many tasks each worker ran, and how many it stole */
+  void report() {
+    for (size_t i = 0; i < workers.size(); ++i)
+      printf("Worker/Tasks/Steals = (%zu, %lu, %lu)\n", i,
+             workers[i]->executed.load(), workers[i]->steals.load());
+  }
+};
+
+/** A cheap, high-quality hash of a 64-bit value (SplitMix64's finalizer) */
+uint64_t mix64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+/** The most children that a node in the task tree can have */
+const int MAX_CHILDREN = 4;
+
+/**
+ * Return the number of children of a node in the irregular task tree.  The
+ * top two levels always branch fully, and below that a node has 0 to 4
+ * children (2 on average), so some subtrees die out right away while others
+ * go all the way down.
+ */
+int tree_children(uint64_t id, int depth, arg_t &args) {
+  if (depth >= args.depth)
     return 0;
+  if (depth < 2)
+    return MAX_CHILDREN;
+  return mix64(id) % (MAX_CHILDREN + 1);
+}
+
+/** Return the id of the kth child of node `id` */
+uint64_t tree_child(uint64_t id, int k) { return mix64(id * 8 + k + 1); }
+
+/**
+ * Do the work of one node of the task tree: a random number (averaging
+ * num_ints) of rounds of hashing.  The result lets us check that every node
+ * ran exactly once, no matter who ran it.
+ */
+uint64_t tree_work(uint64_t id, arg_t &args) {
+  int cost = 1 + mix64(id ^ 0x5bd1e995) % (2 * args.num_ints);
+  uint64_t x = id;
+  for (int i = 0; i < cost; ++i)
+    x = mix64(x);
+  return x;
+}
+
+/**
+ * Visit a subtree on the calling thread, and return its checksum
+ *
+ * @param nodes Incremented once for every node in the subtree
+ */
+uint64_t tree_visit(uint64_t id, int depth, arg_t &args, uint64_t &nodes) {
+  uint64_t sum = tree_work(id, args);
+  ++nodes;
+  int n = tree_children(id, depth, args);
+  for (int k = 0; k < n; ++k)
+    sum += tree_visit(tree_child(id, k), depth + 1, args, nodes);
+  return sum;
+}
+
+/**
+ * Visit a subtree with fork-join on the pool: spawn all but one child, visit
+ * the last child directly, and then join on the rest
+ */
+uint64_t tree_visit_parallel(ws_pool_t &pool, uint64_t id, int depth,
+                             arg_t &args) {
+  int n = tree_children(id, depth, args);
+  uint64_t results[MAX_CHILDREN] = {0};
+  task_group_t group;
+  for (int k = 0; k + 1 < n; ++k)
+    pool.spawn(group, [&, k]() {
+      results[k] = tree_visit_parallel(pool, tree_child(id, k), depth + 1, args);
+    });
+  uint64_t sum = tree_work(id, args);
+  if (n > 0)
+    results[n - 1] = tree_visit_parallel(pool, tree_child(id, n - 1),
+                                         depth + 1, args);
+  pool.wait(group);
+  for (int k = 0; k < n; ++k)
+    sum += results[k];
+  return sum;
+}
+
+/**
+ * The steal test runs an irregular tree of tasks, whose subtrees have wildly
+ * different sizes, in two ways:
+ * - Static partitioning: expand the top of the tree until there is a subtree
+ *   for every thread, deal the subtrees out round-robin, and let each thread
+ *   visit its subtrees on its own.  The thread with the biggest subtrees
+ *   determines the time.
+ * - Work stealing: recursive fork-join on a ws_pool_t.  Idle workers steal
+ *   from busy ones, so the load balances itself.
+ * Both should produce the same checksum.
+ *
+ * @param args The bundle of arguments to the program
+ */
+void run_steal_test(arg_t &args) {
+  using namespace std::chrono;
+  const uint64_t root = 1;
+
+  // Find the frontier for static partitioning, breadth-first.  The nodes above
+  // it are "interior", and thread 0 does their work.
+  struct node_t {
+    uint64_t id;
+    int depth;
+  };
+  std::vector<node_t> frontier{{root, 0}}, interior;
+  while ((int)frontier.size() < args.num_threads) {
+    std::vector<node_t> next;
+    for (auto &nd : frontier) {
+      int n = tree_children(nd.id, nd.depth, args);
+      for (int k = 0; k < n; ++k)
+        next.push_back({tree_child(nd.id, k), nd.depth + 1});
+      if (n > 0)
+        interior.push_back(nd);
+      else
+        next.push_back(nd); // a leaf stays on the frontier
+    }
+    if (next.size() == frontier.size())
+      break; // only leaves left
+    frontier.swap(next);
+  }
+
+  printf("Static partitioning (%zu subtrees):\n", frontier.size());
+  std::atomic<uint64_t> static_sum(0);
+  auto workload = [&](int id) {
+    uint64_t my_sum = 0, my_nodes = 0;
+    if (id == 0)
+      for (auto &nd : interior)
+        my_sum += tree_work(nd.id, args);
+    for (size_t i = id; i < frontier.size(); i += args.num_threads)
+      my_sum += tree_visit(frontier[i].id, frontier[i].depth, args, my_nodes);
+    // NB: the thread with the most nodes is the one everyone waits for
+    printf("Thread/Nodes = (%d, %lu)\n", id, my_nodes);
+    static_sum += my_sum;
+  };
+  run_timed_test(args, workload, "static");
+  printf("Checksum: %016lx\n", static_sum.load());
+
+  printf("Work stealing:\n");
+  // NB: the counters must be open before the pool's threads are created, so
+  //     that the threads inherit them
+  uint64_t steal_sum;
+  {
+    perf_counters_t counters(args);
+    // NB: pin the pool the same way run_timed_test() pinned the static phase,
+    //     so that the two phases' rows are comparable
+    std::vector<int> cpus;
+    if (args.affinity != "none")
+      cpus = cpu_order(args.affinity);
+    std::unique_ptr<ws_pool_t> pool(new ws_pool_t(args.num_threads, cpus));
+    // NB: the pool's threads already exist, so this only times the work
+    counters.start();
+    double c1 = cpu_time();
+    high_resolution_clock::time_point t1 = high_resolution_clock::now();
+    steal_sum = tree_visit_parallel(*pool, root, 0, args);
+    high_resolution_clock::time_point t2 = high_resolution_clock::now();
+    double c2 = cpu_time();
+    pool->report();
+    // Stop the counters once the workers have exited, so their counts are in
+    pool.reset();
+    counters.stop();
+    duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
+    record_sample("steal", time_span.count(), c2 - c1, counters);
   }
+  printf("Checksum: %016lx\n", steal_sum);
+  if (steal_sum != static_sum)
+    printf("Error: checksums differ\n");
+}
 
-  // Run the appropriate workload
+/**
+ * Run the test for the requested behavior once
+ *
+ * @param args The bundle of arguments to the program
+ *
+ * @return false if the behavior is invalid
+ */
+bool run_behavior(arg_t &args) {
   if (args.behavior == "counter")
     run_counter_test(args);
   else if (args.behavior == "counters")
     run_counters_test(args);
+  else if (args.behavior == "sharded")
+    run_sharded_test(args);
+  else if (args.behavior == "combining")
+    run_combining_test(args);
   else if (args.behavior == "queue")
     run_queue_test(args);
+  else if (args.behavior == "mpmc")
+    run_mpmc_test(args);
+  else if (args.behavior == "spsc")
+    run_spsc_test(args);
+  else if (args.behavior == "steal")
+    run_steal_test(args);
   else
-    printf("invalid behavior parameter %s\n", args.behavior.c_str());
+    return false;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  arg_t args;
+  parse_args(argc, argv, args);
+
+  // if help was requested, give help, then quit
+  if (args.usage) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  // Open the CSV file, and give it a header if it is new
+  FILE *csv = nullptr;
+  if (args.csv_file != "") {
+    csv = fopen(args.csv_file.c_str(), "a+");
+    if (csv == nullptr) {
+      perror(args.csv_file.c_str());
+      exit(0);
+    }
+    // NB: in "a+" mode, reads start at the beginning, and writes always go to
+    //     the end
+    std::string header = csv_header(), existing;
+    int c;
+    while ((c = fgetc(csv)) != EOF && c != '\n')
+      existing += (char)c;
+    if (existing.empty() && c == EOF) {
+      fprintf(csv, "%s\n", header.c_str());
+    } else if (existing != header) {
+      fprintf(stderr, "%s has a different header; not appending to it\n",
+              args.csv_file.c_str());
+      exit(0);
+    }
+  }
+
+  // Run the appropriate workload, for each thread count, as many times as
+  // requested
+  if (args.sweep.empty())
+    args.sweep.push_back(args.num_threads);
+  for (int threads : args.sweep) {
+    args.num_threads = threads;
+    for (int r = 0; r < args.repeats; ++r) {
+      if (!run_behavior(args)) {
+        printf("invalid behavior parameter %s\n", args.behavior.c_str());
+        exit(0);
+      }
+    }
+    report_samples(args, csv);
+  }
+  if (csv != nullptr)
+    fclose(csv);
 }
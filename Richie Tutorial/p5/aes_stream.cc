@@ -0,0 +1,206 @@
+/**
+ * aes_stream.cc
+ *
+ * The AES streaming code that crypto_aes and crypto_rsa share.  See
+ * aes_stream.h.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <openssl/err.h>
+#include <vector>
+
+#include "aes_stream.h"
+
+/**
+ * Take an input file and run the AES algorithm on it to produce an output file.
+ * This can be used for either encryption or decryption, depending on how ctx is
+ * configured.
+ *
+ * @param ctx     A fully-configured symmetric cipher object for managing the
+ *                encryption or decryption
+ * @param in      the file to read
+ * @param out     the file to populate with the result of the AES algorithm
+ * @param bufsize the number of bytes to read and crypt at a time
+ *
+ * @return true on success, false on any error
+ */
+bool aes_crypt(EVP_CIPHER_CTX *ctx, FILE *in, FILE *out, size_t bufsize) {
+  // figure out the block size that AES is going to use
+  int cipher_block_size = EVP_CIPHER_block_size(EVP_CIPHER_CTX_cipher(ctx));
+
+  // Set up a buffer where AES puts crypted bits.  Since the last block is
+  // special, we need this outside the loop.
+  //
+  // NB: both buffers are allocated once, aligned, and reused for every chunk
+  aligned_buffer_t out_buf(bufsize + cipher_block_size), in_buf(bufsize);
+  int out_len;
+
+  // Read blocks from the file and crypt them:
+  while (true) {
+    // read from file
+    size_t num_bytes_read =
+        fread(in_buf.data, sizeof(unsigned char), bufsize, in);
+    if (ferror(in)) {
+      perror("Error in fread()");
+      return false;
+    }
+    // crypt in_buf into out_buf
+    if (!EVP_CipherUpdate(ctx, out_buf.data, &out_len, in_buf.data,
+                          num_bytes_read)) {
+      fprintf(stderr, "Error in EVP_CipherUpdate: %s\n",
+              ERR_error_string(ERR_get_error(), nullptr));
+      return false;
+    }
+    // write crypted bytes to file
+    fwrite(out_buf.data, sizeof(unsigned char), out_len, out);
+    if (ferror(out)) {
+      perror("Error in fwrite()");
+      return false;
+    }
+    // stop on EOF
+    if (num_bytes_read < bufsize) {
+      break;
+    }
+  }
+
+  // The final block needs special attention!
+  if (!EVP_CipherFinal_ex(ctx, out_buf.data, &out_len)) {
+    fprintf(stderr, "Error in EVP_CipherFinal_ex: %s\n",
+            ERR_error_string(ERR_get_error(), nullptr));
+    return false;
+  }
+  fwrite(out_buf.data, sizeof(unsigned char), out_len, out);
+  if (ferror(out)) {
+    perror("Error in fwrite");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Point a GCM context at the nonce for one chunk of an envelope.  The nonce is
+ * the random base nonce, with the chunk number XORed into its last 8 bytes, so
+ * no two chunks share a nonce, and chunks can't be reordered.
+ *
+ * @param ctx     A GCM context that already has its key
+ * @param base    The base nonce
+ * @param chunk   The chunk number
+ * @param encrypt true to encrypt, false to decrypt
+ * @param final   Is this the last chunk?  This goes in the AAD, so that a
+ *                truncated envelope doesn't verify.
+ *
+ * @return true on success, false on any error
+ */
+static bool gcm_start_chunk(EVP_CIPHER_CTX *ctx, const unsigned char *base,
+                     uint64_t chunk, bool encrypt, bool final) {
+  unsigned char nonce[GCM_IV_SIZE];
+  memcpy(nonce, base, GCM_IV_SIZE);
+  for (int i = 0; i < 8; ++i)
+    nonce[GCM_IV_SIZE - 1 - i] ^= (unsigned char)(chunk >> (8 * i));
+  unsigned char aad = final ? 1 : 0;
+  int len;
+  return EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, nonce, encrypt) &&
+         EVP_CipherUpdate(ctx, nullptr, &len, &aad, 1);
+}
+
+/**
+ * Seal a file with AES-GCM, in large chunks, writing the result to another
+ * file.  Each chunk of chunk_size bytes of plaintext becomes the same
+ * number of bytes of ciphertext, followed by its GCM tag.  The last chunk is
+ * shorter than chunk_size (it's empty if the input size is a multiple
+ * of chunk_size).
+ *
+ * @param ctx        A GCM context that already has its key
+ * @param base       The base nonce (GCM_IV_SIZE bytes)
+ * @param in         The file to read
+ * @param out        The file to populate with the sealed chunks
+ * @param chunk_size The number of bytes of plaintext in each chunk
+ *
+ * @return true on success, false on any error
+ */
+bool gcm_seal_stream(EVP_CIPHER_CTX *ctx, const unsigned char *base, FILE *in,
+                     FILE *out, size_t chunk_size) {
+  std::vector<unsigned char> in_buf(chunk_size),
+      out_buf(chunk_size + GCM_TAG_SIZE);
+  for (uint64_t chunk = 0;; ++chunk) {
+    size_t bytes = fread(in_buf.data(), 1, in_buf.size(), in);
+    if (ferror(in)) {
+      perror("Error in fread()");
+      return false;
+    }
+    bool final = bytes < in_buf.size();
+    int out_len, final_len;
+    if (!gcm_start_chunk(ctx, base, chunk, true, final) ||
+        !EVP_CipherUpdate(ctx, out_buf.data(), &out_len, in_buf.data(),
+                          bytes) ||
+        !EVP_CipherFinal_ex(ctx, out_buf.data() + out_len, &final_len) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, GCM_TAG_SIZE,
+                             out_buf.data() + bytes)) {
+      fprintf(stderr, "Error sealing chunk %lu: %s\n", (unsigned long)chunk,
+              ERR_error_string(ERR_get_error(), nullptr));
+      return false;
+    }
+    if (fwrite(out_buf.data(), 1, bytes + GCM_TAG_SIZE, out) !=
+        bytes + GCM_TAG_SIZE) {
+      perror("Error in fwrite()");
+      return false;
+    }
+    if (final)
+      return true;
+  }
+}
+
+/**
+ * Open a stream produced by gcm_seal_stream(), writing the plaintext to
+ * another file.  Each chunk's tag is checked before any of its plaintext is
+ * written, so nothing unauthenticated ever reaches the output.
+ *
+ * NB: if a later chunk fails, the chunks before it have already been written.
+ *     They are authentic, but the output is incomplete, so the caller must
+ *     treat a false return as "discard the output".
+ *
+ * @param ctx        A GCM context that already has its key
+ * @param base       The base nonce (GCM_IV_SIZE bytes)
+ * @param in         The file to read
+ * @param out        The file to populate with the plaintext
+ * @param chunk_size The chunk size that the stream was sealed with
+ *
+ * @return true on success, false on any error or authentication failure
+ */
+bool gcm_open_stream(EVP_CIPHER_CTX *ctx, const unsigned char *base, FILE *in,
+                     FILE *out, size_t chunk_size) {
+  std::vector<unsigned char> in_buf(chunk_size + GCM_TAG_SIZE),
+      out_buf(chunk_size);
+  for (uint64_t chunk = 0;; ++chunk) {
+    size_t bytes = fread(in_buf.data(), 1, in_buf.size(), in);
+    if (ferror(in)) {
+      perror("Error in fread()");
+      return false;
+    }
+    if (bytes < GCM_TAG_SIZE) {
+      fprintf(stderr, "Envelope is truncated at chunk %lu\n",
+              (unsigned long)chunk);
+      return false;
+    }
+    bool final = bytes < in_buf.size();
+    size_t ct_len = bytes - GCM_TAG_SIZE;
+    int out_len, final_len;
+    if (!gcm_start_chunk(ctx, base, chunk, false, final) ||
+        !EVP_CipherUpdate(ctx, out_buf.data(), &out_len, in_buf.data(),
+                          ct_len) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, GCM_TAG_SIZE,
+                             in_buf.data() + ct_len) ||
+        !EVP_CipherFinal_ex(ctx, out_buf.data() + out_len, &final_len)) {
+      fprintf(stderr, "Envelope chunk %lu failed authentication\n",
+              (unsigned long)chunk);
+      return false;
+    }
+    if (fwrite(out_buf.data(), 1, ct_len, out) != ct_len) {
+      perror("Error in fwrite()");
+      return false;
+    }
+    if (final)
+      return true;
+  }
+}
@@ -0,0 +1,72 @@
+/**
+ * aes_stream.h
+ *
+ * The AES streaming code that crypto_aes and crypto_rsa share: a plain
+ * chunked stream through any EVP cipher (CBC, in crypto_aes), and a chunked,
+ * authenticated AES-GCM stream (for crypto_rsa's envelopes).
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <openssl/evp.h>
+
+/** alignment of I/O buffers (a page, which is what the kernel copies in) */
+const size_t BUF_ALIGN = 4096;
+
+/** size of the GCM nonce */
+const int GCM_IV_SIZE = 12;
+
+/** size of the GCM tag that follows each chunk of a GCM stream */
+const int GCM_TAG_SIZE = 16;
+
+/**
+ * A page-aligned buffer that is allocated once and reused.  Unlike a
+ * variable-length array on the stack, it can be megabytes in size, and its
+ * alignment lets the kernel copy whole pages in and out of it.
+ */
+struct aligned_buffer_t {
+  /** The memory, or nullptr if allocation failed */
+  unsigned char *data;
+
+  /** The size of the buffer */
+  size_t size;
+
+  /** Allocate `size` bytes (rounded up to a multiple of BUF_ALIGN) */
+  explicit aligned_buffer_t(size_t size)
+      : data((unsigned char *)aligned_alloc(
+            BUF_ALIGN, (size + BUF_ALIGN - 1) / BUF_ALIGN * BUF_ALIGN)),
+        size(size) {
+    if (data == nullptr) {
+      perror("Error in aligned_alloc()");
+      exit(0);
+    }
+  }
+
+  /** Free the memory */
+  ~aligned_buffer_t() { free(data); }
+
+  aligned_buffer_t(const aligned_buffer_t &) = delete;
+  aligned_buffer_t &operator=(const aligned_buffer_t &) = delete;
+};
+
+/**
+ * Run a file through AES (encrypting or decrypting, depending on how ctx is
+ * configured), `bufsize` bytes at a time, writing the result to another file
+ */
+bool aes_crypt(EVP_CIPHER_CTX *ctx, FILE *in, FILE *out, size_t bufsize);
+
+/**
+ * Seal a file with AES-GCM, in chunks of `chunk_size` bytes, each followed by
+ * its tag.  `base` is the GCM_IV_SIZE-byte base nonce.
+ */
+bool gcm_seal_stream(EVP_CIPHER_CTX *ctx, const unsigned char *base, FILE *in,
+                     FILE *out, size_t chunk_size);
+
+/**
+ * Open a stream made by gcm_seal_stream().  No chunk's plaintext is written
+ * until its tag has been checked.
+ */
+bool gcm_open_stream(EVP_CIPHER_CTX *ctx, const unsigned char *base, FILE *in,
+                     FILE *out, size_t chunk_size);
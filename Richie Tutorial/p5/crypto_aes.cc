@@ -8,18 +8,43 @@
  * briefly, and discard them.  This demo saves an AES key to a file so that we
  * can convince ourselves that the program works, but in general, saving AES
  * keys is a bad practice.
+ *
+ * By default, we use AES-256 in CBC mode, where each block's encryption depends
+ * on the previous block, so it can only use one core.  In CTR mode, each block
+ * is encrypted independently (block i is XORed with the encryption of IV + i),
+ * so we can split the file into segments and encrypt them on many threads.
+ *
+ * NB: a CTR keystream must never be reused: XORing two ciphertexts made with
+ *     the same key and counter gives the XOR of the two plaintexts.  So CTR
+ *     mode ignores the IV in the key file.  Each encryption makes a fresh
+ *     random counter block, and stores it in a small header at the start of
+ *     the output, where decryption reads it back.
+ *
+ * With -M, the input file is memory-mapped (instead of read in 1KB chunks),
+ * each call to OpenSSL crypts megabytes at a time, and the output is written
+ * with large pwrite() calls.
  */
 
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
+#include <fcntl.h>
+#include <memory>
 #include <openssl/aes.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
+
+#include "aes_stream.h"
 
 /** size of AES key */
 const int AES_256_KEY_SIZE = 32;
@@ -30,6 +55,18 @@ const int BLOCK_SIZE = 16;
 /** chunk size for reading/writing from files */
 const int BUFSIZE = 1024;
 
+/** magic string at the start of a CTR-mode file */
+const char CTR_MAGIC[8] = {'A', 'E', 'S', 'C', 'T', 'R', '1', '\0'};
+
+/** size of a CTR-mode file's header: the magic, then the initial counter */
+const off_t CTR_HEADER_SIZE = sizeof(CTR_MAGIC) + BLOCK_SIZE;
+
+/** size of the pieces of the file that CTR-mode threads work on */
+const size_t SEGMENT_SIZE = 16 << 20;
+
+/** default chunk size for the large-block (-M) path */
+const size_t BIG_BUFSIZE = 8 << 20;
+
 /**
  * Display a help message to explain how the command-line parameters for this
  * program work
@@ -45,6 +82,12 @@ void usage(char *progname) {
   printf("  -d          Decrypt from input to output using key\n");
   printf("  -e          Encrypt from input to output using key\n");
   printf("  -g          Generate a key file\n");
+  printf("  -m [string] Cipher mode: cbc (default) or ctr (random nonce in a\n");
+  printf("              header on the output)\n");
+  printf("  -t [int]    Number of threads for ctr mode (default 1)\n");
+  printf("  -M          Use mmap() input and large pwrite() output\n");
+  printf("  -c [int]    Chunk size in bytes for -M (default 8MB)\n");
+  printf("  -B          Report throughput in GB/s\n");
   printf("  -h       Print help (this message)\n");
 }
 
@@ -68,6 +111,21 @@ struct arg_t {
   /** Should we generate a key? */
   bool generate = false;
 
+  /** The cipher mode (cbc or ctr) */
+  std::string mode = "cbc";
+
+  /** The number of threads to use in ctr mode */
+  int threads = 1;
+
+  /** Should we use memory-mapped input and large-block output? */
+  bool mapped = false;
+
+  /** The chunk size for the large-block path */
+  size_t chunk = BIG_BUFSIZE;
+
+  /** Should we report throughput? */
+  bool bench = false;
+
   /** Display a usage message? */
   bool usage = false;
 };
@@ -82,7 +140,7 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "k:i:o:degh")) != -1) {
+  while ((opt = getopt(argc, argv, "k:i:o:degm:t:Mc:Bh")) != -1) {
     switch (opt) {
     case 'k':
       args.keyfile = std::string(optarg);
@@ -102,6 +160,21 @@ void parse_args(int argc, char **argv, arg_t &args) {
     case 'g':
       args.generate = true;
       break;
+    case 'm':
+      args.mode = std::string(optarg);
+      break;
+    case 't':
+      args.threads = atoi(optarg);
+      break;
+    case 'M':
+      args.mapped = true;
+      break;
+    case 'c':
+      args.chunk = atoi(optarg);
+      break;
+    case 'B':
+      args.bench = true;
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -139,30 +212,43 @@ void generate_aes_key_file(std::string keyfile) {
 }
 
 /**
- * Produce an AES context that can be used for encrypting or decrypting.  Set
- * the AES key from the provided file.
+ * Read an AES key and initialization vector from a file
  *
  * @param keyfile The name of the file holding the AES key
- * @param encrypt true if the context will be used to encrypt, false otherwise
- *
- * @return A properly configured AES context
+ * @param key     Where to put the key (AES_256_KEY_SIZE bytes)
+ * @param iv      Where to put the iv (BLOCK_SIZE bytes)
  */
-EVP_CIPHER_CTX *get_aes_context(std::string keyfile, bool encrypt) {
+void read_aes_key_file(std::string keyfile, unsigned char *key,
+                       unsigned char *iv) {
   // Open the key file and read the key and iv
   FILE *file = fopen(keyfile.c_str(), "rb");
   if (!file) {
     perror("Error opening keyfile");
     exit(0);
   }
-  unsigned char key[AES_256_KEY_SIZE], iv[BLOCK_SIZE];
-  int num_read = fread(key, sizeof(unsigned char), sizeof(key), file);
-  num_read += fread(iv, sizeof(unsigned char), sizeof(iv), file);
+  int num_read = fread(key, sizeof(unsigned char), AES_256_KEY_SIZE, file);
+  num_read += fread(iv, sizeof(unsigned char), BLOCK_SIZE, file);
   fclose(file);
   if (num_read != AES_256_KEY_SIZE + BLOCK_SIZE) {
     fprintf(stderr, "Error reading keyfile");
     exit(0);
   }
+}
 
+/**
+ * Produce an AES context that can be used for encrypting or decrypting, from a
+ * key and iv that are already in memory.
+ *
+ * @param cipher  The cipher to use, e.g., EVP_aes_256_cbc()
+ * @param key     The AES key
+ * @param iv      The initialization vector
+ * @param encrypt true if the context will be used to encrypt, false otherwise
+ *
+ * @return A properly configured AES context
+ */
+EVP_CIPHER_CTX *make_aes_context(const EVP_CIPHER *cipher,
+                                 const unsigned char *key,
+                                 const unsigned char *iv, bool encrypt) {
   // create and initialize a context for the AES operations we are going to do
   EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
   if (ctx == nullptr) {
@@ -172,8 +258,7 @@ EVP_CIPHER_CTX *get_aes_context(std::string keyfile, bool encrypt) {
   }
 
   // Make sure the key and iv lengths we have up above are valid
-  if (!EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), nullptr, nullptr, nullptr,
-                         1)) {
+  if (!EVP_CipherInit_ex(ctx, cipher, nullptr, nullptr, nullptr, 1)) {
     fprintf(stderr, "Error: OpenSSL couldn't initialize context: %s\n",
             ERR_error_string(ERR_get_error(), nullptr));
     exit(0);
@@ -194,63 +279,294 @@ EVP_CIPHER_CTX *get_aes_context(std::string keyfile, bool encrypt) {
 }
 
 /**
- * Take an input file and run the AES algorithm on it to produce an output file.
- * This can be used for either encryption or decryption, depending on how ctx is
- * configured.
+ * Produce an AES context that can be used for encrypting or decrypting.  Set
+ * the AES key from the provided file.
+ *
+ * @param keyfile The name of the file holding the AES key
+ * @param encrypt true if the context will be used to encrypt, false otherwise
  *
- * @param ctx A fully-configured symmetric cipher object for managing the
- *            encryption or decryption
- * @param in  the file to read
- * @param out the file to populate with the result of the AES algorithm
+ * @return A properly configured AES context
  */
-bool aes_crypt(EVP_CIPHER_CTX *ctx, FILE *in, FILE *out) {
-  // figure out the block size that AES is going to use
+EVP_CIPHER_CTX *get_aes_context(std::string keyfile, bool encrypt) {
+  unsigned char key[AES_256_KEY_SIZE], iv[BLOCK_SIZE];
+  read_aes_key_file(keyfile, key, iv);
+  return make_aes_context(EVP_aes_256_cbc(), key, iv, encrypt);
+}
+
+/**
+ * A read-only memory mapping of an entire file.  If the file can't be mapped
+ * (for example, it is empty, or it is a pipe), `data` is nullptr.
+ */
+struct mapped_file_t {
+  /** The start of the mapping */
+  const unsigned char *data = nullptr;
+
+  /** The size of the file */
+  size_t size = 0;
+
+  /** Map the file open on `fd` */
+  explicit mapped_file_t(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+      return;
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      return;
+    // NB: we read the file front to back, once, so tell the kernel to read
+    //     ahead aggressively and not bother keeping pages we're done with
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    data = (const unsigned char *)p;
+    size = st.st_size;
+  }
+
+  /** Unmap the file */
+  ~mapped_file_t() {
+    if (data != nullptr)
+      munmap((void *)data, size);
+  }
+
+  mapped_file_t(const mapped_file_t &) = delete;
+  mapped_file_t &operator=(const mapped_file_t &) = delete;
+};
+
+/**
+ * Write an entire buffer at a given offset of a file
+ *
+ * @param fd  The file to write to
+ * @param buf The data to write
+ * @param len The number of bytes to write
+ * @param off The offset in the file at which to write
+ *
+ * @return true on success, false on error
+ */
+bool pwrite_all(int fd, const unsigned char *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t bytes = pwrite(fd, buf, len, off);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Error in pwrite()");
+      return false;
+    }
+    buf += bytes;
+    len -= bytes;
+    off += bytes;
+  }
+  return true;
+}
+
+/**
+ * Like aes_crypt(), but built for throughput: each EVP_CipherUpdate() covers
+ * `chunk` bytes (megabytes, not one kilobyte), and each result is written with
+ * one large pwrite().  The input is memory-mapped if possible, so it is crypted
+ * straight out of the page cache.  Otherwise (e.g., the input is a pipe) it is
+ * read into a large aligned buffer, with a hint that we'll read sequentially.
+ *
+ * @param ctx    A fully-configured symmetric cipher object for managing the
+ *               encryption or decryption
+ * @param in_fd  the file to read
+ * @param out_fd the file to populate with the result of the AES algorithm
+ * @param chunk  the number of bytes to crypt per call into OpenSSL
+ *
+ * @return The number of bytes written, or -1 on error
+ */
+off_t aes_crypt_mapped(EVP_CIPHER_CTX *ctx, int in_fd, int out_fd,
+                       size_t chunk) {
   int cipher_block_size = EVP_CIPHER_block_size(EVP_CIPHER_CTX_cipher(ctx));
+  aligned_buffer_t out_buf(chunk + cipher_block_size);
+  mapped_file_t map(in_fd);
+  std::unique_ptr<aligned_buffer_t> in_buf;
+  if (map.data == nullptr) {
+    in_buf.reset(new aligned_buffer_t(chunk));
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
 
-  // Set up a buffer where AES puts crypted bits.  Since the last block is
-  // special, we need this outside the loop.
-  unsigned char out_buf[BUFSIZE + cipher_block_size];
+  off_t in_off = 0, out_off = 0;
   int out_len;
-
-  // Read blocks from the file and crypt them:
   while (true) {
-    // read from file
-    unsigned char in_buf[BUFSIZE];
-    int num_bytes_read = fread(in_buf, sizeof(unsigned char), BUFSIZE, in);
-    if (ferror(in)) {
-      perror("Error in fread()");
-      return false;
+    // Find the next chunk of input, either in the mapping or by reading it
+    const unsigned char *src;
+    ssize_t len;
+    if (map.data != nullptr) {
+      src = map.data + in_off;
+      len = std::min(chunk, map.size - in_off);
+    } else {
+      src = in_buf->data;
+      len = read(in_fd, in_buf->data, chunk);
+      if (len < 0) {
+        if (errno == EINTR)
+          continue;
+        perror("Error in read()");
+        return -1;
+      }
     }
-    // crypt in_buf into out_buf
-    if (!EVP_CipherUpdate(ctx, out_buf, &out_len, in_buf, num_bytes_read)) {
+    if (len == 0)
+      break;
+    in_off += len;
+
+    if (!EVP_CipherUpdate(ctx, out_buf.data, &out_len, src, len)) {
       fprintf(stderr, "Error in EVP_CipherUpdate: %s\n",
               ERR_error_string(ERR_get_error(), nullptr));
-      return false;
-    }
-    // write crypted bytes to file
-    fwrite(out_buf, sizeof(unsigned char), out_len, out);
-    if (ferror(out)) {
-      perror("Error in fwrite()");
-      return false;
-    }
-    // stop on EOF
-    if (num_bytes_read < BUFSIZE) {
-      break;
+      return -1;
     }
+    if (!pwrite_all(out_fd, out_buf.data, out_len, out_off))
+      return -1;
+    out_off += out_len;
   }
 
   // The final block needs special attention!
-  if (!EVP_CipherFinal_ex(ctx, out_buf, &out_len)) {
+  if (!EVP_CipherFinal_ex(ctx, out_buf.data, &out_len)) {
     fprintf(stderr, "Error in EVP_CipherFinal_ex: %s\n",
             ERR_error_string(ERR_get_error(), nullptr));
+    return -1;
+  }
+  if (!pwrite_all(out_fd, out_buf.data, out_len, out_off))
+    return -1;
+  return out_off + out_len;
+}
+
+/**
+ * Add a number of blocks to a CTR-mode counter.  OpenSSL treats the 16-byte IV
+ * as one big-endian 128-bit number, and adds one for each block, so the block
+ * at byte offset `off` of the file is encrypted with counter IV + off/16.
+ *
+ * @param iv     The counter to advance (BLOCK_SIZE bytes)
+ * @param blocks The number of blocks to add
+ */
+void ctr_add(unsigned char *iv, uint64_t blocks) {
+  for (int i = BLOCK_SIZE - 1; i >= 0 && blocks; --i) {
+    uint64_t sum = iv[i] + (blocks & 0xff);
+    iv[i] = sum & 0xff;
+    blocks = (blocks >> 8) + (sum >> 8);
+  }
+}
+
+/**
+ * Encrypt or decrypt a file with AES-256-CTR, using several threads.  The file
+ * is split into SEGMENT_SIZE pieces, and each thread repeatedly claims the next
+ * piece, reads it with pread(), crypts it with a counter that starts at the
+ * right offset, and writes it to the same offset of the output with pwrite().
+ * The output is exactly what a single thread would produce.
+ *
+ * NB: CTR mode has no padding, so the output is the same size as the input,
+ *     and encryption and decryption are the same operation.
+ *
+ * @param key         The AES key
+ * @param iv          The initial counter
+ * @param in_fd       The file to read
+ * @param in_base     The offset in the input where the data starts
+ * @param out_fd      The file to populate with the result of the AES algorithm
+ * @param out_base    The offset in the output where the result starts
+ * @param num_threads The number of threads to use
+ * @param mapped      Should threads crypt straight from a mapping of the
+ *                    input, instead of pread()ing it?
+ *
+ * @return true on success, false on any error
+ */
+bool aes_ctr_parallel(const unsigned char *key, const unsigned char *iv,
+                      int in_fd, off_t in_base, int out_fd, off_t out_base,
+                      int num_threads, bool mapped) {
+  off_t size = lseek(in_fd, 0, SEEK_END);
+  if (size < in_base) {
+    perror("Error in lseek()");
     return false;
   }
-  fwrite(out_buf, sizeof(unsigned char), out_len, out);
-  if (ferror(out)) {
-    perror("Error in fwrite");
+  size -= in_base;
+  std::unique_ptr<mapped_file_t> map;
+  if (mapped)
+    map.reset(new mapped_file_t(in_fd));
+  // NB: mapped_file_t leaves data null if the file couldn't be mapped, and then
+  //     we fall back to pread()
+  const unsigned char *src_base =
+      (map && map->data) ? map->data + in_base : nullptr;
+  size_t num_segments = (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+  std::atomic<size_t> next_segment(0);
+  std::atomic<bool> ok(true);
+
+  auto worker = [&]() {
+    // Each thread has its own context and buffers, so threads share nothing
+    // but the segment counter
+    EVP_CIPHER_CTX *ctx = make_aes_context(EVP_aes_256_ctr(), key, iv, true);
+    aligned_buffer_t in_buf(src_base ? 0 : SEGMENT_SIZE),
+        out_buf(SEGMENT_SIZE);
+    size_t seg;
+    while (ok && (seg = next_segment++) < num_segments) {
+      off_t off = seg * SEGMENT_SIZE;
+      size_t len = std::min((off_t)SEGMENT_SIZE, size - off);
+      const unsigned char *src = src_base ? src_base + off : in_buf.data;
+      if (!src_base &&
+          pread(in_fd, in_buf.data, len, in_base + off) != (ssize_t)len) {
+        perror("Error in pread()");
+        ok = false;
+        break;
+      }
+      // Start this segment's counter at IV + (offset / block size)
+      unsigned char seg_iv[BLOCK_SIZE];
+      memcpy(seg_iv, iv, BLOCK_SIZE);
+      ctr_add(seg_iv, off / BLOCK_SIZE);
+      int out_len;
+      if (!EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, seg_iv, -1) ||
+          !EVP_CipherUpdate(ctx, out_buf.data, &out_len, src, len)) {
+        fprintf(stderr, "Error in EVP_CipherUpdate: %s\n",
+                ERR_error_string(ERR_get_error(), nullptr));
+        ok = false;
+        break;
+      }
+      if (!pwrite_all(out_fd, out_buf.data, out_len, out_base + off)) {
+        ok = false;
+        break;
+      }
+    }
+    EVP_CIPHER_CTX_free(ctx);
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::max(1, num_threads); ++i)
+    threads.emplace_back(worker);
+  for (auto &t : threads)
+    t.join();
+  return ok;
+}
+
+/**
+ * Encrypt or decrypt a file in CTR mode.  Encryption makes a random initial
+ * counter and writes it, after CTR_MAGIC, as the output's header.  Decryption
+ * reads the counter back from the input's header.
+ *
+ * @param keyfile     The file holding the AES key (its IV is not used)
+ * @param encrypt     true to encrypt, false to decrypt
+ * @param in_fd       The file to read
+ * @param out_fd      The file to write
+ * @param num_threads The number of threads to use
+ * @param mapped      Should threads crypt from a mapping of the input?
+ *
+ * @return true on success, false on any error
+ */
+bool aes_ctr_file(const std::string &keyfile, bool encrypt, int in_fd,
+                  int out_fd, int num_threads, bool mapped) {
+  unsigned char key[AES_256_KEY_SIZE], unused_iv[BLOCK_SIZE], iv[BLOCK_SIZE];
+  read_aes_key_file(keyfile, key, unused_iv);
+  unsigned char header[CTR_HEADER_SIZE];
+  if (encrypt) {
+    if (!RAND_bytes(iv, BLOCK_SIZE)) {
+      fprintf(stderr, "Error in RAND_bytes()\n");
+      return false;
+    }
+    memcpy(header, CTR_MAGIC, sizeof(CTR_MAGIC));
+    memcpy(header + sizeof(CTR_MAGIC), iv, BLOCK_SIZE);
+    if (!pwrite_all(out_fd, header, CTR_HEADER_SIZE, 0))
+      return false;
+    return aes_ctr_parallel(key, iv, in_fd, 0, out_fd, CTR_HEADER_SIZE,
+                            num_threads, mapped);
+  }
+  if (pread(in_fd, header, CTR_HEADER_SIZE, 0) != CTR_HEADER_SIZE ||
+      memcmp(header, CTR_MAGIC, sizeof(CTR_MAGIC)) != 0) {
+    fprintf(stderr, "Input is not a CTR-mode file\n");
     return false;
   }
-  return true;
+  memcpy(iv, header + sizeof(CTR_MAGIC), BLOCK_SIZE);
+  return aes_ctr_parallel(key, iv, in_fd, CTR_HEADER_SIZE, out_fd, 0,
+                          num_threads, mapped);
 }
 
 int main(int argc, char **argv) {
@@ -269,6 +585,11 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  if (args.mode != "cbc" && args.mode != "ctr") {
+    fprintf(stderr, "Unknown mode %s\n", args.mode.c_str());
+    return 0;
+  }
+
   // Get the AES key from the file, and make an AES encryption context suitable
   // for either encryption or decryption
   EVP_CIPHER_CTX *ctx = get_aes_context(args.keyfile, args.encrypt);
@@ -289,10 +610,31 @@ int main(int argc, char **argv) {
 
   // Do the encryption or decryption.  Since it's symmetric, the call is the
   // same :)
-  bool res = aes_crypt(ctx, infile, outfile);
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  bool res;
+  if (args.mode == "ctr") {
+    res = aes_ctr_file(args.keyfile, args.encrypt, fileno(infile),
+                       fileno(outfile), args.threads, args.mapped);
+  } else if (args.mapped) {
+    res = aes_crypt_mapped(ctx, fileno(infile), fileno(outfile),
+                           args.chunk > 0 ? args.chunk : BIG_BUFSIZE) >= 0;
+  } else {
+    res = aes_crypt(ctx, infile, outfile, BUFSIZE);
+  }
   if (!res) {
     fprintf(stderr, "Error calling aes_crypt()");
   }
+  if (args.bench) {
+    // NB: flush stdio's buffer, so the time includes all of the writing
+    fflush(outfile);
+    std::chrono::duration<double> secs =
+        std::chrono::steady_clock::now() - start_time;
+    struct stat st;
+    fstat(fileno(infile), &st);
+    printf("Crypted %ld bytes in %.6f seconds (%.3f GB/s)\n", st.st_size,
+           secs.count(), st.st_size / secs.count() / 1e9);
+  }
   fclose(infile);
   fclose(outfile);
   EVP_CIPHER_CTX_cleanup(ctx);
@@ -0,0 +1,488 @@
+/**
+ * crypto_bench.cc
+ *
+ * Crypto_bench measures the cost of the choices that crypto_aes and crypto_rsa
+ * hard-code: which symmetric cipher to use, how big a buffer to hand to
+ * OpenSSL on each call, how many threads to use, and how big an RSA key to
+ * use.
+ *
+ * Each symmetric test encrypts one buffer per "message" (re-keying the IV,
+ * calling EVP_EncryptUpdate once, finishing, and fetching the tag for AEAD
+ * ciphers) over and over, on every thread, for a fixed amount of time.  Each
+ * RSA test repeats one operation (sign, verify, encrypt, or decrypt) on every
+ * thread.  Every thread has its own context, so threads never share OpenSSL
+ * state.
+ *
+ * The output is CSV, one row per test, so that results from two OpenSSL builds
+ * or two machines can be compared with a script (or a spreadsheet).
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/** size of the largest key used by any of the symmetric ciphers */
+const int MAX_KEY_SIZE = 32;
+
+/** size of the largest IV used by any of the symmetric ciphers */
+const int MAX_IV_SIZE = 16;
+
+/** size of the authentication tag for AEAD ciphers */
+const int TAG_SIZE = 16;
+
+/**
+ * Display a help message to explain how the command-line parameters for this
+ * program work
+ *
+ * @progname The name of the program
+ */
+void usage(char *progname) {
+  printf("%s: Benchmark symmetric ciphers and RSA.\n", basename(progname));
+  printf("  -c [list]   Comma-separated ciphers (default "
+         "cbc,ctr,gcm,chacha20-poly1305)\n");
+  printf("  -s [list]   Comma-separated buffer sizes in bytes (default 1KB to "
+         "16MB, x4)\n");
+  printf("  -t [list]   Comma-separated thread counts (default 1 and #cores)\n");
+  printf("  -r [list]   Comma-separated RSA key sizes (default "
+         "2048,3072,4096)\n");
+  printf("  -d [float]  Seconds to run each test (default 0.25)\n");
+  printf("  -S          Skip symmetric cipher tests\n");
+  printf("  -R          Skip RSA tests\n");
+  printf("  -h          Print help (this message)\n");
+}
+
+/** arg_t is used to store the command-line arguments of the program */
+struct arg_t {
+  /** The symmetric ciphers to test */
+  std::vector<std::string> ciphers = {"cbc", "ctr", "gcm", "chacha20-poly1305"};
+
+  /** The buffer sizes to test */
+  std::vector<long> sizes = {1 << 10,  1 << 12,  1 << 14,  1 << 16,
+                             1 << 18,  1 << 20,  1 << 22,  1 << 24};
+
+  /** The thread counts to test */
+  std::vector<long> threads;
+
+  /** The RSA key sizes to test */
+  std::vector<long> rsa_bits = {2048, 3072, 4096};
+
+  /** How long to run each test */
+  double duration = 0.25;
+
+  /** Should we skip the symmetric tests? */
+  bool skip_symmetric = false;
+
+  /** Should we skip the RSA tests? */
+  bool skip_rsa = false;
+
+  /** Display a usage message? */
+  bool usage = false;
+};
+
+/**
+ * Split a comma-separated list into its parts
+ *
+ * @param list The string to split
+ *
+ * @return A vector with one entry per comma-separated part
+ */
+std::vector<std::string> split_list(const char *list) {
+  std::vector<std::string> res;
+  std::string cur;
+  for (const char *c = list; *c; ++c) {
+    if (*c == ',') {
+      res.push_back(cur);
+      cur.clear();
+    } else {
+      cur += *c;
+    }
+  }
+  res.push_back(cur);
+  return res;
+}
+
+/**
+ * Split a comma-separated list of integers into a vector
+ *
+ * @param list The string to split
+ *
+ * @return A vector with one integer per comma-separated part
+ */
+std::vector<long> split_int_list(const char *list) {
+  std::vector<long> res;
+  for (auto &s : split_list(list)) {
+    res.push_back(atol(s.c_str()));
+  }
+  return res;
+}
+
+/**
+ * Parse the command-line arguments, and use them to populate the provided args
+ * object.
+ *
+ * @param argc The number of command-line arguments passed to the program
+ * @param argv The list of command-line arguments
+ * @param args The struct into which the parsed args should go
+ */
+void parse_args(int argc, char **argv, arg_t &args) {
+  long opt;
+  while ((opt = getopt(argc, argv, "c:s:t:r:d:SRh")) != -1) {
+    switch (opt) {
+    case 'c':
+      args.ciphers = split_list(optarg);
+      break;
+    case 's':
+      args.sizes = split_int_list(optarg);
+      break;
+    case 't':
+      args.threads = split_int_list(optarg);
+      break;
+    case 'r':
+      args.rsa_bits = split_int_list(optarg);
+      break;
+    case 'd':
+      args.duration = atof(optarg);
+      break;
+    case 'S':
+      args.skip_symmetric = true;
+      break;
+    case 'R':
+      args.skip_rsa = true;
+      break;
+    case 'h':
+      args.usage = true;
+      break;
+    }
+  }
+  // By default, test one thread and one thread per core
+  if (args.threads.empty()) {
+    args.threads.push_back(1);
+    long cores = std::thread::hardware_concurrency();
+    if (cores > 1) {
+      args.threads.push_back(cores);
+    }
+  }
+}
+
+/**
+ * Print an error message and exit the program
+ *
+ * @param msg The message to display
+ */
+void print_error_and_exit(const char *msg) {
+  fprintf(stderr, "%s: %s\n", msg, ERR_error_string(ERR_get_error(), nullptr));
+  exit(0);
+}
+
+/**
+ * Map one of our cipher names to an OpenSSL cipher
+ *
+ * @param name The name of the cipher
+ *
+ * @return The cipher, or nullptr if the name is not recognized
+ */
+const EVP_CIPHER *lookup_cipher(const std::string &name) {
+  if (name == "cbc")
+    return EVP_aes_256_cbc();
+  if (name == "ctr")
+    return EVP_aes_256_ctr();
+  if (name == "gcm")
+    return EVP_aes_256_gcm();
+  if (name == "chacha20-poly1305")
+    return EVP_chacha20_poly1305();
+  return nullptr;
+}
+
+/**
+ * Run `body` on `num_threads` threads until `duration` seconds have passed.
+ * `body` is called repeatedly, and returns the number of operations (or
+ * bytes) that it completed.  Each thread constructs its own state by calling
+ * `make_state` once, so no OpenSSL objects are shared.
+ *
+ * @param num_threads The number of threads to run
+ * @param duration    The number of seconds to run for
+ * @param make_state  A function that makes a thread's state
+ * @param body        A function that does some work using a thread's state
+ * @param secs        The elapsed wall-clock time, as an out parameter
+ *
+ * @return The total count returned by every call to `body` on every thread
+ */
+template <typename MakeState, typename Body>
+uint64_t run_threads(int num_threads, double duration, MakeState make_state,
+                     Body body, double &secs) {
+  std::atomic<uint64_t> total(0);
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> workers;
+  std::chrono::steady_clock::time_point start_time;
+  for (int t = 0; t < num_threads; ++t) {
+    workers.emplace_back([&]() {
+      auto state = make_state();
+      // NB: don't start the clock until every thread has built its state
+      ready++;
+      while (!go) {
+        std::this_thread::yield();
+      }
+      std::chrono::steady_clock::time_point deadline =
+          start_time + std::chrono::duration_cast<
+                           std::chrono::steady_clock::duration>(
+                           std::chrono::duration<double>(duration));
+      uint64_t count = 0;
+      do {
+        count += body(state);
+      } while (std::chrono::steady_clock::now() < deadline);
+      total += count;
+    });
+  }
+  while (ready < num_threads) {
+    std::this_thread::yield();
+  }
+  start_time = std::chrono::steady_clock::now();
+  go = true;
+  for (auto &t : workers) {
+    t.join();
+  }
+  secs = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start_time)
+             .count();
+  return total;
+}
+
+/** The per-thread state for a symmetric cipher test */
+struct cipher_state_t {
+  /** The cipher context, initialized with a key */
+  EVP_CIPHER_CTX *ctx;
+
+  /** The plaintext */
+  std::vector<unsigned char> in;
+
+  /** The ciphertext */
+  std::vector<unsigned char> out;
+
+  /** The IV that gets re-applied for each message */
+  unsigned char iv[MAX_IV_SIZE];
+};
+
+/**
+ * Measure the encryption throughput of a symmetric cipher
+ *
+ * @param name        The name of the cipher
+ * @param size        The number of bytes to encrypt per message
+ * @param num_threads The number of threads to use
+ * @param duration    How long to run the test
+ */
+void bench_cipher(const std::string &name, long size, int num_threads,
+                  double duration) {
+  const EVP_CIPHER *cipher = lookup_cipher(name);
+  if (cipher == nullptr) {
+    fprintf(stderr, "Unknown cipher %s\n", name.c_str());
+    return;
+  }
+  bool aead = EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER;
+  int block = EVP_CIPHER_block_size(cipher);
+
+  auto make_state = [&]() {
+    std::shared_ptr<cipher_state_t> s(new cipher_state_t, [](cipher_state_t *s) {
+      EVP_CIPHER_CTX_free(s->ctx);
+      delete s;
+    });
+    unsigned char key[MAX_KEY_SIZE];
+    s->in.resize(size);
+    s->out.resize(size + block);
+    s->ctx = EVP_CIPHER_CTX_new();
+    if (s->ctx == nullptr || !RAND_bytes(key, sizeof(key)) ||
+        !RAND_bytes(s->iv, sizeof(s->iv)) ||
+        !RAND_bytes(s->in.data(), s->in.size()) ||
+        !EVP_EncryptInit_ex(s->ctx, cipher, nullptr, key, s->iv)) {
+      print_error_and_exit("Error setting up cipher");
+    }
+    return s;
+  };
+  auto body = [&](std::shared_ptr<cipher_state_t> &s) -> uint64_t {
+    int len, fin;
+    unsigned char tag[TAG_SIZE];
+    // NB: a NULL cipher and key keep the expanded key schedule, so this just
+    //     resets the IV (and the AEAD state) for the next message
+    if (!EVP_EncryptInit_ex(s->ctx, nullptr, nullptr, nullptr, s->iv) ||
+        !EVP_EncryptUpdate(s->ctx, s->out.data(), &len, s->in.data(), size) ||
+        !EVP_EncryptFinal_ex(s->ctx, s->out.data() + len, &fin) ||
+        (aead && !EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_AEAD_GET_TAG, TAG_SIZE,
+                                      tag))) {
+      print_error_and_exit("Error encrypting");
+    }
+    return size;
+  };
+  double secs;
+  uint64_t bytes = run_threads(num_threads, duration, make_state, body, secs);
+  printf("cipher,%s,%ld,%d,%lu,%.6f,%.2f,%.1f\n", name.c_str(), size,
+         num_threads, bytes, secs, bytes / secs / 1e6, bytes / size / secs);
+}
+
+/** The RSA operations we benchmark */
+enum class rsa_op_t { SIGN, VERIFY, ENCRYPT, DECRYPT };
+
+/** The per-thread state for an RSA test */
+struct rsa_state_t {
+  /** The key context, initialized for one operation */
+  EVP_PKEY_CTX *ctx;
+
+  /** The input to the operation */
+  std::vector<unsigned char> in;
+
+  /** The output of the operation */
+  std::vector<unsigned char> out;
+};
+
+/**
+ * Measure the rate of an RSA operation
+ *
+ * @param key         The RSA key
+ * @param bits        The size of the key
+ * @param op          The operation to measure
+ * @param num_threads The number of threads to use
+ * @param duration    How long to run the test
+ */
+void bench_rsa(EVP_PKEY *key, long bits, rsa_op_t op, int num_threads,
+               double duration) {
+  const char *names[] = {"sign", "verify", "encrypt", "decrypt"};
+  const char *name = names[(int)op];
+
+  // Make the inputs once: a SHA-256 digest to sign, its signature to verify,
+  // a 32-byte message (like an AES key) to encrypt, and its ciphertext
+  unsigned char digest[32], msg[32];
+  RAND_bytes(digest, sizeof(digest));
+  RAND_bytes(msg, sizeof(msg));
+  std::vector<unsigned char> sig(bits / 8), enc(bits / 8);
+  {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, nullptr);
+    size_t sig_len = sig.size(), enc_len = enc.size();
+    if (ctx == nullptr || 1 != EVP_PKEY_sign_init(ctx) ||
+        1 != EVP_PKEY_CTX_set_signature_md(ctx, EVP_sha256()) ||
+        1 != EVP_PKEY_sign(ctx, sig.data(), &sig_len, digest, sizeof(digest)) ||
+        1 != EVP_PKEY_encrypt_init(ctx) ||
+        1 != EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) ||
+        1 != EVP_PKEY_encrypt(ctx, enc.data(), &enc_len, msg, sizeof(msg))) {
+      print_error_and_exit("Error preparing RSA inputs");
+    }
+    EVP_PKEY_CTX_free(ctx);
+  }
+
+  auto make_state = [&]() {
+    std::shared_ptr<rsa_state_t> s(new rsa_state_t, [](rsa_state_t *s) {
+      EVP_PKEY_CTX_free(s->ctx);
+      delete s;
+    });
+    s->ctx = EVP_PKEY_CTX_new(key, nullptr);
+    s->out.resize(bits / 8);
+    int rc = s->ctx != nullptr;
+    switch (op) {
+    case rsa_op_t::SIGN:
+      s->in.assign(digest, digest + sizeof(digest));
+      rc = rc && EVP_PKEY_sign_init(s->ctx) == 1 &&
+           EVP_PKEY_CTX_set_signature_md(s->ctx, EVP_sha256()) == 1;
+      break;
+    case rsa_op_t::VERIFY:
+      s->in = sig;
+      s->out.assign(digest, digest + sizeof(digest));
+      rc = rc && EVP_PKEY_verify_init(s->ctx) == 1 &&
+           EVP_PKEY_CTX_set_signature_md(s->ctx, EVP_sha256()) == 1;
+      break;
+    case rsa_op_t::ENCRYPT:
+      s->in.assign(msg, msg + sizeof(msg));
+      rc = rc && EVP_PKEY_encrypt_init(s->ctx) == 1 &&
+           EVP_PKEY_CTX_set_rsa_padding(s->ctx, RSA_PKCS1_OAEP_PADDING) == 1;
+      break;
+    case rsa_op_t::DECRYPT:
+      s->in = enc;
+      rc = rc && EVP_PKEY_decrypt_init(s->ctx) == 1 &&
+           EVP_PKEY_CTX_set_rsa_padding(s->ctx, RSA_PKCS1_OAEP_PADDING) == 1;
+      break;
+    }
+    if (!rc) {
+      print_error_and_exit("Error setting up RSA context");
+    }
+    return s;
+  };
+  auto body = [&](std::shared_ptr<rsa_state_t> &s) -> uint64_t {
+    size_t out_len = s->out.size();
+    int rc = 0;
+    switch (op) {
+    case rsa_op_t::SIGN:
+      rc = EVP_PKEY_sign(s->ctx, s->out.data(), &out_len, s->in.data(),
+                         s->in.size());
+      break;
+    case rsa_op_t::VERIFY:
+      // NB: for verify, `out` holds the digest that was signed
+      rc = EVP_PKEY_verify(s->ctx, s->in.data(), s->in.size(), s->out.data(),
+                           s->out.size());
+      break;
+    case rsa_op_t::ENCRYPT:
+      rc = EVP_PKEY_encrypt(s->ctx, s->out.data(), &out_len, s->in.data(),
+                            s->in.size());
+      break;
+    case rsa_op_t::DECRYPT:
+      rc = EVP_PKEY_decrypt(s->ctx, s->out.data(), &out_len, s->in.data(),
+                            s->in.size());
+      break;
+    }
+    if (rc != 1) {
+      print_error_and_exit("Error in RSA operation");
+    }
+    return 1;
+  };
+  double secs;
+  uint64_t ops = run_threads(num_threads, duration, make_state, body, secs);
+  printf("rsa,%s,%ld,%d,%lu,%.6f,,%.1f\n", name, bits, num_threads, ops, secs,
+         ops / secs);
+}
+
+int main(int argc, char *argv[]) {
+  // Parse the command-line arguments
+  arg_t args;
+  parse_args(argc, argv, args);
+  if (args.usage) {
+    usage(argv[0]);
+    return 0;
+  }
+
+  // NB: "count" is bytes for ciphers and operations for RSA.  "param" is the
+  //     buffer size for ciphers and the key size for RSA.
+  printf("kind,algorithm,param,threads,count,seconds,mb_per_sec,ops_per_sec\n");
+  if (!args.skip_symmetric) {
+    for (auto &c : args.ciphers) {
+      for (long size : args.sizes) {
+        for (long t : args.threads) {
+          bench_cipher(c, size, t, args.duration);
+          fflush(stdout);
+        }
+      }
+    }
+  }
+  if (!args.skip_rsa) {
+    for (long bits : args.rsa_bits) {
+      EVP_PKEY *key = EVP_RSA_gen(bits);
+      if (key == nullptr) {
+        print_error_and_exit("Error in EVP_RSA_gen()");
+      }
+      for (rsa_op_t op : {rsa_op_t::SIGN, rsa_op_t::VERIFY, rsa_op_t::ENCRYPT,
+                          rsa_op_t::DECRYPT}) {
+        for (long t : args.threads) {
+          bench_rsa(key, bits, op, t, args.duration);
+          fflush(stdout);
+        }
+      }
+      EVP_PKEY_free(key);
+    }
+  }
+}
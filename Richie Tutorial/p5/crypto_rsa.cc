@@ -8,17 +8,55 @@
  * key private!  Also, remember that RSA is slow, and often just used to sign a
  * digest or secure the transmission of an AES key that then gets used for the
  * actual encryption/decryption.
+ *
+ * With -x, crypto_rsa does exactly that: it makes a fresh AES key, wraps it
+ * with the RSA public key, and then streams the whole file through AES-GCM.
+ * This "envelope" works for files of any size, and costs just one RSA
+ * operation.  The file is sealed in chunks, each with its own GCM tag, so a
+ * chunk is authenticated before any of its plaintext is written.
+ *
+ * With -B, crypto_rsa processes a whole batch of small messages in one run.
+ * The input is a stream of records, each a 4-byte length (network byte order)
+ * followed by that many bytes, and the output is a stream of records in the
+ * same format and order.  The key is loaded once, and each worker thread
+ * initializes one EVP_PKEY_CTX and reuses it for every message it handles.
  */
 
+#include <arpa/inet.h>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
+#include <vector>
+
+#include "aes_stream.h"
 
 /** size of RSA key */
 const int RSA_KEY_SIZE = 2048;
 
+/** size of AES key for envelope encryption */
+const int AES_256_KEY_SIZE = 32;
+
+/** size of the chunks that get streamed through AES in envelope mode */
+const size_t ENVELOPE_BUFSIZE = 1 << 20;
+
+/** magic number at the start of every envelope file */
+const char ENVELOPE_MAGIC[8] = {'R', 'S', 'A', 'E', 'N', 'V', '2', '\0'};
+
+/**
+ * The largest message that rsa_encrypt() can handle: the key size, less the
+ * PKCS#1 v1.5 padding that EVP_PKEY_encrypt uses by default
+ */
+const int RSA_MAX_MESSAGE = RSA_KEY_SIZE / 8 - RSA_PKCS1_PADDING_SIZE;
+
 /**
  * Display a help message to explain how the command-line parameters for this
  * program work
@@ -35,6 +73,9 @@ void usage(char *progname) {
   printf("  -d          Decrypt from input to output using key\n");
   printf("  -e          Encrypt from input to output using key\n");
   printf("  -g          Generate a key file\n");
+  printf("  -x          Use envelope (RSA-wrapped AES key) mode for -d/-e\n");
+  printf("  -B          Batch mode: -d/-e a stream of length-prefixed records\n");
+  printf("  -t [int]    Number of worker threads for batch mode (default 1)\n");
   printf("  -h       Print help (this message)\n");
 }
 
@@ -61,6 +102,15 @@ struct arg_t {
   /** Should we generate a key? */
   bool generate = false;
 
+  /** Should we use envelope encryption? */
+  bool envelope = false;
+
+  /** Should we process a batch of length-prefixed records? */
+  bool batch = false;
+
+  /** The number of worker threads for batch mode */
+  int threads = 1;
+
   /** Display a usage message? */
   bool usage = false;
 };
@@ -75,7 +125,7 @@ struct arg_t {
  */
 void parse_args(int argc, char **argv, arg_t &args) {
   long opt;
-  while ((opt = getopt(argc, argv, "b:v:i:o:degh")) != -1) {
+  while ((opt = getopt(argc, argv, "b:v:i:o:degxBt:h")) != -1) {
     switch (opt) {
     case 'b':
       args.pub_key_file = std::string(optarg);
@@ -98,6 +148,15 @@ void parse_args(int argc, char **argv, arg_t &args) {
     case 'g':
       args.generate = true;
       break;
+    case 'x':
+      args.envelope = true;
+      break;
+    case 'B':
+      args.batch = true;
+      break;
+    case 't':
+      args.threads = atoi(optarg);
+      break;
     case 'h':
       args.usage = true;
       break;
@@ -209,12 +268,18 @@ EVP_PKEY *load_pri(const char *filename) {
 bool rsa_encrypt(EVP_PKEY *pub, FILE *in, FILE *out) {
   // We're going to assume that the file is small, and read it straight into
   // this buffer:
-  unsigned char msg[RSA_KEY_SIZE / 8] = {0};
+  unsigned char msg[RSA_MAX_MESSAGE] = {0};
   int bytes = fread(msg, 1, sizeof(msg), in);
   if (ferror(in)) {
     perror("Error in fread()");
     return false;
   }
+  // NB: Don't silently drop the rest of a big file.  Envelope mode handles it.
+  if (fgetc(in) != EOF) {
+    fprintf(stderr, "Input is larger than %d bytes; use -x for large files\n",
+            RSA_MAX_MESSAGE);
+    return false;
+  }
 
   // Create an encryption context
   EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(pub, NULL);
@@ -300,6 +365,272 @@ bool rsa_decrypt(EVP_PKEY *pri, FILE *in, FILE *out) {
   return true;
 }
 
+/**
+ * Encrypt a file of any size with a fresh AES-256-GCM key, and wrap that key
+ * with RSA.  The output is:
+ *   - ENVELOPE_MAGIC
+ *   - the length of the wrapped key (4 bytes, network byte order)
+ *   - the wrapped key (AES key followed by base nonce, RSA-OAEP encrypted)
+ *   - the input, sealed in chunks by gcm_seal_stream()
+ *
+ * @param pub The public key
+ * @param in  The file to read
+ * @param out The file to populate with the result of the encryption
+ *
+ * @return true on success, false on any error
+ */
+bool envelope_encrypt(EVP_PKEY *pub, FILE *in, FILE *out) {
+  // Make a one-time AES key and base nonce
+  unsigned char key_iv[AES_256_KEY_SIZE + GCM_IV_SIZE];
+  if (!RAND_bytes(key_iv, sizeof(key_iv))) {
+    fprintf(stderr, "Error in RAND_bytes: %s\n",
+            ERR_error_string(ERR_get_error(), nullptr));
+    return false;
+  }
+
+  // Wrap it with RSA.  This is the only RSA operation for the whole file.
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(pub, NULL);
+  if (pctx == nullptr) {
+    print_error_and_exit(0, "Error calling EVP_PKEY_CTX_new()");
+  }
+  size_t wrapped_len = 0;
+  if (1 != EVP_PKEY_encrypt_init(pctx) ||
+      1 != EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) ||
+      1 != EVP_PKEY_encrypt(pctx, nullptr, &wrapped_len, key_iv,
+                            sizeof(key_iv))) {
+    EVP_PKEY_CTX_free(pctx);
+    print_error_and_exit(0, "Error setting up RSA key wrapping");
+  }
+  std::vector<unsigned char> wrapped(wrapped_len);
+  if (1 != EVP_PKEY_encrypt(pctx, wrapped.data(), &wrapped_len, key_iv,
+                            sizeof(key_iv))) {
+    EVP_PKEY_CTX_free(pctx);
+    print_error_and_exit(0, "Error calling EVP_PKEY_encrypt()");
+  }
+  EVP_PKEY_CTX_free(pctx);
+
+  // Write the header
+  uint32_t len_field = htonl(wrapped_len);
+  if (fwrite(ENVELOPE_MAGIC, 1, sizeof(ENVELOPE_MAGIC), out) !=
+          sizeof(ENVELOPE_MAGIC) ||
+      fwrite(&len_field, 1, sizeof(len_field), out) != sizeof(len_field) ||
+      fwrite(wrapped.data(), 1, wrapped_len, out) != wrapped_len) {
+    perror("Error in fwrite()");
+    return false;
+  }
+
+  // Stream the payload through AES
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if (ctx == nullptr) {
+    print_error_and_exit(0, "Error calling EVP_CIPHER_CTX_new()");
+  }
+  if (!EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key_iv, nullptr,
+                         1)) {
+    EVP_CIPHER_CTX_free(ctx);
+    print_error_and_exit(0, "Error calling EVP_CipherInit_ex()");
+  }
+  bool res =
+      gcm_seal_stream(ctx, key_iv + AES_256_KEY_SIZE, in, out, ENVELOPE_BUFSIZE);
+  OPENSSL_cleanse(key_iv, sizeof(key_iv));
+  EVP_CIPHER_CTX_free(ctx);
+  return res;
+}
+
+/**
+ * Decrypt a file produced by envelope_encrypt().  On a false return, the
+ * output may hold a prefix of the plaintext, and must be discarded.
+ *
+ * @param pri The private key
+ * @param in  The file to read
+ * @param out The file to populate with the result of the decryption
+ *
+ * @return true on success, false on any error
+ */
+bool envelope_decrypt(EVP_PKEY *pri, FILE *in, FILE *out) {
+  // Read and check the header
+  char magic[sizeof(ENVELOPE_MAGIC)];
+  uint32_t len_field;
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+      memcmp(magic, ENVELOPE_MAGIC, sizeof(magic)) != 0 ||
+      fread(&len_field, 1, sizeof(len_field), in) != sizeof(len_field)) {
+    fprintf(stderr, "Input is not an envelope file\n");
+    return false;
+  }
+  size_t wrapped_len = ntohl(len_field);
+  if (wrapped_len == 0 || wrapped_len > 2 * RSA_KEY_SIZE / 8) {
+    fprintf(stderr, "Invalid wrapped key length %zu\n", wrapped_len);
+    return false;
+  }
+  std::vector<unsigned char> wrapped(wrapped_len);
+  if (fread(wrapped.data(), 1, wrapped_len, in) != wrapped_len) {
+    fprintf(stderr, "Truncated envelope header\n");
+    return false;
+  }
+
+  // Unwrap the AES key and IV
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(pri, NULL);
+  if (pctx == nullptr) {
+    print_error_and_exit(0, "Error calling EVP_PKEY_CTX_new()");
+  }
+  size_t key_len = 0;
+  if (1 != EVP_PKEY_decrypt_init(pctx) ||
+      1 != EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) ||
+      1 != EVP_PKEY_decrypt(pctx, nullptr, &key_len, wrapped.data(),
+                            wrapped_len)) {
+    EVP_PKEY_CTX_free(pctx);
+    print_error_and_exit(0, "Error setting up RSA key unwrapping");
+  }
+  std::vector<unsigned char> key_iv(key_len);
+  if (1 != EVP_PKEY_decrypt(pctx, key_iv.data(), &key_len, wrapped.data(),
+                            wrapped_len) ||
+      key_len != AES_256_KEY_SIZE + GCM_IV_SIZE) {
+    EVP_PKEY_CTX_free(pctx);
+    fprintf(stderr, "Error unwrapping AES key: %s\n",
+            ERR_error_string(ERR_get_error(), nullptr));
+    return false;
+  }
+  EVP_PKEY_CTX_free(pctx);
+
+  // Stream the payload through AES
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if (ctx == nullptr) {
+    print_error_and_exit(0, "Error calling EVP_CIPHER_CTX_new()");
+  }
+  if (!EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key_iv.data(),
+                         nullptr, 0)) {
+    EVP_CIPHER_CTX_free(ctx);
+    print_error_and_exit(0, "Error calling EVP_CipherInit_ex()");
+  }
+  bool res = gcm_open_stream(ctx, key_iv.data() + AES_256_KEY_SIZE, in, out,
+                             ENVELOPE_BUFSIZE);
+  OPENSSL_cleanse(key_iv.data(), key_iv.size());
+  EVP_CIPHER_CTX_free(ctx);
+  return res;
+}
+
+/**
+ * Read a stream of length-prefixed records (4-byte length in network byte
+ * order, followed by the bytes of the record)
+ *
+ * @param in      The file to read
+ * @param records The vector into which the records should be put
+ *
+ * @return true on success, false if the stream is malformed
+ */
+bool read_records(FILE *in, std::vector<std::vector<unsigned char>> &records) {
+  uint32_t len_field;
+  while (fread(&len_field, 1, sizeof(len_field), in) == sizeof(len_field)) {
+    size_t len = ntohl(len_field);
+    // NB: every record must fit in one RSA block, so a huge length means the
+    //     stream is garbage
+    if (len > RSA_KEY_SIZE / 8) {
+      fprintf(stderr, "Record %zu is too long (%zu bytes)\n", records.size(),
+              len);
+      return false;
+    }
+    records.emplace_back(len);
+    if (fread(records.back().data(), 1, len, in) != len) {
+      fprintf(stderr, "Record %zu is truncated\n", records.size() - 1);
+      return false;
+    }
+  }
+  if (ferror(in)) {
+    perror("Error in fread()");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Encrypt or decrypt a batch of records with one key.  Each worker thread
+ * makes and initializes a single EVP_PKEY_CTX, and then reuses it for all of
+ * the records it claims, so the per-record cost is just the RSA math.
+ *
+ * @param key         The public key (for encryption) or private key (for
+ *                    decryption)
+ * @param encrypt     true to encrypt, false to decrypt
+ * @param in          The file of length-prefixed records to read
+ * @param out         The file to populate with length-prefixed results
+ * @param num_threads The number of worker threads
+ *
+ * @return true on success, false on any error
+ */
+bool rsa_batch(EVP_PKEY *key, bool encrypt, FILE *in, FILE *out,
+               int num_threads) {
+  std::vector<std::vector<unsigned char>> records;
+  if (!read_records(in, records)) {
+    return false;
+  }
+  std::vector<std::vector<unsigned char>> results(records.size());
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  // Workers claim records from a shared counter
+  std::atomic<size_t> next_record(0);
+  std::atomic<bool> ok(true);
+  auto worker = [&]() {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+    if (ctx == nullptr ||
+        1 != (encrypt ? EVP_PKEY_encrypt_init(ctx)
+                      : EVP_PKEY_decrypt_init(ctx))) {
+      fprintf(stderr, "Error initializing RSA context: %s\n",
+              ERR_error_string(ERR_get_error(), nullptr));
+      EVP_PKEY_CTX_free(ctx);
+      ok = false;
+      return;
+    }
+    size_t i;
+    while (ok && (i = next_record++) < records.size()) {
+      // NB: the output of either operation is never bigger than the key
+      std::vector<unsigned char> &res = results[i];
+      res.resize(RSA_KEY_SIZE / 8);
+      size_t res_len = res.size();
+      int rc = encrypt ? EVP_PKEY_encrypt(ctx, res.data(), &res_len,
+                                          records[i].data(), records[i].size())
+                       : EVP_PKEY_decrypt(ctx, res.data(), &res_len,
+                                          records[i].data(), records[i].size());
+      if (rc != 1) {
+        fprintf(stderr, "Error processing record %zu: %s\n", i,
+                ERR_error_string(ERR_get_error(), nullptr));
+        ok = false;
+        break;
+      }
+      res.resize(res_len);
+    }
+    EVP_PKEY_CTX_free(ctx);
+  };
+
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; ++t) {
+    workers.emplace_back(worker);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  std::chrono::duration<double> secs =
+      std::chrono::steady_clock::now() - start_time;
+  if (!ok) {
+    return false;
+  }
+
+  // Write the results in input order
+  for (auto &res : results) {
+    uint32_t len_field = htonl(res.size());
+    if (fwrite(&len_field, 1, sizeof(len_field), out) != sizeof(len_field) ||
+        fwrite(res.data(), 1, res.size(), out) != res.size()) {
+      perror("Error in fwrite()");
+      return false;
+    }
+  }
+  printf("%zu %s in %.6f seconds with %d thread(s) (%.1f ops/sec)\n",
+         records.size(), encrypt ? "encryptions" : "decryptions", secs.count(),
+         num_threads, records.size() / secs.count());
+  return true;
+}
+
 int main(int argc, char *argv[]) {
   // Parse the command-line arguments
   arg_t args;
@@ -330,15 +661,23 @@ int main(int argc, char *argv[]) {
   if (args.encrypt) {
     printf("Encrypting %s to %s\n", args.infile.c_str(), args.outfile.c_str());
     EVP_PKEY *pub = load_pub(args.pub_key_file.c_str());
-    if (rsa_encrypt(pub, infile, outfile)) {
+    if (args.batch      ? rsa_batch(pub, true, infile, outfile, args.threads)
+        : args.envelope ? envelope_encrypt(pub, infile, outfile)
+                        : rsa_encrypt(pub, infile, outfile)) {
       printf("Success!\n");
     }
     EVP_PKEY_free(pub);
   } else if (args.decrypt) {
     printf("Decrypting %s to %s\n", args.infile.c_str(), args.outfile.c_str());
     EVP_PKEY *pri = load_pri(args.pri_key_file.c_str());
-    if (rsa_decrypt(pri, infile, outfile)) {
+    if (args.batch      ? rsa_batch(pri, false, infile, outfile, args.threads)
+        : args.envelope ? envelope_decrypt(pri, infile, outfile)
+                        : rsa_decrypt(pri, infile, outfile)) {
       printf("Success!\n");
+    } else if (fflush(outfile) != 0 || ftruncate(fileno(outfile), 0) != 0) {
+      // NB: a failed decryption may have written part of the plaintext, so
+      //     don't leave it behind for someone to mistake for the real thing
+      perror("Error discarding output");
     }
     EVP_PKEY_free(pri);
   }